@@ -0,0 +1,257 @@
+// Benchmark harness for the C side of count: generates corpora in a
+// temporary directory, runs them through the same file and counting
+// functions as each FileMode of main.c, and reports throughput and heap
+// allocations.
+//
+// Usage: count_bench [corpus size in MiB]
+
+#include "modules/file/file.h"
+#include "bindings.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+#define SMALL_FILE_COUNT 10000
+#define SMALL_FILE_SIZE 1024
+
+typedef struct Corpus {
+    const char* name;
+    char path[256];
+    size_t length;
+} Corpus;
+
+typedef struct Bench {
+    const char* name;
+    uint64_t (*run)(const char* path);
+} Bench;
+
+static uint8_t stream_buffer[STREAM_BUFFER_SIZE];
+// For files that can't be mapped, which the generated ones always can
+static BufferPool* pool;
+static uint64_t state = 0x2545F4914F6CDD1D;
+static char directory[] = "/tmp/count-bench-XXXXXX";
+
+// Counts every allocation made by C and Rust code alike, when the harness is
+// linked with --wrap for the allocation functions (see CMakeLists.txt).
+static atomic_size_t allocations;
+
+#ifdef COUNT_BENCH_WRAP_MALLOC
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+int __real_posix_memalign(void** ptr, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void** ptr, size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_posix_memalign(ptr, alignment, size);
+}
+#endif
+
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void put_utf8(FILE* file, const uint32_t code_point) {
+    if (code_point < 0x80) {
+        fputc((int) code_point, file);
+    } else if (code_point < 0x800) {
+        fputc(0xC0 | (int) (code_point >> 6), file);
+        fputc(0x80 | (int) (code_point & 0x3F), file);
+    } else {
+        fputc(0xE0 | (int) (code_point >> 12), file);
+        fputc(0x80 | (int) ((code_point >> 6) & 0x3F), file);
+        fputc(0x80 | (int) (code_point & 0x3F), file);
+    }
+}
+
+static void generate(Corpus* corpus, const size_t size) {
+    snprintf(corpus->path, sizeof(corpus->path), "%s/%s.txt", directory, corpus->name);
+    FILE* file = fopen(corpus->path, "wb");
+    if (!file) {
+        printf("Could not create file: '%s'\n", corpus->path);
+        exit(1);
+    }
+    while ((size_t) ftell(file) < size) {
+        const uint64_t random = next_random();
+        if (strcmp(corpus->name, "ascii") == 0) {
+            fputc(random % 64 == 0 ? '\n' : 'a' + (int) (random % 26), file);
+        } else if (strcmp(corpus->name, "cjk") == 0) {
+            put_utf8(file, random % 10 == 0 ? ' ' : 0x4E00 + (uint32_t) (random % 0x5200));
+        } else {
+            fputc((int) (random & 0xFF), file);
+        }
+    }
+    corpus->length = (size_t) ftell(file);
+    fclose(file);
+}
+
+// Many small files, and a CSV manifest listing them
+static void generate_manifest(Corpus* corpus) {
+    snprintf(corpus->path, sizeof(corpus->path), "%s/manifest.csv", directory);
+    FILE* manifest = fopen(corpus->path, "wb");
+    corpus->length = 0;
+    for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/small-%d.txt", directory, i);
+        FILE* file = fopen(path, "wb");
+        for (int j = 0; j < SMALL_FILE_SIZE; j++) {
+            fputc('a' + (int) (next_random() % 26), file);
+        }
+        fclose(file);
+        fprintf(manifest, i == 0 ? "%s" : ",%s", path);
+        corpus->length += SMALL_FILE_SIZE;
+    }
+    fclose(manifest);
+}
+
+static uint64_t run_mapped(const char* path) {
+    File file;
+    file_map(path, pool, &file);
+    const uint64_t result = count_characters_len(file.data, file.length);
+    file_unmap(file);
+    return result;
+}
+
+static uint64_t run_streamed(const char* path) {
+    Counter* counter = counter_new(Command_Characters, Utf8Mode_Raw);
+    FileStream stream;
+    file_stream_open(path, &stream);
+    size_t length;
+    while (file_stream_read(&stream, stream_buffer, STREAM_BUFFER_SIZE, &length) == Status_Ok && length > 0) {
+        counter_feed(counter, stream_buffer, length);
+    }
+    file_stream_close(stream);
+    CountResult result;
+    counter_finish(counter, &result);
+    return result.characters;
+}
+
+// All metrics at once, to compare with the single-metric passes
+static uint64_t run_all(const char* path) {
+    File file;
+    file_map(path, pool, &file);
+    Counter* counter = counter_new(Command_All, Utf8Mode_Raw);
+    counter_feed(counter, file.data, file.length);
+    CountResult result;
+    counter_finish(counter, &result);
+    file_unmap(file);
+    return result.words;
+}
+
+static uint64_t run_parallel(const char* path) {
+    File file;
+    file_map(path, pool, &file);
+    CountResult result;
+    count_parallel(file.data, file.length, Command_Characters, Utf8Mode_Raw, 4, &result);
+    file_unmap(file);
+    return result.characters;
+}
+
+static void add_streamed(const char* filename, const void* ctx_ptr) {
+    *(uint64_t*) ctx_ptr += run_streamed(filename);
+}
+
+static uint64_t run_csv_list(const char* path) {
+    uint64_t result = 0;
+    csv_for_each_value(path, NULL, add_streamed, &result);
+    return result;
+}
+
+static uint64_t run_csv_merged(const char* path) {
+    return csv_count_merged(path, Command_Characters, Utf8Mode_Raw).characters;
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
+static void run(const Bench* bench, const Corpus* corpus) {
+    // One untimed run to warm up the page cache
+    bench->run(corpus->path);
+
+    const size_t allocations_before = atomic_load(&allocations);
+    const double start = now();
+    int iterations = 0;
+    do {
+        bench->run(corpus->path);
+        iterations++;
+    } while (now() - start < 1.0);
+    const double elapsed = now() - start;
+    const size_t allocated = atomic_load(&allocations) - allocations_before;
+
+    printf("%-10s %-8s %8.3f GB/s %10.1f allocations/run\n",
+           bench->name,
+           corpus->name,
+           (double) corpus->length * iterations / elapsed / 1e9,
+           (double) allocated / iterations);
+}
+
+int main(const int argc, const char* argv[]) {
+    const size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) * 1024 * 1024;
+    if (!mkdtemp(directory)) {
+        printf("Could not create directory: '%s'\n", directory);
+        return 1;
+    }
+
+    Corpus corpora[] = { { .name = "ascii" }, { .name = "cjk" }, { .name = "binary" } };
+    const size_t corpus_count = sizeof(corpora) / sizeof(corpora[0]);
+    for (size_t i = 0; i < corpus_count; i++) {
+        generate(&corpora[i], size);
+    }
+    Corpus manifest = { .name = "small" };
+    generate_manifest(&manifest);
+    pool = buffer_pool_new();
+
+    const Bench file_benches[] = {
+            { "mapped", run_mapped },
+            { "streamed", run_streamed },
+            { "parallel", run_parallel },
+            { "all", run_all },
+    };
+    for (size_t i = 0; i < sizeof(file_benches) / sizeof(file_benches[0]); i++) {
+        for (size_t j = 0; j < corpus_count; j++) {
+            run(&file_benches[i], &corpora[j]);
+        }
+    }
+    const Bench csv_list = { "csv-list", run_csv_list };
+    const Bench csv_merged = { "csv-merged", run_csv_merged };
+    run(&csv_list, &manifest);
+    run(&csv_merged, &manifest);
+
+    for (size_t i = 0; i < corpus_count; i++) {
+        remove(corpora[i].path);
+    }
+    for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/small-%d.txt", directory, i);
+        remove(path);
+    }
+    remove(manifest.path);
+    rmdir(directory);
+    buffer_pool_free(pool);
+    return 0;
+}
@@ -0,0 +1,121 @@
+use count::bench::{
+    allocations, count_all, count_characters, count_characters_lossy, count_characters_strict, count_parallel, enable_stats,
+    CountResult, Counter, Utf8Mode,
+};
+use count::Command;
+use criterion::{black_box, BenchmarkId, Criterion, Throughput};
+
+const CORPUS_SIZE: usize = 16 * 1024 * 1024;
+const CHUNK_SIZE: usize = 1024 * 1024;
+
+/// Small xorshift generator, so the corpora are the same on every run.
+struct Random(u64);
+
+impl Random {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+fn ascii_corpus() -> Vec<u8> {
+    let mut random = Random(1);
+    (0..CORPUS_SIZE)
+        .map(|_| match random.next() % 64 {
+            0 => b'\n',
+            1..=9 => b' ',
+            n => b'a' + (n % 26) as u8,
+        })
+        .collect()
+}
+
+fn cjk_corpus() -> Vec<u8> {
+    let mut random = Random(2);
+    let mut corpus = String::with_capacity(CORPUS_SIZE + 4);
+    while corpus.len() < CORPUS_SIZE {
+        if random.next() % 10 == 0 {
+            corpus.push(' ');
+        } else {
+            corpus.push(char::from_u32(0x4E00 + (random.next() % 0x5200) as u32).unwrap());
+        }
+    }
+    corpus.into_bytes()
+}
+
+fn binary_corpus() -> Vec<u8> {
+    let mut random = Random(3);
+    (0..CORPUS_SIZE).map(|_| random.next() as u8).collect()
+}
+
+fn stream(data: &[u8], utf8: Utf8Mode) -> u64 {
+    let mut counter = Counter::new(Command::Characters, utf8);
+    for chunk in data.chunks(CHUNK_SIZE) {
+        counter.feed(chunk).unwrap();
+    }
+    counter.finish().unwrap().characters
+}
+
+fn all(data: &[u8]) -> u64 {
+    let mut result = CountResult::default();
+    count_all(data, &mut result, true);
+    result.words
+}
+
+fn bench_corpora(criterion: &mut Criterion) {
+    let corpora = [("ascii", ascii_corpus()), ("cjk", cjk_corpus()), ("binary", binary_corpus())];
+    let mut group = criterion.benchmark_group("characters");
+    group.throughput(Throughput::Bytes(CORPUS_SIZE as u64));
+    for (name, corpus) in &corpora {
+        let corpus = &corpus[..];
+        group.bench_with_input(BenchmarkId::new("kernel", name), corpus, |b, data| {
+            b.iter(|| count_characters(black_box(data)))
+        });
+        group.bench_with_input(BenchmarkId::new("all", name), corpus, |b, data| {
+            b.iter(|| all(black_box(data)))
+        });
+        group.bench_with_input(BenchmarkId::new("stream", name), corpus, |b, data| {
+            b.iter(|| stream(black_box(data), Utf8Mode::Raw))
+        });
+        group.bench_with_input(BenchmarkId::new("parallel", name), corpus, |b, data| {
+            b.iter(|| count_parallel(black_box(data), Command::Characters, Utf8Mode::Raw, 4).unwrap().characters)
+        });
+        group.bench_with_input(BenchmarkId::new("lossy", name), corpus, |b, data| {
+            b.iter(|| count_characters_lossy(black_box(data)))
+        });
+        group.bench_with_input(BenchmarkId::new("stream-lossy", name), corpus, |b, data| {
+            b.iter(|| stream(black_box(data), Utf8Mode::Lossy))
+        });
+        // Binary data isn't valid UTF-8, so it can't be counted strictly
+        if *name != "binary" {
+            group.bench_with_input(BenchmarkId::new("strict", name), corpus, |b, data| {
+                b.iter(|| count_characters_strict(black_box(data)))
+            });
+            group.bench_with_input(BenchmarkId::new("stream-strict", name), corpus, |b, data| {
+                b.iter(|| stream(black_box(data), Utf8Mode::Strict))
+            });
+        }
+    }
+    group.finish();
+
+    // Allocations are only counted with stats enabled, which the timings
+    // above would include
+    enable_stats(false);
+    println!("\nAllocations per count:");
+    for (name, corpus) in &corpora {
+        let before = allocations();
+        black_box(stream(corpus, Utf8Mode::Raw));
+        let stream_allocations = allocations() - before;
+        let before = allocations();
+        black_box(count_parallel(corpus, Command::Characters, Utf8Mode::Raw, 4).unwrap().characters);
+        let parallel_allocations = allocations() - before;
+        println!("  {name:<8} stream: {stream_allocations:>4}  parallel: {parallel_allocations:>4}");
+    }
+}
+
+fn main() {
+    let mut criterion = Criterion::default().configure_from_args();
+    bench_corpora(&mut criterion);
+    criterion.final_summary();
+}
@@ -3,14 +3,33 @@ use std::env;
 
 fn main() {
     println!("cargo:rerun-if-changed=src/lib.rs");
+    println!("cargo:rerun-if-changed=src/modules/approx.rs");
+    println!("cargo:rerun-if-changed=src/modules/arena.rs");
+    println!("cargo:rerun-if-changed=src/modules/cache.rs");
+    println!("cargo:rerun-if-changed=src/modules/count.rs");
+    println!("cargo:rerun-if-changed=src/modules/counter.rs");
     println!("cargo:rerun-if-changed=src/modules/csv.rs");
-    println!("cargo:rerun-if-changed=src/modules/files/mod.rs");
+    println!("cargo:rerun-if-changed=src/modules/decompress.rs");
+    println!("cargo:rerun-if-changed=src/modules/dedup.rs");
+    println!("cargo:rerun-if-changed=src/modules/error.rs");
+    println!("cargo:rerun-if-changed=src/modules/file/mod.rs");
+    println!("cargo:rerun-if-changed=src/modules/manifest.rs");
+    println!("cargo:rerun-if-changed=src/modules/parallel.rs");
+    println!("cargo:rerun-if-changed=src/modules/pipeline.rs");
+    println!("cargo:rerun-if-changed=src/modules/pool.rs");
+    println!("cargo:rerun-if-changed=src/modules/queue.rs");
+    println!("cargo:rerun-if-changed=src/modules/server.rs");
+    println!("cargo:rerun-if-changed=src/modules/stats.rs");
+    println!("cargo:rerun-if-changed=src/modules/trace/mod.rs");
+    println!("cargo:rerun-if-changed=src/modules/walk.rs");
 
     let manifest_dir = env::var("CARGO_MANIFEST_DIR").unwrap();
 
     cbindgen::Builder::new()
         .with_crate(manifest_dir)
         .with_language(Language::C)
+        // Included by the module headers as well as by main.c
+        .with_pragma_once(true)
         .generate()
         .expect("Unable to generate C bindings")
         .write_to_file("target/bridge/bindings.h");
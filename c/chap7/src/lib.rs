@@ -1,29 +1,78 @@
 mod modules {
+    mod approx;
+    pub mod arena;
+    mod cache;
+    pub mod count;
+    pub mod counter;
     mod csv;
-    mod file;
+    mod decompress;
+    mod dedup;
+    pub mod error;
+    pub mod file;
+    mod manifest;
+    pub mod parallel;
+    mod pipeline;
+    mod pool;
+    mod queue;
+    // Served over Unix sockets
+    #[cfg(unix)]
+    mod server;
+    pub mod stats;
+    pub mod trace;
+    mod walk;
 }
 
+/// Rust entry points for the benchmarks in benches/, not part of the C API.
+#[doc(hidden)]
+pub mod bench {
+    pub use crate::modules::count::{count_all, count_characters, count_characters_lossy, count_characters_strict, CountResult};
+    pub use crate::modules::counter::Counter;
+    pub use crate::modules::parallel::count_parallel;
+    pub use crate::modules::stats::{allocations, enable as enable_stats};
+    pub use crate::Utf8Mode;
+}
+
+use modules::count::{self, CountFn};
+use modules::error::{self, Error, Status};
+use modules::{file, stats, trace};
 use std::ffi::CStr;
+use std::num::NonZeroUsize;
 use std::os::raw::c_char;
-use std::{slice, ptr};
+use std::{slice, ptr, thread};
 
 #[no_mangle]
 pub extern "C" fn print_version() {
     println!("count version 1.0.0");
 }
 
-#[no_mangle]
-pub extern "C" fn count_characters(text: *const c_char) -> u64 {
-    let text = unsafe { CStr::from_ptr(text) };
-    let text = text.to_str().expect("Unicode conversion failed.");
-    text.chars().count().try_into().unwrap()
-}
-
 #[repr(C)]
 pub struct Arguments {
     command: Command,
     filename: *const c_char,
     file_mode: FileMode,
+    utf8: Utf8Mode,
+    threads: usize,
+    jobs: usize,
+    unordered: bool,
+    /// Number of file reads kept in flight for --csv-list and --csv-merged,
+    /// or 0 to read one file at a time.
+    io_depth: usize,
+    pipeline: bool,
+    /// Path of the result cache, or NULL to count every file.
+    cache: *const c_char,
+    format: OutputFormat,
+    /// Counts a whole file for the command and UTF-8 mode, or NULL for the
+    /// commands that don't count files themselves.
+    count: Option<CountFn>,
+    /// The relative error that --approx allows for estimates, or 0 to count
+    /// exactly.
+    approx: f64,
+    /// Whether files compressed with gzip or zstd are counted by their
+    /// decompressed content.
+    decompress: bool,
+    /// Which listings of a manifest or directory tree are taken for the same
+    /// file, and only counted once.
+    dedup: DedupMode,
 }
 
 /// cbindgen:prefix-with-name
@@ -31,47 +80,226 @@ pub struct Arguments {
 pub enum FileMode {
     Normal,
     CsvList,
-    CsvMerged
+    CsvMerged,
+    /// Every file in the directory tree at the filename
+    Recursive,
+    /// Every file that matches the filename as a glob pattern
+    Glob,
 }
 
 /// cbindgen:prefix-with-name
 #[repr(C)]
-#[derive(PartialEq)]
+#[derive(Clone, Copy, PartialEq)]
 pub enum Command {
     Version,
     Bytes,
     Characters,
+    /// Bytes, characters, lines and words, in a single pass
+    All,
+    /// Counts files for clients that connect to the socket at the filename
+    Serve,
 }
 
+impl Command {
+    pub fn name(self) -> &'static str {
+        match self {
+            Command::Version => "version",
+            Command::Bytes => "bytes",
+            Command::Characters => "characters",
+            Command::All => "all",
+            Command::Serve => "serve",
+        }
+    }
+}
+
+/// How characters are counted in text that isn't valid UTF-8.
+/// cbindgen:prefix-with-name
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq)]
+pub enum Utf8Mode {
+    /// Every byte that isn't a continuation byte counts, without validation
+    Raw,
+    /// Every invalid sequence counts as one replacement character, as with
+    /// `String::from_utf8_lossy()`
+    Lossy,
+    /// Invalid UTF-8 is an error
+    Strict,
+}
+
+/// Which listings name the same file, with --dedup. Every mode includes the
+/// ones before it.
+/// cbindgen:prefix-with-name
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq)]
+pub enum DedupMode {
+    /// Every listing is counted
+    Off,
+    /// The same path
+    Paths,
+    /// The same device and inode, like hard links
+    Inodes,
+    /// The same content, like copies
+    Content,
+}
+
+/// How the results are written to stdout.
+/// cbindgen:prefix-with-name
+#[repr(C)]
+pub enum OutputFormat {
+    /// The counts and filename on a line, like wc
+    Text,
+    /// One JSON object per line, with a field for every count
+    Ndjson,
+    /// Fixed-size little-endian records, see src/modules/output/output.h
+    Binary,
+}
+
+/// Without Unix sockets there is no server, and `parse_args()` rejects the
+/// serve command, so this only exits with the same message.
+#[cfg(not(unix))]
+#[no_mangle]
+pub extern "C" fn server_run(_path: *const c_char, _workers: usize, _cache: *const c_char) {
+    error::or_exit(|| Err(invalid("serve: Unix sockets are not supported on this platform.")));
+}
+
+/// Exits with a message for arguments that aren't valid.
 #[no_mangle]
 pub extern "C" fn parse_args(argc: usize, argv: *const *const c_char) -> Arguments {
     let arguments = unsafe { slice::from_raw_parts(argv, argc) };
+    error::or_exit(|| parse(arguments))
+}
 
-    let command = arguments.get(1).copied().expect("Missing command.");
-    let command = unsafe { CStr::from_ptr(command) }.to_str().unwrap();
-    let command = match command {
+fn parse(arguments: &[*const c_char]) -> Result<Arguments, Error> {
+    let command = arguments.get(1).copied().ok_or_else(|| invalid("Missing command."))?;
+    // Text that isn't valid UTF-8 is never a command or flag, and is printed
+    // as well as it can be
+    let command = unsafe { CStr::from_ptr(command) }.to_string_lossy();
+    let command = match &*command {
         "version" => Command::Version,
         "bytes" => Command::Bytes,
         "characters" => Command::Characters,
-        _ => panic!("Command not recognized: {command}")
+        "all" => Command::All,
+        "serve" if cfg!(unix) => Command::Serve,
+        "serve" => return Err(invalid("serve: Unix sockets are not supported on this platform.")),
+        _ => return Err(invalid(format!("Command not recognized: {command}")))
     };
 
     let filename = arguments.get(2).copied();
     if command != Command::Version && filename.is_none() {
-        panic!("Missing filename.");
+        return Err(invalid("Missing filename."));
     }
     let filename = filename.unwrap_or(ptr::null());
 
-    let file_mode = if let Some(csv_flag) = arguments.get(3).copied() {
-        let csv_flag = unsafe { CStr::from_ptr(csv_flag) }.to_str().unwrap();
-        match csv_flag {
-            "--csv-list" => FileMode::CsvList,
-            "--csv-merged" => FileMode::CsvMerged,
-            _ => panic!("CSV flag not recognized: {csv_flag}")
+    let mut file_mode = FileMode::Normal;
+    let mut utf8 = Utf8Mode::Raw;
+    let mut threads = 1;
+    // A server keeps its workers busy with the requests of many clients
+    let mut jobs = if command == Command::Serve { thread::available_parallelism().map_or(1, NonZeroUsize::get) } else { 1 };
+    let mut unordered = false;
+    let mut io_depth = 0;
+    let mut pipeline = false;
+    let mut cache = ptr::null();
+    let mut format = OutputFormat::Text;
+    let mut approx = 0.0;
+    let mut decompress = false;
+    let mut dedup = DedupMode::Off;
+    let mut flags = arguments.iter().skip(3).map(|flag| unsafe { CStr::from_ptr(*flag) });
+    while let Some(flag) = flags.next() {
+        let flag = flag.to_string_lossy();
+        match &*flag {
+            "--csv-list" => file_mode = FileMode::CsvList,
+            "--csv-merged" => file_mode = FileMode::CsvMerged,
+            "--recursive" => file_mode = FileMode::Recursive,
+            "--glob" => file_mode = FileMode::Glob,
+            "--strict-utf8" | "--utf8=strict" => utf8 = Utf8Mode::Strict,
+            "--utf8=lossy" => utf8 = Utf8Mode::Lossy,
+            "--utf8=raw" => utf8 = Utf8Mode::Raw,
+            "--threads" => {
+                let count = flags.next().ok_or_else(|| invalid("Missing thread count."))?.to_string_lossy();
+                threads = match count.parse() {
+                    Ok(count) if count > 0 => count,
+                    _ => return Err(invalid(format!("Invalid thread count: {count}")))
+                };
+            }
+            "--jobs" => {
+                let count = flags.next().ok_or_else(|| invalid("Missing job count."))?.to_string_lossy();
+                jobs = match count.parse() {
+                    Ok(count) if count > 0 => count,
+                    _ => return Err(invalid(format!("Invalid job count: {count}")))
+                };
+            }
+            "--unordered" => unordered = true,
+            "--io-depth" => {
+                let depth = flags.next().ok_or_else(|| invalid("Missing I/O depth."))?.to_string_lossy();
+                io_depth = match depth.parse() {
+                    Ok(depth) if depth > 0 => depth,
+                    _ => return Err(invalid(format!("Invalid I/O depth: {depth}")))
+                };
+            }
+            "--pipeline" => pipeline = true,
+            "--decompress" => decompress = true,
+            "--dedup" | "--dedup=paths" => dedup = DedupMode::Paths,
+            "--dedup=inodes" => dedup = DedupMode::Inodes,
+            "--dedup=content" => dedup = DedupMode::Content,
+            "--approx" => {
+                let error = flags.next().ok_or_else(|| invalid("Missing approximation error."))?.to_string_lossy();
+                approx = match error.parse() {
+                    Ok(error) if error > 0.0 && error < 1.0 => error,
+                    _ => return Err(invalid(format!("Invalid approximation error, it must be between 0 and 1: {error}")))
+                };
+            }
+            "--cache" => {
+                let path = flags.next().ok_or_else(|| invalid("Missing cache path."))?;
+                // The flags come from C strings, so this one is NUL-terminated
+                cache = path.as_ptr() as *const c_char;
+            }
+            "--trace" => {
+                let path = flags.next().ok_or_else(|| invalid("Missing trace path."))?;
+                if !cfg!(feature = "trace") {
+                    return Err(invalid("--trace: count was built without tracing support."));
+                }
+                trace::enable(file::path_from_bytes(path.to_bytes())?);
+            }
+            "--stats" => stats::enable(false),
+            "--stats=json" => stats::enable(true),
+            "--format=text" => format = OutputFormat::Text,
+            "--format=ndjson" => format = OutputFormat::Ndjson,
+            "--format=binary" => format = OutputFormat::Binary,
+            _ if flag.starts_with("--utf8=") => return Err(invalid(format!("UTF-8 mode not recognized: {}", &flag[7..]))),
+            _ if flag.starts_with("--format=") => return Err(invalid(format!("Output format not recognized: {}", &flag[9..]))),
+            _ if flag.starts_with("--dedup=") => return Err(invalid(format!("Dedup mode not recognized: {}", &flag[8..]))),
+            _ => return Err(invalid(format!("Flag not recognized: {flag}")))
         }
-    } else {
-        FileMode::Normal
-    };
+    }
+
+    // These modes read every file by design, and merged counts aren't per file
+    if !cache.is_null() && (pipeline || io_depth > 0 || matches!(file_mode, FileMode::CsvMerged)) {
+        return Err(invalid("--cache can't be combined with --pipeline, --io-depth or --csv-merged."));
+    }
+    // Estimates are made one file at a time, from a sample of raw text
+    if approx > 0.0 && (pipeline || io_depth > 0 || jobs > 1 || threads > 1 || !cache.is_null() || matches!(file_mode, FileMode::CsvMerged)) {
+        return Err(invalid("--approx can't be combined with --pipeline, --io-depth, --jobs, --threads, --cache or --csv-merged."));
+    }
+    if approx > 0.0 && utf8 != Utf8Mode::Raw {
+        return Err(invalid("--approx only counts raw UTF-8, since validating it takes reading all of it."));
+    }
+
+    // Compressed files can only be streamed, and cached results don't tell
+    // whether a file was decompressed
+    if decompress && (pipeline || io_depth > 0 || threads > 1 || approx > 0.0 || !cache.is_null() || matches!(file_mode, FileMode::CsvMerged)) {
+        return Err(invalid("--decompress can't be combined with --pipeline, --io-depth, --threads, --approx, --cache or --csv-merged."));
+    }
+
+    // A merged count counts a file again for every listing of it
+    if dedup != DedupMode::Off && matches!(file_mode, FileMode::CsvMerged) {
+        return Err(invalid("--dedup can't be combined with --csv-merged."));
+    }
+
+    let count = count::count_fn(command, utf8);
+    Ok(Arguments { command, filename, file_mode, utf8, threads, jobs, unordered, io_depth, pipeline, cache, format, count, approx, decompress, dedup })
+}
 
-    Arguments { command, filename, file_mode }
+// Arguments that aren't valid fail the run
+fn invalid(message: impl Into<String>) -> Error {
+    Error::new(Status::Failed, message)
 }
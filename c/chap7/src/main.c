@@ -1,19 +1,93 @@
 #include "modules/file/file.h"
+#include "modules/loader/loader.h"
+#include "modules/output/output.h"
+#include "modules/trace/trace.h"
 #include "bindings.h"
 
 #include <stdio.h>
 #include <string.h>
 
+// Size of the read buffer that files are streamed through
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+// Size of the chunks that arenas allocate per-file and per-batch data in
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// Files up to this size are collected, and counted in batches of BATCH_SIZE
+#define BATCH_FILE_LIMIT (64 * 1024)
+#define BATCH_SIZE 256
+// With --io-depth, files up to this size are loaded asynchronously, bigger
+// ones are streamed
+#define LOADER_FILE_LIMIT (4 * 1024 * 1024)
+
+typedef struct Batch {
+    FileView files[BATCH_SIZE];
+    const char* filenames[BATCH_SIZE];
+    CountResult results[BATCH_SIZE];
+    Status statuses[BATCH_SIZE];
+    // The messages of the files that failed, in the arena
+    const char* messages[BATCH_SIZE];
+    size_t count;
+    Arena* arena;
+} Batch;
+
 typedef struct CommandContext {
     Command command;
+    Utf8Mode utf8;
+    // Counts a whole file, specialized for the command and UTF-8 mode
+    CountFn count;
+    // The error allowed for estimates, or 0 to count exactly
+    double approx;
+    // Whether compressed files are decompressed while they are streamed
+    bool decompress;
+    size_t threads;
     bool print_filename;
+    // The stream buffer is drawn from it for every file, so that it's on the
+    // NUMA node that the context's thread runs on
+    BufferPool* pool;
+    Arena* arena;
+    // Only set when small files are counted in batches
+    Batch* batch;
+    // Only set when loaded files are counted as one
+    Counter* merge_counter;
+    // Only set with --cache, shared by all contexts
+    Cache* cache;
+    // Only set with --dedup, shared by all contexts
+    Dedup* dedup;
+    // Shared by all contexts, and only written to by the main thread
+    Output* output;
 } CommandContext;
 
+void for_each_listed_file(const Arguments* args, const Dedup* dedup, void (*callback)(const char*, const void*),
+                          const void* ctx);
+void for_each_listed_file_parallel(const Arguments* args, const Dedup* dedup,
+                                   Status (*calculate)(const char*, size_t, const void*, CountResult*),
+                                   void (*emit)(const char*, Status, CountResult, const void*),
+                                   const void* ctx);
+void count_listed_files_pipelined(const Arguments* args, const Dedup* dedup, size_t readers,
+                                  void (*emit)(const char*, Status, CountResult, const void*), const void* ctx);
+CommandContext context_new(const Arguments* args, bool print_filename, Output* output);
+void context_free(CommandContext ctx);
 void run_command_for_file(const char* filename, const void* ctx_ptr);
-uint64_t do_calculation(Command command, const char* data);
-uint64_t count_bytes(const char* data);
-void print_result(uint64_t result);
-void print_result_with_filename(uint64_t result, const char* filename);
+bool batch_add(const CommandContext* ctx, const char* filename);
+void batch_flush(const CommandContext* ctx);
+void submit_file(const char* filename, const void* loader_ptr);
+void count_loaded_file(const char* filename, const File* file, void* ctx_ptr);
+void merge_loaded_file(const char* filename, const File* file, void* ctx_ptr);
+void fail_merged_count(const char* filename);
+Status calculate_for_worker(const char* filename, size_t worker, const void* ctx_ptr, CountResult* result);
+void print_result_for_file(const char* filename, Status status, CountResult result, const void* ctx_ptr);
+Status calculate_for_file(const CommandContext* ctx, const char* filename, CountResult* result);
+Status count_file(const CommandContext* ctx, const char* filename, CountResult* result);
+Status stream_calculation(const CommandContext* ctx, const char* filename, CountResult* result);
+Status stream_into(const CommandContext* ctx, Counter* counter, const char* filename);
+Status stream_decompressed_into(Counter* counter, const char* filename);
+Status parallel_calculation(const CommandContext* ctx, const char* filename, CountResult* result);
+Status do_calculation(const CommandContext* ctx, const File* file, CountResult* result);
+void print_result(const CommandContext* ctx, CountResult result, const char* filename);
+void print_estimate(const CommandContext* ctx, Estimate estimate, const char* filename);
+void print_error(const CommandContext* ctx, Status status, const char* filename);
+void fan_out(const CommandContext* ctx, const char* filename, Status status, Estimate estimate);
+void print_repeat(const char* filename, Status status, const Estimate* estimate, const void* ctx_ptr);
+void flush_repeats(const CommandContext* ctx);
 
 int main(const int argc, const char *argv[]) {
     const Arguments args = parse_args(argc, argv);
@@ -22,69 +96,517 @@ int main(const int argc, const char *argv[]) {
         print_version();
         return 0;
     }
+    if (args.command == Command_Serve) {
+        // The server opens the cache itself, and keeps it until it shuts down
+        server_run(args.filename, args.jobs, args.cache);
+        return 0;
+    }
+    Cache* cache = args.cache ? cache_open(args.cache) : NULL;
+    Output* output = output_open(stdout, args.format);
 
     switch (args.file_mode) {
         case FileMode_Normal: {
-            CommandContext ctx = { .command = args.command, .print_filename = false };
+            CommandContext ctx = context_new(&args, false, output);
+            ctx.cache = cache;
             run_command_for_file(args.filename, &ctx);
+            context_free(ctx);
             break;
         }
-        case FileMode_CsvList: {
-            char* csv = file_to_string(file_read(args.filename));
-            CommandContext ctx = { .command = args.command, .print_filename = true };
-            csv_for_each_value(csv, run_command_for_file, &ctx);
-            file_free_string(csv);
+        case FileMode_CsvList:
+        case FileMode_Recursive:
+        case FileMode_Glob: {
+            // Repeated listings are left out, and printed along with the
+            // files they repeat
+            Dedup* dedup = args.dedup != DedupMode_Off ? dedup_new(args.dedup) : NULL;
+            if (args.pipeline) {
+                // Reads are kept in flight by the reader threads, and the
+                // counting is spread over the jobs
+                CommandContext ctx = context_new(&args, true, output);
+                ctx.dedup = dedup;
+                const size_t readers = args.io_depth > 0 ? args.io_depth : 1;
+                count_listed_files_pipelined(&args, dedup, readers, print_result_for_file, &ctx);
+                flush_repeats(&ctx);
+                context_free(ctx);
+            } else if (args.jobs > 1) {
+                // Every worker gets a context of its own, with its own buffer
+                CommandContext* workers = (CommandContext*) malloc(args.jobs * sizeof(CommandContext));
+                for (size_t i = 0; i < args.jobs; i++) {
+                    workers[i] = context_new(&args, true, output);
+                    workers[i].cache = cache;
+                    workers[i].dedup = dedup;
+                }
+                for_each_listed_file_parallel(&args, dedup, calculate_for_worker, print_result_for_file, workers);
+                flush_repeats(&workers[0]);
+                for (size_t i = 0; i < args.jobs; i++) {
+                    context_free(workers[i]);
+                }
+                free(workers);
+            } else if (args.io_depth > 0 && args.command != Command_Bytes) {
+                CommandContext ctx = context_new(&args, true, output);
+                ctx.dedup = dedup;
+                Loader* loader = loader_new(args.io_depth, LOADER_FILE_LIMIT, count_loaded_file, &ctx);
+                for_each_listed_file(&args, dedup, submit_file, loader);
+                loader_finish(loader);
+                flush_repeats(&ctx);
+                context_free(ctx);
+            } else {
+                CommandContext ctx = context_new(&args, true, output);
+                ctx.cache = cache;
+                ctx.dedup = dedup;
+                // Byte counts don't read the files, --threads is for big ones,
+                // and cached files aren't read either. Estimates are made
+                // for big files, and compressed files are streamed.
+                Batch* batch = NULL;
+                if (args.command != Command_Bytes && args.threads == 1 && !cache && args.approx == 0 &&
+                    !args.decompress) {
+                    batch = (Batch*) malloc(sizeof(Batch));
+                    batch->count = 0;
+                    batch->arena = arena_new(ARENA_CHUNK_SIZE);
+                    ctx.batch = batch;
+                }
+                for_each_listed_file(&args, dedup, run_command_for_file, &ctx);
+                if (batch) {
+                    batch_flush(&ctx);
+                    arena_free(batch->arena);
+                    free(batch);
+                }
+                flush_repeats(&ctx);
+                context_free(ctx);
+            }
+            if (dedup) {
+                dedup_free(dedup);
+            }
             break;
         }
         case FileMode_CsvMerged: {
-            char* csv = file_to_string(file_read(args.filename));
-            char* content = csv_merge_files(csv, file_free_string);
-            const size_t result = do_calculation(args.command, content);
-            csv_free_merged_file(content);
-            print_result(result);
+            CountResult result;
+            if (args.io_depth > 0) {
+                CommandContext ctx = context_new(&args, false, output);
+                ctx.merge_counter = counter_new(args.command, args.utf8);
+                Loader* loader = loader_new(args.io_depth, LOADER_FILE_LIMIT, merge_loaded_file, &ctx);
+                csv_for_each_value(args.filename, NULL, submit_file, loader);
+                loader_finish(loader);
+                if (counter_finish(ctx.merge_counter, &result) != Status_Ok) {
+                    fail_merged_count(args.filename);
+                }
+                context_free(ctx);
+            } else {
+                result = csv_count_merged(args.filename, args.command, args.utf8);
+            }
+            const uint64_t start = stats_begin();
+            output_result(output, args.command, &result, NULL);
+            stats_end(Phase_Output, start);
             break;
         }
     }
 
-    return 0;
+    // Files that couldn't be counted didn't stop the others, but fail the run
+    const bool failed = output_error_count(output) > 0;
+    const uint64_t start = stats_begin();
+    output_close(output);
+    stats_end(Phase_Output, start);
+    if (cache) {
+        cache_close(cache);
+    }
+    stats_print();
+    trace_finish();
+    return failed ? 1 : 0;
+}
+
+// The files are listed by a manifest with --csv-list, and otherwise found by
+// walking a directory tree
+void for_each_listed_file(const Arguments* args, const Dedup* dedup, void (*callback)(const char*, const void*),
+                          const void* ctx) {
+    if (args->file_mode == FileMode_CsvList) {
+        csv_for_each_value(args->filename, dedup, callback, ctx);
+    } else {
+        walk_for_each_file(args->filename, args->file_mode == FileMode_Glob, dedup, callback, ctx);
+    }
+}
+
+void for_each_listed_file_parallel(const Arguments* args, const Dedup* dedup,
+                                   Status (*calculate)(const char*, size_t, const void*, CountResult*),
+                                   void (*emit)(const char*, Status, CountResult, const void*),
+                                   const void* ctx) {
+    if (args->file_mode == FileMode_CsvList) {
+        csv_for_each_value_parallel(args->filename, dedup, calculate, emit, ctx, args->jobs, !args->unordered);
+    } else {
+        walk_for_each_file_parallel(args->filename, args->file_mode == FileMode_Glob, dedup, calculate, emit, ctx,
+                                    args->jobs, !args->unordered);
+    }
+}
+
+void count_listed_files_pipelined(const Arguments* args, const Dedup* dedup, const size_t readers,
+                                  void (*emit)(const char*, Status, CountResult, const void*), const void* ctx) {
+    if (args->file_mode == FileMode_CsvList) {
+        csv_count_pipelined(args->filename, dedup, args->command, args->utf8, readers, args->jobs, emit, ctx);
+    } else {
+        walk_count_pipelined(args->filename, args->file_mode == FileMode_Glob, dedup, args->command, args->utf8,
+                             readers, args->jobs, emit, ctx);
+    }
+}
+
+CommandContext context_new(const Arguments* args, const bool print_filename, Output* output) {
+    return (CommandContext) {
+            .command = args->command,
+            .utf8 = args->utf8,
+            .count = args->count,
+            .approx = args->approx,
+            .decompress = args->decompress,
+            .threads = args->threads,
+            .print_filename = print_filename,
+            .pool = buffer_pool_new(),
+            .arena = arena_new(ARENA_CHUNK_SIZE),
+            .batch = NULL,
+            .merge_counter = NULL,
+            .cache = NULL,
+            .dedup = NULL,
+            .output = output
+    };
+}
+
+void context_free(const CommandContext ctx) {
+    buffer_pool_free(ctx.pool);
+    arena_free(ctx.arena);
 }
 
 void run_command_for_file(const char* filename, const void* ctx_ptr) {
     const CommandContext* ctx = (CommandContext*) ctx_ptr;
-    File file = file_read(filename);
-    char* str = file_to_string(file);
+    TRACE_BEGIN(span);
+    if (ctx->approx > 0) {
+        // Times its reads and counting itself
+        Estimate estimate;
+        const Status status = approx_count(filename, ctx->command, ctx->approx, &estimate);
+        const uint64_t start = stats_begin();
+        if (status == Status_Ok) {
+            print_estimate(ctx, estimate, filename);
+        } else {
+            print_error(ctx, status, filename);
+        }
+        stats_end(Phase_Output, start);
+        TRACE_END(span, "run_command_for_file", filename);
+        return;
+    }
+    if (ctx->batch) {
+        if (batch_add(ctx, filename)) {
+            TRACE_END(span, "run_command_for_file", filename);
+            return;
+        }
+        // Print the batched results first, to keep the output in list order
+        batch_flush(ctx);
+    }
+
+    CountResult result;
+    const Status status = calculate_for_file(ctx, filename, &result);
+    print_result_for_file(filename, status, result, ctx);
+    TRACE_END(span, "run_command_for_file", filename);
+}
+
+// Reads a small file into the batch, so it can be counted along with others
+// in a single count_batch() call. Returns false for files that are too big,
+// and for the ones that can't be read, which are left to the usual way of
+// counting to report.
+bool batch_add(const CommandContext* ctx, const char* filename) {
+    Batch* batch = ctx->batch;
+    size_t length;
+    if (file_length(filename, &length) != Status_Ok || length > BATCH_FILE_LIMIT) {
+        return false;
+    }
+
+    // The filename is only valid during the callback, so it is kept as well
+    const size_t filename_size = strlen(filename) + 1;
+    char* name = (char*) arena_alloc(batch->arena, filename_size, 1);
+    memcpy(name, filename, filename_size);
+
+    const uint64_t start = stats_begin();
+    File file;
+    const Status status = file_read_arena(name, batch->arena, &file);
+    stats_end(Phase_Read, start);
+    if (status != Status_Ok) {
+        return false;
+    }
+    stats_add_file(file.length);
+
+    batch->files[batch->count] = (FileView) { file.data, file.length };
+    batch->filenames[batch->count] = name;
+    if (++batch->count == BATCH_SIZE) {
+        batch_flush(ctx);
+    }
+    return true;
+}
+
+void batch_flush(const CommandContext* ctx) {
+    Batch* batch = ctx->batch;
+    if (batch->count == 0) {
+        return;
+    }
+    TRACE_BEGIN(span);
+
+    uint64_t start = stats_begin();
+    count_batch(batch->files, batch->count, ctx->command, ctx->utf8, batch->arena, batch->results, batch->statuses,
+                batch->messages);
+    stats_end(Phase_Count, start);
+
+    start = stats_begin();
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->statuses[i] == Status_Ok) {
+            print_result(ctx, batch->results[i], batch->filenames[i]);
+            continue;
+        }
+        // Made the last error again, which is where the printing takes it from
+        count_set_error(batch->statuses[i], batch->messages[i]);
+        print_error(ctx, batch->statuses[i], batch->filenames[i]);
+    }
+    stats_end(Phase_Output, start);
+
+    batch->count = 0;
+    arena_reset(batch->arena);
+    TRACE_END(span, "batch_flush", NULL);
+}
+
+void submit_file(const char* filename, const void* loader_ptr) {
+    loader_submit((Loader*) loader_ptr, filename);
+}
+
+// Called by the loader in list order. Files it didn't load are counted the
+// usual way.
+void count_loaded_file(const char* filename, const File* file, void* ctx_ptr) {
+    const CommandContext* ctx = (CommandContext*) ctx_ptr;
+    if (!file) {
+        run_command_for_file(filename, ctx);
+        return;
+    }
+    TRACE_BEGIN(span);
+
+    uint64_t start = stats_begin();
+    CountResult result;
+    const Status status = do_calculation(ctx, file, &result);
+    arena_reset(ctx->arena);
+    stats_end(Phase_Count, start);
+    stats_add_file(file->length);
 
-    const uint64_t result = do_calculation(ctx->command, str);
-    if (ctx->print_filename) {
-        print_result_with_filename(result, filename);
+    print_result_for_file(filename, status, result, ctx);
+    TRACE_END(span, "count_loaded_file", filename);
+}
+
+void merge_loaded_file(const char* filename, const File* file, void* ctx_ptr) {
+    const CommandContext* ctx = (CommandContext*) ctx_ptr;
+    TRACE_BEGIN(span);
+    Status status;
+    if (file) {
+        const uint64_t start = stats_begin();
+        status = counter_feed(ctx->merge_counter, file->data, file->length);
+        stats_end(Phase_Count, start);
+        stats_add_file(file->length);
+    } else {
+        status = stream_into(ctx, ctx->merge_counter, filename);
+    }
+    if (status != Status_Ok) {
+        fail_merged_count(filename);
+    }
+    TRACE_END(span, "merge_loaded_file", filename);
+}
+
+// A file that can't be counted fails a merged count, which is all or nothing
+void fail_merged_count(const char* filename) {
+    fprintf(stderr, "%s: %s\n", filename, count_error_message());
+    exit(1);
+}
+
+// Called concurrently by csv_for_each_value_parallel(), with an array of
+// contexts that has one entry per worker.
+Status calculate_for_worker(const char* filename, const size_t worker, const void* ctx_ptr, CountResult* result) {
+    const CommandContext* ctx = &((const CommandContext*) ctx_ptr)[worker];
+    TRACE_BEGIN(span);
+    const Status status = calculate_for_file(ctx, filename, result);
+    TRACE_END(span, "calculate_for_worker", filename);
+    return status;
+}
+
+// Only called from the thread that started the workers, so reading the
+// first worker's context is fine.
+void print_result_for_file(const char* filename, const Status status, const CountResult result,
+                           const void* ctx_ptr) {
+    const CommandContext* ctx = (const CommandContext*) ctx_ptr;
+    const uint64_t start = stats_begin();
+    if (status == Status_Ok) {
+        print_result(ctx, result, filename);
     } else {
-        print_result(result);
+        print_error(ctx, status, filename);
+    }
+    stats_end(Phase_Output, start);
+}
+
+// The result is only set if the file could be counted, the returned status
+// tells why it couldn't otherwise
+Status calculate_for_file(const CommandContext* ctx, const char* filename, CountResult* result) {
+    if (!ctx->cache) {
+        return count_file(ctx, filename, result);
+    }
+    FileIdentity identity;
+    bool found;
+    Status status = cache_lookup(ctx->cache, filename, ctx->command, ctx->utf8, &identity, result, &found);
+    if (status != Status_Ok || found) {
+        return status;
+    }
+    status = count_file(ctx, filename, result);
+    if (status == Status_Ok) {
+        cache_store(ctx->cache, &identity, ctx->command, ctx->utf8, *result);
+    }
+    return status;
+}
+
+Status count_file(const CommandContext* ctx, const char* filename, CountResult* result) {
+    // The byte count only needs the length, which mapping the file gives us
+    // without reading any of it, unless it's compressed.
+    if (ctx->command == Command_Bytes && !ctx->decompress) {
+        const uint64_t start = stats_begin();
+        File file;
+        Status status = file_map(filename, ctx->pool, &file);
+        if (status == Status_Ok) {
+            status = do_calculation(ctx, &file, result);
+            file_unmap(file);
+        }
+        stats_end(Phase_Read, start);
+        stats_add_file(0);
+        return status;
+    }
+    const Status status = ctx->threads > 1
+            ? parallel_calculation(ctx, filename, result)
+            : stream_calculation(ctx, filename, result);
+    // Everything allocated for this file goes at once
+    arena_reset(ctx->arena);
+    return status;
+}
+
+Status stream_calculation(const CommandContext* ctx, const char* filename, CountResult* result) {
+    Counter* counter = counter_new_in(ctx->arena, ctx->command, ctx->utf8);
+    const Status status = stream_into(ctx, counter, filename);
+    // The counter goes with the arena, so it doesn't have to be finished
+    return status == Status_Ok ? counter_finish_in(counter, result) : status;
+}
+
+// Feeds the file to `counter`, one buffer at a time, up to the first error
+Status stream_into(const CommandContext* ctx, Counter* counter, const char* filename) {
+    if (ctx->decompress) {
+        return stream_decompressed_into(counter, filename);
+    }
+    FileStream stream;
+    Status status = file_stream_open(filename, &stream);
+    if (status != Status_Ok) {
+        return status;
+    }
+    uint8_t* buffer = buffer_pool_alloc(ctx->pool, STREAM_BUFFER_SIZE);
+    uint64_t bytes_read = 0;
+    while (status == Status_Ok) {
+        uint64_t start = stats_begin();
+        size_t length;
+        status = file_stream_read(&stream, buffer, STREAM_BUFFER_SIZE, &length);
+        stats_end(Phase_Read, start);
+        if (status != Status_Ok || length == 0) {
+            break;
+        }
+
+        start = stats_begin();
+        status = counter_feed(counter, buffer, length);
+        stats_end(Phase_Count, start);
+        bytes_read += length;
     }
+    buffer_pool_release(ctx->pool, buffer);
+    file_stream_close(stream);
+    stats_add_file(bytes_read);
+    return status;
+}
 
-    free(str);
-    file_free(file);
+// Like stream_into(), through the decoder's chunks, which hold the
+// decompressed content of compressed files
+Status stream_decompressed_into(Counter* counter, const char* filename) {
+    Decoder* decoder;
+    Status status = decoder_open(filename, &decoder);
+    if (status != Status_Ok) {
+        return status;
+    }
+    const uint8_t* chunk;
+    size_t length;
+    // Times its reads itself
+    while ((status = decoder_next(decoder, &chunk, &length)) == Status_Ok && length > 0) {
+        const uint64_t start = stats_begin();
+        status = counter_feed(counter, chunk, length);
+        stats_end(Phase_Count, start);
+        if (status != Status_Ok) {
+            break;
+        }
+    }
+    stats_add_file(decoder_close(decoder));
+    return status;
 }
 
-uint64_t do_calculation(const Command command, const char* data) {
-    switch (command) {
-        case Command_Bytes:
-            return count_bytes(data);
-        case Command_Characters:
-            return count_characters(data);
-        default:
-            fprintf(stderr, "Unrecognized command: %i\n", command);
-            exit(1);
+Status parallel_calculation(const CommandContext* ctx, const char* filename, CountResult* result) {
+    File file;
+    Status status = file_map(filename, ctx->pool, &file);
+    if (status != Status_Ok) {
+        return status;
     }
+    // Pages of the mapping are read while counting, so this time includes the I/O
+    const uint64_t start = stats_begin();
+    status = count_parallel(file.data, file.length, ctx->command, ctx->utf8, ctx->threads, result);
+    stats_end(Phase_Count, start);
+    file_unmap(file);
+    stats_add_file(file.length);
+    return status;
 }
 
-void print_result(const uint64_t result) {
-    printf("%llu\n", result);
+// parse_args() picked the function for the command and UTF-8 mode, so
+// nothing is decided per file here
+Status do_calculation(const CommandContext* ctx, const File* file, CountResult* result) {
+    return ctx->count(file->data, file->length, result);
 }
 
-void print_result_with_filename(const uint64_t result, const char* filename) {
-    printf("%lli %s\n", result, filename);
+// The filename is left out for a single file
+void print_result(const CommandContext* ctx, const CountResult result, const char* filename) {
+    fan_out(ctx, filename, Status_Ok, (Estimate) { .result = result });
+    output_result(ctx->output, ctx->command, &result, ctx->print_filename ? filename : NULL);
 }
 
-uint64_t count_bytes(const char* data) {
-    return strlen(data);
+void print_estimate(const CommandContext* ctx, const Estimate estimate, const char* filename) {
+    fan_out(ctx, filename, Status_Ok, estimate);
+    output_estimate(ctx->output, ctx->command, &estimate.result, &estimate.margin,
+                    ctx->print_filename ? filename : NULL);
+}
+
+// With the message of the last error on the calling thread, which is always
+// named after the file, also for a single one
+void print_error(const CommandContext* ctx, const Status status, const char* filename) {
+    fan_out(ctx, filename, status, (Estimate) { 0 });
+    output_error(ctx->output, filename, count_error_message());
+}
+
+// With --dedup, prints the listings before the file that repeat files that
+// are already printed, and keeps the file's outcome for its own repeats
+void fan_out(const CommandContext* ctx, const char* filename, const Status status, const Estimate estimate) {
+    if (ctx->dedup) {
+        dedup_pass(ctx->dedup, filename, status, &estimate, print_repeat, ctx);
+    }
+}
+
+// Like the print functions, without fanning out again. Repeats are only ever
+// listed, so they are named.
+void print_repeat(const char* filename, const Status status, const Estimate* estimate, const void* ctx_ptr) {
+    const CommandContext* ctx = (const CommandContext*) ctx_ptr;
+    if (status != Status_Ok) {
+        output_error(ctx->output, filename, count_error_message());
+    } else if (ctx->approx > 0) {
+        output_estimate(ctx->output, ctx->command, &estimate->result, &estimate->margin, filename);
+    } else {
+        output_result(ctx->output, ctx->command, &estimate->result, filename);
+    }
+}
+
+// Once every listed file is printed, the repeats after the last one are left
+void flush_repeats(const CommandContext* ctx) {
+    if (ctx->dedup) {
+        const uint64_t start = stats_begin();
+        dedup_flush(ctx->dedup, print_repeat, ctx);
+        stats_end(Phase_Output, start);
+    }
 }
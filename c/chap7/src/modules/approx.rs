@@ -0,0 +1,222 @@
+mod ffi {
+    use super::Estimate;
+    use crate::modules::error::{self, Status};
+    use crate::modules::file;
+    use crate::Command;
+    use std::os::raw::c_char;
+
+    /// Estimates what `command` counts in the file from a random sample of
+    /// its blocks, which grows until the 95% confidence interval of every
+    /// count is within `error` of the count, relative to it. The estimate
+    /// is written to `estimate` if the file could be read.
+    #[no_mangle]
+    pub extern "C" fn approx_count(filename: *const c_char, command: Command, error: f64, estimate: *mut Estimate) -> Status {
+        error::status(|| {
+            let filename = unsafe { file::c_path(filename) }?;
+            super::estimate(filename, command, error).map(|estimated| unsafe { *estimate = estimated })
+        })
+    }
+}
+
+use crate::modules::count::{self, CountResult};
+use crate::modules::counter::Counter;
+use crate::modules::error::Error;
+use crate::modules::file;
+use crate::modules::stats::{self, Phase};
+use crate::modules::trace;
+use crate::{Command, Utf8Mode};
+use std::collections::HashSet;
+use std::fs;
+use std::path::Path;
+
+// The unit that is sampled. Every block is read with the byte before it, to
+// tell whether a word continues into it.
+const BLOCK_SIZE: usize = 64 * 1024;
+// Smaller samples don't make for a normal sampling distribution
+const MIN_SAMPLES: usize = 32;
+// Reading more of a file than this at random offsets takes about as long as
+// reading all of it in order, so then it is counted exactly
+const MAX_SAMPLED_FRACTION: f64 = 0.25;
+// The 97.5th percentile of the standard normal distribution, for a two-sided
+// 95% confidence interval
+const Z: f64 = 1.96;
+
+// Picks one of the counts of a result
+type Field = fn(&mut CountResult) -> &mut u64;
+
+/// Counts that were extrapolated from a sample, with their margins of error.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct Estimate {
+    pub result: CountResult,
+    /// Half the width of the 95% confidence interval of each count in
+    /// `result`, or 0 for counts that are exact, like the bytes
+    pub margin: CountResult,
+}
+
+/// See `approx_count()`. Only raw UTF-8 can be counted this way, since
+/// validating it takes reading all of it.
+pub fn estimate(filename: &Path, command: Command, error: f64) -> Result<Estimate, Error> {
+    let _span = trace::file_span("approx_count", filename);
+    let file = file::open(filename)?;
+    let size = file.metadata().map_err(file::open_failed)?.len();
+    if command == Command::Bytes {
+        stats::add_file(0);
+        return Ok(Estimate { result: CountResult { bytes: size, ..CountResult::default() }, ..Estimate::default() });
+    }
+
+    let blocks = size.div_ceil(BLOCK_SIZE as u64);
+    let max_samples = (blocks as f64 * MAX_SAMPLED_FRACTION) as usize;
+    if max_samples < MIN_SAMPLES {
+        return count_exactly(filename, command, 0);
+    }
+
+    let mut sampler = Sampler::new(file, size, command);
+    let mut wanted = MIN_SAMPLES;
+    loop {
+        sampler.sample(wanted - sampler.samples.len())?;
+        let estimate = sampler.estimate();
+        let worst = sampler.fields().iter().map(|&field| relative_margin(&estimate, field) / error).fold(0.0, f64::max);
+        if worst <= 1.0 {
+            stats::add_file(sampler.bytes_read);
+            return Ok(estimate);
+        }
+        // The margin shrinks with the square root of the sample size, and a
+        // bit more is asked for, to not fall just short again
+        let taken = sampler.samples.len();
+        wanted = ((taken as f64 * worst * worst * 1.1).ceil() as usize).max(taken + MIN_SAMPLES);
+        if wanted > max_samples {
+            return count_exactly(filename, command, sampler.bytes_read);
+        }
+    }
+}
+
+// `bytes_read` is what was already read for a sample
+fn count_exactly(filename: &Path, command: Command, mut bytes_read: u64) -> Result<Estimate, Error> {
+    let mut counter = Counter::new(command, Utf8Mode::Raw);
+    file::Reader::new().for_each_chunk(filename, |chunk| {
+        let start = stats::begin();
+        let fed = counter.feed(chunk);
+        stats::end(Phase::Count, start);
+        bytes_read += chunk.len() as u64;
+        fed
+    })?;
+    stats::add_file(bytes_read);
+    Ok(Estimate { result: counter.finish()?, ..Estimate::default() })
+}
+
+fn relative_margin(estimate: &Estimate, field: Field) -> f64 {
+    let margin = get(field, &estimate.margin) as f64;
+    if margin == 0.0 { 0.0 } else { margin / get(field, &estimate.result).max(1) as f64 }
+}
+
+fn get(field: Field, result: &CountResult) -> u64 {
+    *field(&mut { *result })
+}
+
+/// A sample of a file's blocks, drawn without replacement.
+struct Sampler {
+    file: fs::File,
+    size: u64,
+    command: Command,
+    blocks: u64,
+    sampled: HashSet<u64>,
+    samples: Vec<CountResult>,
+    buffer: Box<[u8]>,
+    bytes_read: u64,
+    // Seeded the same way for every file, so that estimates are repeatable
+    random: u64,
+}
+
+impl Sampler {
+    fn new(file: fs::File, size: u64, command: Command) -> Self {
+        Sampler {
+            file,
+            size,
+            command,
+            blocks: size.div_ceil(BLOCK_SIZE as u64),
+            sampled: HashSet::new(),
+            samples: Vec::new(),
+            buffer: vec![0; BLOCK_SIZE + 1].into_boxed_slice(),
+            bytes_read: 0,
+            random: 0x853c_49e6_748f_ea9b,
+        }
+    }
+
+    // The counts that are estimated
+    fn fields(&self) -> &'static [Field] {
+        const CHARACTERS: &[Field] = &[|result| &mut result.characters];
+        const ALL: &[Field] = &[|result| &mut result.characters, |result| &mut result.lines, |result| &mut result.words];
+        if self.command == Command::All { ALL } else { CHARACTERS }
+    }
+
+    fn sample(&mut self, count: usize) -> Result<(), Error> {
+        let mut blocks = Vec::with_capacity(count);
+        while blocks.len() < count {
+            let block = self.next_random() % self.blocks;
+            if self.sampled.insert(block) {
+                blocks.push(block);
+            }
+        }
+        // Read in file order, which is kinder to disks and readahead
+        blocks.sort_unstable();
+        for block in blocks {
+            let result = self.count_block(block)?;
+            self.samples.push(result);
+        }
+        Ok(())
+    }
+
+    fn count_block(&mut self, block: u64) -> Result<CountResult, Error> {
+        let offset = block * BLOCK_SIZE as u64;
+        let before = (offset > 0) as usize;
+        // Only the byte before the block is extra, the first block has none
+        let read = file::read_at(&self.file, offset - before as u64, &mut self.buffer[..BLOCK_SIZE + before])?;
+        self.bytes_read += read as u64;
+        let after_space = before == 0 || count::is_space(self.buffer[0]);
+
+        let start = stats::begin();
+        // Raw UTF-8 is never invalid
+        let mut counter = Counter::continuing(self.command, Utf8Mode::Raw, after_space);
+        let result = counter.feed(&self.buffer[before.min(read)..read]).and_then(|()| counter.finish());
+        stats::end(Phase::Count, start);
+        result
+    }
+
+    // Extrapolates the ratio of each count to the bytes in the sample to the
+    // whole file, which accounts for the last block being shorter. The
+    // variance is that of a ratio estimator, with the finite population
+    // correction, as in Cochran's Sampling Techniques, 6.9.
+    fn estimate(&self) -> Estimate {
+        let n = self.samples.len() as f64;
+        let sampled_bytes: f64 = self.samples.iter().map(|sample| sample.bytes as f64).sum();
+        let correction = 1.0 - n / self.blocks as f64;
+        let size = self.size as f64;
+
+        let mut estimate = Estimate::default();
+        estimate.result.bytes = self.size;
+        for &field in self.fields() {
+            let ratio = self.samples.iter().map(|sample| get(field, sample) as f64).sum::<f64>() / sampled_bytes;
+            let residuals = self
+                .samples
+                .iter()
+                .map(|sample| (get(field, sample) as f64 - ratio * sample.bytes as f64).powi(2))
+                .sum::<f64>()
+                / (n - 1.0);
+            let mean_bytes = sampled_bytes / n;
+            let variance = (size / mean_bytes).powi(2) * correction * residuals / n;
+            *field(&mut estimate.result) = (ratio * size).round() as u64;
+            *field(&mut estimate.margin) = (Z * variance.sqrt()).ceil() as u64;
+        }
+        estimate
+    }
+
+    // SplitMix64
+    fn next_random(&mut self) -> u64 {
+        self.random = self.random.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        let mut z = self.random;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        z ^ (z >> 31)
+    }
+}
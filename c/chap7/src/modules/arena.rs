@@ -0,0 +1,114 @@
+mod ffi {
+    use super::Arena;
+    use std::ffi::c_void;
+
+    /// Creates an arena that allocates memory in chunks of at least
+    /// `chunk_size` bytes. Must be released with `arena_free()`.
+    #[no_mangle]
+    pub extern "C" fn arena_new(chunk_size: usize) -> *mut Arena {
+        Box::into_raw(Box::new(Arena::new(chunk_size)))
+    }
+
+    /// Allocates `size` bytes aligned to `align`, which must be a power of
+    /// two. The memory stays valid until the next `arena_reset()`.
+    #[no_mangle]
+    pub extern "C" fn arena_alloc(arena: *mut Arena, size: usize, align: usize) -> *mut c_void {
+        let arena = unsafe { &mut *arena };
+        arena.alloc(size, align) as *mut c_void
+    }
+
+    /// Releases everything allocated from the arena at once, keeping its
+    /// chunks around for the next allocations.
+    #[no_mangle]
+    pub extern "C" fn arena_reset(arena: *mut Arena) {
+        let arena = unsafe { &mut *arena };
+        arena.reset();
+    }
+
+    #[no_mangle]
+    pub extern "C" fn arena_free(arena: *mut Arena) {
+        drop(unsafe { Box::from_raw(arena) });
+    }
+}
+
+use std::alloc::{self, Layout};
+use std::os::raw::c_char;
+use std::ptr::{self, NonNull};
+
+// Chunks are aligned to a cache line, which covers every type we allocate
+const CHUNK_ALIGN: usize = 64;
+
+/// A bump allocator for data that lives as long as one file, or one batch.
+///
+/// Each allocation is a pointer increment, and resetting the arena frees
+/// all of them at once. An arena may only be used by one thread at a time.
+pub struct Arena {
+    chunks: Vec<Chunk>,
+    chunk_size: usize,
+    // The chunk that is allocated from, and how much of it is used
+    current: usize,
+    offset: usize,
+}
+
+struct Chunk {
+    data: NonNull<u8>,
+    size: usize,
+}
+
+impl Arena {
+    pub fn new(chunk_size: usize) -> Self {
+        Arena { chunks: Vec::new(), chunk_size: chunk_size.max(CHUNK_ALIGN), current: 0, offset: 0 }
+    }
+
+    pub fn alloc(&mut self, size: usize, align: usize) -> *mut u8 {
+        assert!(align.is_power_of_two(), "Arena alignment must be a power of two: {align}");
+        loop {
+            if let Some(chunk) = self.chunks.get(self.current) {
+                let start = (chunk.data.as_ptr() as usize + self.offset).next_multiple_of(align)
+                    - chunk.data.as_ptr() as usize;
+                if start + size <= chunk.size {
+                    self.offset = start + size;
+                    return unsafe { chunk.data.as_ptr().add(start) };
+                }
+                if self.current + 1 < self.chunks.len() {
+                    self.current += 1;
+                    self.offset = 0;
+                    continue;
+                }
+            }
+            self.push_chunk(size + align);
+        }
+    }
+
+    /// Copies `text` into the arena as a C string.
+    pub fn alloc_c_str(&mut self, text: &str) -> *const c_char {
+        let data = self.alloc(text.len() + 1, 1);
+        unsafe {
+            ptr::copy_nonoverlapping(text.as_ptr(), data, text.len());
+            *data.add(text.len()) = 0;
+        }
+        data as *const c_char
+    }
+
+    pub fn reset(&mut self) {
+        self.current = 0;
+        self.offset = 0;
+    }
+
+    fn push_chunk(&mut self, min_size: usize) {
+        let size = self.chunk_size.max(min_size);
+        let layout = Layout::from_size_align(size, CHUNK_ALIGN).unwrap();
+        let data = NonNull::new(unsafe { alloc::alloc(layout) }).unwrap_or_else(|| alloc::handle_alloc_error(layout));
+        self.chunks.push(Chunk { data, size });
+        self.current = self.chunks.len() - 1;
+        self.offset = 0;
+    }
+}
+
+impl Drop for Arena {
+    fn drop(&mut self) {
+        for chunk in &self.chunks {
+            unsafe { alloc::dealloc(chunk.data.as_ptr(), Layout::from_size_align_unchecked(chunk.size, CHUNK_ALIGN)) };
+        }
+    }
+}
@@ -0,0 +1,538 @@
+mod ffi {
+    use super::{Cache, FileIdentity};
+    use crate::modules::count::CountResult;
+    use crate::modules::error::{self, Status};
+    use crate::modules::file;
+    use crate::{Command, Utf8Mode};
+    use std::os::raw::c_char;
+
+    /// Opens the cache at `path`, or starts an empty one if there is none (or
+    /// it can't be used). Must be released with `cache_close()`.
+    #[no_mangle]
+    pub extern "C" fn cache_open(path: *const c_char) -> *mut Cache {
+        let path = error::or_exit(|| unsafe { file::c_path(path) });
+        Box::into_raw(Box::new(Cache::open(path)))
+    }
+
+    /// Looks up the counts of `filename` for `command`, and sets `found` to
+    /// whether they were. Either way `identity` is filled in, to be passed to
+    /// `cache_store()` once the file is counted. Fails like counting the file
+    /// would if it can't be looked at. Can be called from any number of
+    /// threads at once.
+    #[no_mangle]
+    pub extern "C" fn cache_lookup(
+        cache: *const Cache,
+        filename: *const c_char,
+        command: Command,
+        utf8: Utf8Mode,
+        identity: *mut FileIdentity,
+        result: *mut CountResult,
+        found: *mut bool,
+    ) -> Status {
+        let cache = unsafe { &*cache };
+        error::status(|| {
+            let (file, cached) = cache.lookup(unsafe { file::c_path(filename) }?, command, utf8)?;
+            unsafe {
+                identity.write(file);
+                found.write(cached.is_some());
+                if let Some(cached) = cached {
+                    result.write(cached);
+                }
+            }
+            Ok(())
+        })
+    }
+
+    #[no_mangle]
+    pub extern "C" fn cache_store(
+        cache: *const Cache,
+        identity: *const FileIdentity,
+        command: Command,
+        utf8: Utf8Mode,
+        result: CountResult,
+    ) {
+        let cache = unsafe { &*cache };
+        cache.store(unsafe { &*identity }, command, utf8, result);
+    }
+
+    /// Writes the cache back if anything was stored, and frees it.
+    #[no_mangle]
+    pub extern "C" fn cache_close(cache: *mut Cache) {
+        unsafe { Box::from_raw(cache) }.save();
+    }
+}
+
+use crate::modules::count::{self, CountResult};
+use crate::modules::error::Error;
+use crate::modules::file;
+use crate::modules::stats::{self, Phase};
+use crate::{Command, Utf8Mode};
+use std::collections::hash_map::RandomState;
+use std::collections::HashMap;
+use std::fs;
+use std::hash::{BuildHasher, Hasher};
+use std::io::Write;
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::{process, slice};
+use std::sync::Mutex;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+// The cache file is a header followed by fixed-size records sorted by the
+// hash of their path, in native byte order. It is memory-mapped, so only the
+// pages that a binary search touches are ever read.
+const MAGIC: [u8; 8] = *b"COUNTCCH";
+const VERSION: u32 = 1;
+
+// What a record holds besides the byte count, which every command counts.
+// Valid text has the same characters in every mode, so a validated record
+// has both kinds.
+const CHARACTERS: u64 = 1 << 0;
+const LINES_AND_WORDS: u64 = 1 << 1;
+const VALIDATED: u64 = 1 << 2;
+const LOSSY_CHARACTERS: u64 = 1 << 3;
+
+// Files modified this recently aren't stored. They could still change within
+// the resolution of their file system's timestamps, without changing those.
+const RACY_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Identifies the version of a file that was counted: a changed file has a
+/// different size or modification time, and a replaced one a different inode.
+#[repr(C)]
+#[derive(Clone, Copy, Default, PartialEq)]
+pub struct FileIdentity {
+    path_hash: u64,
+    device: u64,
+    inode: u64,
+    size: u64,
+    modified_ns: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Record {
+    identity: FileIdentity,
+    flags: u64,
+    result: CountResult,
+}
+
+#[repr(C)]
+struct Header {
+    magic: [u8; 8],
+    version: u32,
+    record_size: u32,
+    count: u64,
+    reserved: u64,
+}
+
+/// Counts of files from previous runs, and the ones added in this run.
+///
+/// A path can have several records, for the same version of the file, when
+/// different commands or UTF-8 modes counted it, and none of them has all
+/// the counts of another.
+pub struct Cache {
+    path: PathBuf,
+    index: Option<Mapping>,
+    // By path hash
+    added: Mutex<HashMap<u64, Vec<Record>>>,
+}
+
+impl FileIdentity {
+    fn of(filename: &Path) -> Result<Self, Error> {
+        let metadata = fs::metadata(filename).map_err(file::open_failed)?;
+        let modified_ns = metadata
+            .modified()
+            .ok()
+            .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |time| time.as_nanos() as u64);
+        let (device, inode) = device_and_inode(&metadata);
+        Ok(FileIdentity { path_hash: hash_path(filename), device, inode, size: metadata.len(), modified_ns })
+    }
+}
+
+#[cfg(unix)]
+fn device_and_inode(metadata: &fs::Metadata) -> (u64, u64) {
+    use std::os::unix::fs::MetadataExt;
+    (metadata.dev(), metadata.ino())
+}
+
+#[cfg(not(unix))]
+fn device_and_inode(_metadata: &fs::Metadata) -> (u64, u64) {
+    (0, 0)
+}
+
+// FNV-1a, which unlike std's hashers is guaranteed to stay the same
+fn hash_path(path: &Path) -> u64 {
+    path.as_os_str().as_encoded_bytes().iter().fold(0xcbf2_9ce4_8422_2325, |hash, byte| (hash ^ *byte as u64).wrapping_mul(0x0100_0000_01b3))
+}
+
+// None for the commands that don't count
+fn flags_for(command: Command, utf8: Utf8Mode) -> Option<u64> {
+    let characters = match utf8 {
+        Utf8Mode::Raw => CHARACTERS,
+        Utf8Mode::Lossy => LOSSY_CHARACTERS,
+        Utf8Mode::Strict => CHARACTERS | LOSSY_CHARACTERS | VALIDATED,
+    };
+    match command {
+        Command::Bytes => Some(0),
+        Command::Characters => Some(characters),
+        Command::All => Some(characters | LINES_AND_WORDS),
+        Command::Version | Command::Serve => None,
+    }
+}
+
+impl Cache {
+    pub fn open(path: &Path) -> Self {
+        let index = match Mapping::open(path) {
+            Some(mapping) if Cache::is_valid(mapping.bytes()) => Some(mapping),
+            Some(_) => {
+                eprintln!("Ignoring invalid cache file: '{}'", path.display());
+                None
+            }
+            None => None,
+        };
+        Cache { path: path.to_owned(), index, added: Mutex::new(HashMap::new()) }
+    }
+
+    fn is_valid(bytes: &[u8]) -> bool {
+        if bytes.len() < mem::size_of::<Header>() {
+            return false;
+        }
+        let header = unsafe { &*(bytes.as_ptr() as *const Header) };
+        header.magic == MAGIC
+            && header.version == VERSION
+            && header.record_size as usize == mem::size_of::<Record>()
+            && (header.count as usize).checked_mul(mem::size_of::<Record>())
+                == Some(bytes.len() - mem::size_of::<Header>())
+    }
+
+    fn records(&self) -> &[Record] {
+        let Some(index) = &self.index else { return &[] };
+        let records = &index.bytes()[mem::size_of::<Header>()..];
+        // The mapping is page-aligned, and the header's size a multiple of 8
+        unsafe { slice::from_raw_parts(records.as_ptr() as *const Record, records.len() / mem::size_of::<Record>()) }
+    }
+
+    pub fn lookup(&self, filename: &Path, command: Command, utf8: Utf8Mode) -> Result<(FileIdentity, Option<CountResult>), Error> {
+        let flags = flags_for(command, utf8).ok_or_else(|| count::nothing_to_count(command))?;
+        let start = stats::begin();
+        let identity = FileIdentity::of(filename);
+        stats::end(Phase::Read, start);
+        let identity = identity?;
+
+        let matches = |record: &Record| record.identity == identity && record.flags & flags == flags;
+        if let Some(records) = self.added.lock().unwrap().get(&identity.path_hash) {
+            if let Some(record) = records.iter().find(|record| matches(record)) {
+                return Ok((identity, Some(record.result)));
+            }
+        }
+        let records = self.records();
+        let first = records.partition_point(|record| record.identity.path_hash < identity.path_hash);
+        let found = records[first..]
+            .iter()
+            .take_while(|record| record.identity.path_hash == identity.path_hash)
+            .find(|record| matches(record))
+            .map(|record| record.result);
+        Ok((identity, found))
+    }
+
+    pub fn store(&self, identity: &FileIdentity, command: Command, utf8: Utf8Mode, result: CountResult) {
+        let modified = UNIX_EPOCH + Duration::from_nanos(identity.modified_ns);
+        if modified + RACY_INTERVAL > SystemTime::now() {
+            return;
+        }
+        let Some(flags) = flags_for(command, utf8) else { return };
+        let record = Record { identity: *identity, flags, result };
+        add_record(self.added.lock().unwrap().entry(identity.path_hash).or_default(), record);
+    }
+
+    /// Merges the added records into the existing ones, and replaces the
+    /// cache file with the result. A mapping of the old file stays valid,
+    /// since the new one is written next to it and renamed over it.
+    pub fn save(self) {
+        let mut added: Vec<(u64, Vec<Record>)> = self.added.lock().unwrap().drain().collect();
+        if added.is_empty() {
+            return;
+        }
+        added.sort_unstable_by_key(|(path_hash, _)| *path_hash);
+
+        // Added records are merged into the existing ones of the same path,
+        // like they were stored after them
+        let existing = self.records();
+        let mut records = Vec::with_capacity(existing.len() + added.len());
+        let mut next = 0;
+        for (path_hash, path_records) in added {
+            while next < existing.len() && existing[next].identity.path_hash < path_hash {
+                records.push(existing[next]);
+                next += 1;
+            }
+            let mut merged = Vec::new();
+            while next < existing.len() && existing[next].identity.path_hash == path_hash {
+                merged.push(existing[next]);
+                next += 1;
+            }
+            for record in path_records {
+                add_record(&mut merged, record);
+            }
+            records.append(&mut merged);
+        }
+        records.extend_from_slice(&existing[next..]);
+
+        if let Err(error) = self.write(&records) {
+            eprintln!("Could not write cache file: '{}': {error}", self.path.display());
+        }
+    }
+
+    fn write(&self, records: &[Record]) -> std::io::Result<()> {
+        let header = Header {
+            magic: MAGIC,
+            version: VERSION,
+            record_size: mem::size_of::<Record>() as u32,
+            count: records.len() as u64,
+            reserved: 0,
+        };
+        // Runs that save at the same time each write a file of their own,
+        // and the last one renamed wins
+        let mut temporary = self.path.clone().into_os_string();
+        temporary.push(format!(".{}-{:016x}.tmp", process::id(), RandomState::new().build_hasher().finish()));
+        let mut file = fs::File::options().write(true).create_new(true).open(&temporary)?;
+        let written = file
+            .write_all(as_bytes(slice::from_ref(&header)))
+            .and_then(|()| file.write_all(as_bytes(records)))
+            .and_then(|()| file.sync_all())
+            .and_then(|()| fs::rename(&temporary, &self.path));
+        if written.is_err() {
+            let _ = fs::remove_file(&temporary);
+        }
+        written
+    }
+}
+
+// Adds `record` to the records of its path, in place of the ones for other
+// versions of the file, and the ones that it has all the counts of
+fn add_record(records: &mut Vec<Record>, record: Record) {
+    records.retain(|kept| kept.identity == record.identity && kept.flags & record.flags != kept.flags);
+    if !records.iter().any(|kept| kept.flags & record.flags == record.flags) {
+        records.push(record);
+    }
+}
+
+// Only used for the plain-data types of the cache file
+fn as_bytes<T>(values: &[T]) -> &[u8] {
+    unsafe { slice::from_raw_parts(values.as_ptr() as *const u8, mem::size_of_val(values)) }
+}
+
+/// A read-only view of a whole file, mapped into memory where possible.
+struct Mapping {
+    data: *const u8,
+    length: usize,
+    #[cfg(not(unix))]
+    _content: Vec<u64>,
+}
+
+// The mapping is never written to.
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    #[cfg(unix)]
+    fn open(path: &Path) -> Option<Self> {
+        use std::os::unix::io::AsRawFd;
+        use std::ptr;
+
+        let file = fs::File::open(path).ok()?;
+        let length = file.metadata().ok()?.len() as usize;
+        if length == 0 {
+            return Some(Mapping { data: ptr::null(), length: 0 });
+        }
+        let data = unsafe { libc::mmap(ptr::null_mut(), length, libc::PROT_READ, libc::MAP_PRIVATE, file.as_raw_fd(), 0) };
+        if data == libc::MAP_FAILED {
+            return None;
+        }
+        Some(Mapping { data: data as *const u8, length })
+    }
+
+    // Elsewhere the file is read, into a buffer aligned for the records
+    #[cfg(not(unix))]
+    fn open(path: &Path) -> Option<Self> {
+        let bytes = fs::read(path).ok()?;
+        let mut content = vec![0u64; bytes.len().div_ceil(8)];
+        unsafe { std::ptr::copy_nonoverlapping(bytes.as_ptr(), content.as_mut_ptr() as *mut u8, bytes.len()) };
+        Some(Mapping { data: content.as_ptr() as *const u8, length: bytes.len(), _content: content })
+    }
+
+    fn bytes(&self) -> &[u8] {
+        if self.length == 0 { &[] } else { unsafe { slice::from_raw_parts(self.data, self.length) } }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        if self.length > 0 {
+            unsafe { libc::munmap(self.data as *mut _, self.length) };
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Cache, Header, Record, MAGIC, VERSION};
+    use crate::modules::count::CountResult;
+    use crate::{Command, Utf8Mode};
+    use std::path::{Path, PathBuf};
+    use std::time::{Duration, SystemTime};
+    use std::{env, fs, mem, process};
+
+    const COUNTED: CountResult = CountResult { bytes: 12, characters: 11, lines: 1, words: 2 };
+
+    // A directory with a file that was last modified long enough ago to be
+    // stored
+    fn directory(name: &str) -> (PathBuf, PathBuf) {
+        let directory = env::temp_dir().join(format!("count-cache-{}-{name}", process::id()));
+        fs::create_dir_all(&directory).unwrap();
+        let text = directory.join("text.txt");
+        write_old(&text, "héllo world\n");
+        (directory, text)
+    }
+
+    fn write_old(path: &Path, content: &str) {
+        fs::write(path, content).unwrap();
+        let file = fs::File::options().write(true).open(path).unwrap();
+        file.set_modified(SystemTime::now() - Duration::from_secs(3600)).unwrap();
+    }
+
+    fn lookup(cache: &Cache, path: &Path, command: Command, utf8: Utf8Mode) -> Option<CountResult> {
+        cache.lookup(path, command, utf8).unwrap().1
+    }
+
+    #[test]
+    fn stored_counts_are_found_after_saving() {
+        let (directory, text) = directory("round-trip");
+        let cache_path = directory.join("cache");
+        let cache = Cache::open(&cache_path);
+        let (identity, found) = cache.lookup(&text, Command::All, Utf8Mode::Strict).unwrap();
+        assert_eq!(found, None);
+        cache.store(&identity, Command::All, Utf8Mode::Strict, COUNTED);
+        assert_eq!(lookup(&cache, &text, Command::All, Utf8Mode::Strict), Some(COUNTED));
+        cache.save();
+
+        let cache = Cache::open(&cache_path);
+        assert_eq!(lookup(&cache, &text, Command::All, Utf8Mode::Strict), Some(COUNTED));
+        // A validated count of everything answers every other command
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), Some(COUNTED));
+        assert_eq!(lookup(&cache, &text, Command::Characters, Utf8Mode::Lossy), Some(COUNTED));
+        assert!(cache.lookup(&text, Command::Version, Utf8Mode::Raw).is_err());
+        drop(cache);
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn counts_without_what_is_looked_up_arent_found() {
+        let (directory, text) = directory("flags");
+        let cache = Cache::open(&directory.join("cache"));
+        let (identity, _) = cache.lookup(&text, Command::Characters, Utf8Mode::Raw).unwrap();
+        cache.store(&identity, Command::Characters, Utf8Mode::Raw, COUNTED);
+        assert_eq!(lookup(&cache, &text, Command::Characters, Utf8Mode::Lossy), None);
+        assert_eq!(lookup(&cache, &text, Command::All, Utf8Mode::Raw), None);
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), Some(COUNTED));
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn counts_of_different_runs_are_kept_together() {
+        let (directory, text) = directory("merge");
+        let cache_path = directory.join("cache");
+        let lossy = CountResult { characters: 10, ..COUNTED };
+        for (command, utf8, result) in [
+            (Command::Bytes, Utf8Mode::Raw, COUNTED),
+            (Command::Characters, Utf8Mode::Lossy, lossy),
+            (Command::All, Utf8Mode::Raw, COUNTED),
+        ] {
+            let cache = Cache::open(&cache_path);
+            let (identity, _) = cache.lookup(&text, command, utf8).unwrap();
+            cache.store(&identity, command, utf8, result);
+            cache.save();
+        }
+
+        // The byte count is covered by the others, which each have a count
+        // that the other one doesn't
+        let cache = Cache::open(&cache_path);
+        assert_eq!(cache.records().len(), 2);
+        assert_eq!(lookup(&cache, &text, Command::Characters, Utf8Mode::Lossy), Some(lossy));
+        assert_eq!(lookup(&cache, &text, Command::All, Utf8Mode::Raw), Some(COUNTED));
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw).map(|result| result.bytes), Some(COUNTED.bytes));
+
+        // A new version of the file replaces all of them
+        write_old(&text, "hello world, again\n");
+        let (identity, _) = cache.lookup(&text, Command::Bytes, Utf8Mode::Raw).unwrap();
+        cache.store(&identity, Command::Bytes, Utf8Mode::Raw, COUNTED);
+        cache.save();
+        let cache = Cache::open(&cache_path);
+        assert_eq!(cache.records().len(), 1);
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), Some(COUNTED));
+        assert_eq!(fs::read_dir(&directory).unwrap().count(), 2, "temporary files are left");
+        drop(cache);
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn changed_files_arent_found() {
+        let (directory, text) = directory("changed");
+        let cache_path = directory.join("cache");
+        let cache = Cache::open(&cache_path);
+        let (identity, _) = cache.lookup(&text, Command::Bytes, Utf8Mode::Raw).unwrap();
+        cache.store(&identity, Command::Bytes, Utf8Mode::Raw, COUNTED);
+        cache.save();
+
+        write_old(&text, "hello world, again\n");
+        let cache = Cache::open(&cache_path);
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), None);
+        drop(cache);
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn recently_modified_files_arent_stored() {
+        let (directory, text) = directory("racy");
+        fs::write(&text, "just now\n").unwrap();
+        let cache = Cache::open(&directory.join("cache"));
+        let (identity, _) = cache.lookup(&text, Command::Bytes, Utf8Mode::Raw).unwrap();
+        cache.store(&identity, Command::Bytes, Utf8Mode::Raw, COUNTED);
+        assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), None);
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn invalid_cache_files_are_ignored() {
+        let (directory, text) = directory("invalid");
+        let cache_path = directory.join("cache");
+        let cache = Cache::open(&cache_path);
+        let (identity, _) = cache.lookup(&text, Command::Bytes, Utf8Mode::Raw).unwrap();
+        cache.store(&identity, Command::Bytes, Utf8Mode::Raw, COUNTED);
+        cache.save();
+        let valid = fs::read(&cache_path).unwrap();
+        assert!(Cache::is_valid(&valid));
+
+        let record_size = mem::size_of::<Record>();
+        let mut wrong_magic = valid.clone();
+        wrong_magic[0] ^= 1;
+        let mut wrong_version = valid.clone();
+        wrong_version[MAGIC.len()..MAGIC.len() + 4].copy_from_slice(&(VERSION + 1).to_ne_bytes());
+        let mut extra_record = valid.clone();
+        extra_record.extend_from_slice(&valid[valid.len() - record_size..]);
+        for (content, what) in [
+            (&valid[..mem::size_of::<Header>() - 1], "a cut-off header"),
+            (&valid[..valid.len() - 1], "a cut-off record"),
+            (&wrong_magic[..], "the wrong magic"),
+            (&wrong_version[..], "the wrong version"),
+            (&extra_record[..], "more records than the header says"),
+        ] {
+            assert!(!Cache::is_valid(content), "{what}");
+            fs::write(&cache_path, content).unwrap();
+            let cache = Cache::open(&cache_path);
+            assert_eq!(lookup(&cache, &text, Command::Bytes, Utf8Mode::Raw), None, "{what}");
+        }
+        fs::remove_dir_all(&directory).unwrap();
+    }
+}
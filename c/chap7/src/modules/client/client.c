@@ -0,0 +1,229 @@
+#include "client.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The protocol, which must match src/modules/server.rs. All fields are in
+// native byte order.
+#define CLIENT_MAGIC ((uint32_t)'C' | (uint32_t)'N' << 8 | (uint32_t)'T' << 16 | (uint32_t)'2' << 24)
+#define CLIENT_KIND_COUNT 1
+#define CLIENT_KIND_SHUTDOWN 2
+#define CLIENT_STATUS_OK 0
+#define CLIENT_MAX_FILES (1u << 20)
+#define CLIENT_MAX_FILENAME_LENGTH (1u << 16)
+#define CLIENT_MAX_MESSAGE_LENGTH (1u << 16)
+
+// A server that has gone away fails the request, instead of raising SIGPIPE
+// in the caller: per send where the flag exists, and otherwise (on macOS and
+// the BSDs without it) for the socket, see count_client_connect()
+#ifdef MSG_NOSIGNAL
+#define CLIENT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define CLIENT_SEND_FLAGS 0
+#endif
+
+typedef struct RequestHeader {
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t command;
+    uint32_t utf8;
+    uint32_t count;
+    uint32_t reserved;
+} RequestHeader;
+
+typedef struct ResponseHeader {
+    uint32_t magic;
+    uint32_t status;
+    uint32_t count;
+    uint32_t reserved;
+} ResponseHeader;
+
+typedef struct ResponseRecord {
+    uint32_t status;
+    uint32_t message_length;
+    CountResult result;
+} ResponseRecord;
+
+struct CountClient {
+    int fd;
+    // The messages of the files of the last request, NULL for the files that
+    // were counted
+    char** messages;
+    size_t message_count;
+};
+
+static bool send_all(int fd, const void* data, size_t length);
+static bool receive_all(int fd, void* data, size_t length);
+static bool receive_header(int fd, uint32_t count);
+static void free_messages(CountClient* client);
+
+CountClient* count_client_connect(const char* socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof address.sun_path) {
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    const int no_sigpipe = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof no_sigpipe) != 0) {
+        close(fd);
+        return NULL;
+    }
+#endif
+    if (connect(fd, (const struct sockaddr*)&address, sizeof address) != 0) {
+        close(fd);
+        return NULL;
+    }
+    CountClient* client = malloc(sizeof *client);
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->messages = NULL;
+    client->message_count = 0;
+    return client;
+}
+
+bool count_client_count(CountClient* client, const Command command, const Utf8Mode utf8,
+                        const char* const* filenames, const size_t count, CountResult* results, bool* counted) {
+    free_messages(client);
+    if (count > CLIENT_MAX_FILES) {
+        return false;
+    }
+
+    // The whole request is sent at once, so the server doesn't wake up for
+    // every filename
+    size_t length = sizeof(RequestHeader);
+    for (size_t i = 0; i < count; i++) {
+        const size_t filename_length = strlen(filenames[i]);
+        if (filename_length > CLIENT_MAX_FILENAME_LENGTH) {
+            return false;
+        }
+        length += sizeof(uint32_t) + filename_length;
+    }
+    uint8_t* request = malloc(length);
+    if (request == NULL) {
+        return false;
+    }
+    const RequestHeader header = {
+        .magic = CLIENT_MAGIC,
+        .kind = CLIENT_KIND_COUNT,
+        .command = (uint32_t)command,
+        .utf8 = (uint32_t)utf8,
+        .count = (uint32_t)count,
+    };
+    memcpy(request, &header, sizeof header);
+    size_t offset = sizeof header;
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t filename_length = (uint32_t)strlen(filenames[i]);
+        memcpy(request + offset, &filename_length, sizeof filename_length);
+        offset += sizeof filename_length;
+        memcpy(request + offset, filenames[i], filename_length);
+        offset += filename_length;
+    }
+    const bool sent = send_all(client->fd, request, length);
+    free(request);
+    if (!sent || !receive_header(client->fd, (uint32_t)count)) {
+        return false;
+    }
+
+    client->messages = calloc(count, sizeof *client->messages);
+    if (count > 0 && client->messages == NULL) {
+        return false;
+    }
+    client->message_count = count;
+    for (size_t i = 0; i < count; i++) {
+        ResponseRecord record;
+        if (!receive_all(client->fd, &record, sizeof record) || record.message_length > CLIENT_MAX_MESSAGE_LENGTH) {
+            return false;
+        }
+        counted[i] = record.status == CLIENT_STATUS_OK;
+        results[i] = counted[i] ? record.result : (CountResult){0};
+        if (!counted[i]) {
+            char* message = malloc(record.message_length + 1);
+            if (message == NULL) {
+                return false;
+            }
+            client->messages[i] = message;
+            if (!receive_all(client->fd, message, record.message_length)) {
+                return false;
+            }
+            message[record.message_length] = '\0';
+        }
+    }
+    return true;
+}
+
+const char* count_client_message(const CountClient* client, const size_t index) {
+    return index < client->message_count ? client->messages[index] : NULL;
+}
+
+bool count_client_shutdown(CountClient* client) {
+    const RequestHeader header = {.magic = CLIENT_MAGIC, .kind = CLIENT_KIND_SHUTDOWN};
+    return send_all(client->fd, &header, sizeof header) && receive_header(client->fd, 0);
+}
+
+void count_client_close(CountClient* client) {
+    free_messages(client);
+    close(client->fd);
+    free(client);
+}
+
+static bool send_all(const int fd, const void* data, const size_t length) {
+    const uint8_t* bytes = data;
+    size_t sent = 0;
+    while (sent < length) {
+        const ssize_t written = send(fd, bytes + sent, length - sent, CLIENT_SEND_FLAGS);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        sent += (size_t)written;
+    }
+    return true;
+}
+
+static bool receive_all(const int fd, void* data, const size_t length) {
+    uint8_t* bytes = data;
+    size_t received = 0;
+    while (received < length) {
+        const ssize_t n = recv(fd, bytes + received, length - received, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        received += (size_t)n;
+    }
+    return true;
+}
+
+// Reads a response header, and checks that it answers the request
+static bool receive_header(const int fd, const uint32_t count) {
+    ResponseHeader header;
+    return receive_all(fd, &header, sizeof header) && header.magic == CLIENT_MAGIC &&
+           header.status == CLIENT_STATUS_OK && header.count == count;
+}
+
+static void free_messages(CountClient* client) {
+    for (size_t i = 0; i < client->message_count; i++) {
+        free(client->messages[i]);
+    }
+    free(client->messages);
+    client->messages = NULL;
+    client->message_count = 0;
+}
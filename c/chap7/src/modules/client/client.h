@@ -0,0 +1,32 @@
+#pragma once
+
+#include "bindings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A connection to a server started with `count serve <socket>`, which keeps
+// its worker threads and cache around between requests, so a caller that
+// counts files over and over doesn't pay for starting the process each time.
+typedef struct CountClient CountClient;
+
+// Returns NULL if there's no server listening at `socket_path`.
+CountClient* count_client_connect(const char* socket_path);
+
+// Counts `count` files, and stores their results in `results`. `counted[i]`
+// is set to whether the server could count `filenames[i]`, since a file that
+// can't be read, or isn't valid UTF-8 in strict mode, only fails itself.
+// Returns false if the request as a whole failed, and then the connection
+// can't be used any more.
+bool count_client_count(CountClient* client, Command command, Utf8Mode utf8, const char* const* filenames, size_t count,
+                        CountResult* results, bool* counted);
+
+// The message of why `filenames[index]` of the last count_client_count()
+// couldn't be counted, which doesn't name the file, or NULL if it was
+// counted. Stays valid until the next request or count_client_close().
+const char* count_client_message(const CountClient* client, size_t index);
+
+// Asks the server to stop, which also closes the connections of other clients.
+bool count_client_shutdown(CountClient* client);
+
+void count_client_close(CountClient* client);
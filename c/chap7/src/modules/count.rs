@@ -0,0 +1,500 @@
+mod ffi {
+    use super::{CountResult, FileView};
+    use crate::modules::arena::Arena;
+    use crate::modules::error::{self, Status};
+    use crate::{Command, Utf8Mode};
+    use std::ffi::CStr;
+    use std::os::raw::c_char;
+    use std::{ptr, slice};
+
+    /// Exits with a message if `text` isn't valid UTF-8, like
+    /// `count_characters_strict()`.
+    #[no_mangle]
+    pub extern "C" fn count_characters(text: *const c_char) -> u64 {
+        let text = unsafe { CStr::from_ptr(text) };
+        error::or_exit(|| super::count_characters_strict(text.to_bytes()))
+    }
+
+    #[no_mangle]
+    pub extern "C" fn count_characters_len(data: *const u8, length: usize) -> u64 {
+        super::count_characters(unsafe { bytes(data, length) })
+    }
+
+    /// Exits with a message if the data isn't valid UTF-8.
+    #[no_mangle]
+    pub extern "C" fn count_characters_strict(data: *const u8, length: usize) -> u64 {
+        let data = unsafe { bytes(data, length) };
+        error::or_exit(|| super::count_characters_strict(data))
+    }
+
+    #[no_mangle]
+    pub extern "C" fn count_characters_lossy(data: *const u8, length: usize) -> u64 {
+        super::count_characters_lossy(unsafe { bytes(data, length) })
+    }
+
+    /// Counts `count` files in one call, writing the result for `files[i]`
+    /// to `results[i]`, and whether it could be counted to `statuses[i]`. A
+    /// file that fails doesn't stop the others, and its error's message is
+    /// written to `messages[i]`, allocated from `arena`. The messages of
+    /// files that were counted are set to NULL. Every file fails for a
+    /// command that doesn't count.
+    #[no_mangle]
+    pub extern "C" fn count_batch(
+        files: *const FileView,
+        count: usize,
+        command: Command,
+        utf8: Utf8Mode,
+        arena: *mut Arena,
+        results: *mut CountResult,
+        statuses: *mut Status,
+        messages: *mut *const c_char,
+    ) {
+        if count == 0 {
+            return;
+        }
+        let count_file = super::count_fn(command, utf8);
+        let files = unsafe { slice::from_raw_parts(files, count) };
+        let results = unsafe { slice::from_raw_parts_mut(results, count) };
+        let statuses = unsafe { slice::from_raw_parts_mut(statuses, count) };
+        let messages = unsafe { slice::from_raw_parts_mut(messages, count) };
+        let arena = unsafe { &mut *arena };
+        for (((file, result), status), message) in files.iter().zip(results).zip(statuses).zip(messages) {
+            *status = match count_file {
+                Some(count_file) => count_file(file.data, file.length, result),
+                None => error::status(|| Err(super::nothing_to_count(command))),
+            };
+            *message = if *status == Status::Ok {
+                ptr::null()
+            } else {
+                arena.alloc_c_str(&error::take_last(*status).message)
+            };
+        }
+    }
+
+    pub(super) unsafe fn bytes<'a>(data: *const u8, length: usize) -> &'a [u8] {
+        if length == 0 { &[] } else { slice::from_raw_parts(data, length) }
+    }
+}
+
+use crate::modules::counter::Counter;
+use crate::modules::error::{self, Error, Status};
+use crate::{Command, Utf8Mode};
+use std::iter::Sum;
+use std::ops::AddAssign;
+use std::str;
+use std::sync::OnceLock;
+
+/// What a command counted. Every command counts the bytes, the other fields
+/// are only filled in by the commands that count them.
+#[repr(C)]
+#[derive(Clone, Copy, Default, PartialEq, Debug)]
+pub struct CountResult {
+    pub bytes: u64,
+    pub characters: u64,
+    pub lines: u64,
+    pub words: u64,
+}
+
+impl AddAssign for CountResult {
+    fn add_assign(&mut self, other: Self) {
+        self.bytes += other.bytes;
+        self.characters += other.characters;
+        self.lines += other.lines;
+        self.words += other.words;
+    }
+}
+
+impl Sum for CountResult {
+    fn sum<I: Iterator<Item = Self>>(results: I) -> Self {
+        results.fold(CountResult::default(), |mut sum, result| {
+            sum += result;
+            sum
+        })
+    }
+}
+
+/// A view of data owned by someone else, usually the content of a file.
+#[repr(C)]
+pub struct FileView {
+    pub data: *const u8,
+    pub length: usize,
+}
+
+type Kernel = unsafe fn(&[u8]) -> u64;
+type AllKernel = unsafe fn(&[u8], &mut CountResult, bool) -> bool;
+
+/// Counts the characters in UTF-8 encoded `bytes` without validating them.
+///
+/// Every byte that isn't a continuation byte (`0b10xx_xxxx`) starts a new
+/// character, so this is a plain byte classification that runs on the widest
+/// SIMD instruction set the CPU supports.
+pub fn count_characters(bytes: &[u8]) -> u64 {
+    static KERNEL: OnceLock<Kernel> = OnceLock::new();
+    let kernel = KERNEL.get_or_init(select_kernel);
+    unsafe { kernel(bytes) }
+}
+
+/// Like `count_characters()`, but fails with `Status::InvalidUtf8` if
+/// `bytes` is not valid UTF-8.
+pub fn count_characters_strict(bytes: &[u8]) -> Result<u64, Error> {
+    let text = str::from_utf8(bytes)
+        .map_err(|error| Error::new(Status::InvalidUtf8, format!("Unicode conversion failed: {error}")))?;
+    Ok(count_characters(text.as_bytes()))
+}
+
+/// Counts the characters that `String::from_utf8_lossy()` would turn `bytes`
+/// into, without making that copy: every invalid sequence counts as one
+/// replacement character.
+pub fn count_characters_lossy(bytes: &[u8]) -> u64 {
+    bytes
+        .utf8_chunks()
+        .map(|chunk| count_characters(chunk.valid().as_bytes()) + !chunk.invalid().is_empty() as u64)
+        .sum()
+}
+
+/// Adds the characters, lines and words in UTF-8 encoded `bytes` to `result`,
+/// in a single pass that doesn't validate them.
+///
+/// Words are runs of bytes other than ASCII whitespace, as with `wc`. Since
+/// one can continue from the previous chunk, `after_space` tells whether the
+/// byte before `bytes` was whitespace (or there was none). The same is
+/// returned for the last byte of `bytes`, to pass on with the next chunk.
+pub fn count_all(bytes: &[u8], result: &mut CountResult, after_space: bool) -> bool {
+    static KERNEL: OnceLock<AllKernel> = OnceLock::new();
+    let kernel = KERNEL.get_or_init(select_all_kernel);
+    unsafe { kernel(bytes, result, after_space) }
+}
+
+/// Counts a whole file, for one command and UTF-8 mode, into `result`. The
+/// result is only written if the status is `Status_Ok`, see
+/// `count_error_message()` otherwise.
+pub type CountFn = extern "C" fn(data: *const u8, length: usize, result: *mut CountResult) -> Status;
+
+// Commands and UTF-8 modes as const generic parameters, which can't be enums
+pub const BYTES: u8 = Command::Bytes as u8;
+pub const CHARACTERS: u8 = Command::Characters as u8;
+pub const ALL: u8 = Command::All as u8;
+pub const RAW: u8 = Utf8Mode::Raw as u8;
+pub const LOSSY: u8 = Utf8Mode::Lossy as u8;
+pub const STRICT: u8 = Utf8Mode::Strict as u8;
+
+/// Returns the instance of `count_file()` for `command` and `utf8`, or `None`
+/// for the commands that don't count. This is chosen once by `parse_args()`,
+/// so counting a file doesn't look at either of them again.
+pub fn count_fn(command: Command, utf8: Utf8Mode) -> Option<CountFn> {
+    Some(match (command, utf8) {
+        // Byte counts don't look at the text
+        (Command::Bytes, _) => count_file::<BYTES, RAW>,
+        (Command::Characters, Utf8Mode::Raw) => count_file::<CHARACTERS, RAW>,
+        (Command::Characters, Utf8Mode::Lossy) => count_file::<CHARACTERS, LOSSY>,
+        (Command::Characters, Utf8Mode::Strict) => count_file::<CHARACTERS, STRICT>,
+        (Command::All, Utf8Mode::Raw) => count_file::<ALL, RAW>,
+        (Command::All, Utf8Mode::Lossy) => count_file::<ALL, LOSSY>,
+        (Command::All, Utf8Mode::Strict) => count_file::<ALL, STRICT>,
+        (Command::Version | Command::Serve, _) => return None,
+    })
+}
+
+/// The error for a command that doesn't count, like `version`, where a
+/// count was asked for.
+pub fn nothing_to_count(command: Command) -> Error {
+    Error::new(Status::Failed, format!("Nothing to count for command: {}", command.name()))
+}
+
+extern "C" fn count_file<const COMMAND: u8, const UTF8: u8>(data: *const u8, length: usize, result: *mut CountResult) -> Status {
+    let bytes = unsafe { ffi::bytes(data, length) };
+    error::status(|| count_bytes::<COMMAND, UTF8>(bytes).map(|counted| unsafe { *result = counted }))
+}
+
+fn count_bytes<const COMMAND: u8, const UTF8: u8>(bytes: &[u8]) -> Result<CountResult, Error> {
+    let mut result = CountResult { bytes: bytes.len() as u64, ..CountResult::default() };
+    if COMMAND == CHARACTERS {
+        result.characters = match UTF8 {
+            RAW => count_characters(bytes),
+            LOSSY => count_characters_lossy(bytes),
+            _ => count_characters_strict(bytes)?,
+        };
+    } else if COMMAND == ALL && UTF8 == RAW {
+        count_all(bytes, &mut result, true);
+    } else if COMMAND == ALL {
+        // The counter validates and counts in one go, one valid part at a time
+        let mut counter = Counter::new(Command::All, utf8_mode(UTF8));
+        counter.feed(bytes)?;
+        result = counter.finish()?;
+    }
+    Ok(result)
+}
+
+pub const fn utf8_mode(value: u8) -> Utf8Mode {
+    match value {
+        RAW => Utf8Mode::Raw,
+        LOSSY => Utf8Mode::Lossy,
+        _ => Utf8Mode::Strict,
+    }
+}
+
+fn select_kernel() -> Kernel {
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return x86::count_avx2;
+        }
+        if is_x86_feature_detected!("sse2") {
+            return x86::count_sse2;
+        }
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        if std::arch::is_aarch64_feature_detected!("neon") {
+            return neon::count_neon;
+        }
+    }
+    count_scalar
+}
+
+fn count_scalar(bytes: &[u8]) -> u64 {
+    bytes.iter().filter(|&&byte| is_char_start(byte)).count() as u64
+}
+
+fn select_all_kernel() -> AllKernel {
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    {
+        if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("popcnt") {
+            return x86::count_all_avx2;
+        }
+        if is_x86_feature_detected!("sse2") {
+            return x86::count_all_sse2;
+        }
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        if std::arch::is_aarch64_feature_detected!("neon") {
+            return neon::count_all_neon;
+        }
+    }
+    count_all_scalar
+}
+
+fn count_all_scalar(bytes: &[u8], result: &mut CountResult, mut after_space: bool) -> bool {
+    for &byte in bytes {
+        let space = is_space(byte);
+        result.characters += is_char_start(byte) as u64;
+        result.lines += (byte == b'\n') as u64;
+        result.words += (after_space && !space) as u64;
+        after_space = space;
+    }
+    after_space
+}
+
+#[inline]
+fn is_char_start(byte: u8) -> bool {
+    // Continuation bytes are 0x80..=0xBF, i.e. -128..=-65 as a signed byte.
+    (byte as i8) >= -64
+}
+
+#[inline]
+pub fn is_space(byte: u8) -> bool {
+    // The same bytes as C's isspace() in the "C" locale: ' ' and \t..=\r
+    byte == b' ' || byte.wrapping_sub(b'\t') <= b'\r' - b'\t'
+}
+
+// The SIMD kernels count in 8-bit lanes, which are flushed into 64-bit sums
+// before they can overflow, i.e. at least every 255 vectors.
+const FLUSH_INTERVAL: usize = 255;
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod x86 {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    use super::{count_all_scalar, count_scalar, CountResult, FLUSH_INTERVAL};
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn count_avx2(bytes: &[u8]) -> u64 {
+        let threshold = _mm256_set1_epi8(-65);
+        let zero = _mm256_setzero_si256();
+        let mut chunks = bytes.chunks_exact(32);
+        let mut sums = zero;
+        let mut counts = zero;
+        let mut pending = 0;
+        for chunk in &mut chunks {
+            let value = _mm256_loadu_si256(chunk.as_ptr() as *const __m256i);
+            // Lanes that start a character compare as -1, so subtracting adds one.
+            counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(value, threshold));
+            pending += 1;
+            if pending == FLUSH_INTERVAL {
+                sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, zero));
+                counts = zero;
+                pending = 0;
+            }
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, zero));
+
+        let mut lanes = [0u64; 4];
+        _mm256_storeu_si256(lanes.as_mut_ptr() as *mut __m256i, sums);
+        lanes.iter().sum::<u64>() + count_scalar(chunks.remainder())
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn count_sse2(bytes: &[u8]) -> u64 {
+        let threshold = _mm_set1_epi8(-65);
+        let zero = _mm_setzero_si128();
+        let mut chunks = bytes.chunks_exact(16);
+        let mut sums = zero;
+        let mut counts = zero;
+        let mut pending = 0;
+        for chunk in &mut chunks {
+            let value = _mm_loadu_si128(chunk.as_ptr() as *const __m128i);
+            counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(value, threshold));
+            pending += 1;
+            if pending == FLUSH_INTERVAL {
+                sums = _mm_add_epi64(sums, _mm_sad_epu8(counts, zero));
+                counts = zero;
+                pending = 0;
+            }
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(counts, zero));
+
+        let mut lanes = [0u64; 2];
+        _mm_storeu_si128(lanes.as_mut_ptr() as *mut __m128i, sums);
+        lanes.iter().sum::<u64>() + count_scalar(chunks.remainder())
+    }
+
+    // The fused kernels classify 64 bytes at a time into bit masks with one
+    // bit per byte, and count the bits.
+
+    #[target_feature(enable = "avx2,popcnt")]
+    pub unsafe fn count_all_avx2(bytes: &[u8], result: &mut CountResult, mut after_space: bool) -> bool {
+        let mut blocks = bytes.chunks_exact(64);
+        for block in &mut blocks {
+            let low = classify_avx2(_mm256_loadu_si256(block.as_ptr() as *const __m256i));
+            let high = classify_avx2(_mm256_loadu_si256(block.as_ptr().add(32) as *const __m256i));
+            let masks = [0, 1, 2].map(|i| low[i] | high[i] << 32);
+            after_space = add_masks(result, masks, after_space);
+        }
+        count_all_scalar(blocks.remainder(), result, after_space)
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn count_all_sse2(bytes: &[u8], result: &mut CountResult, mut after_space: bool) -> bool {
+        let mut blocks = bytes.chunks_exact(64);
+        for block in &mut blocks {
+            let mut masks = [0u64; 3];
+            for part in 0..4 {
+                let value = _mm_loadu_si128(block.as_ptr().add(part * 16) as *const __m128i);
+                for (mask, bits) in masks.iter_mut().zip(classify_sse2(value)) {
+                    *mask |= bits << (part * 16);
+                }
+            }
+            after_space = add_masks(result, masks, after_space);
+        }
+        count_all_scalar(blocks.remainder(), result, after_space)
+    }
+
+    /// Returns the masks of the bytes that start a character, newlines, and
+    /// whitespace.
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn classify_avx2(value: __m256i) -> [u64; 3] {
+        let starts = _mm256_cmpgt_epi8(value, _mm256_set1_epi8(-65));
+        let newlines = _mm256_cmpeq_epi8(value, _mm256_set1_epi8(b'\n' as i8));
+        // \t..=\r are the bytes at most 4 above \t, compared as unsigned
+        let control = _mm256_sub_epi8(value, _mm256_set1_epi8(b'\t' as i8));
+        let controls = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+        let spaces = _mm256_or_si256(_mm256_cmpeq_epi8(value, _mm256_set1_epi8(b' ' as i8)), controls);
+        [starts, newlines, spaces].map(|lanes| _mm256_movemask_epi8(lanes) as u32 as u64)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse2")]
+    unsafe fn classify_sse2(value: __m128i) -> [u64; 3] {
+        let starts = _mm_cmpgt_epi8(value, _mm_set1_epi8(-65));
+        let newlines = _mm_cmpeq_epi8(value, _mm_set1_epi8(b'\n' as i8));
+        let control = _mm_sub_epi8(value, _mm_set1_epi8(b'\t' as i8));
+        let controls = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+        let spaces = _mm_or_si128(_mm_cmpeq_epi8(value, _mm_set1_epi8(b' ' as i8)), controls);
+        [starts, newlines, spaces].map(|lanes| _mm_movemask_epi8(lanes) as u16 as u64)
+    }
+
+    // A word starts at every byte that isn't whitespace, but follows some.
+    #[inline(always)]
+    fn add_masks(result: &mut CountResult, [starts, newlines, spaces]: [u64; 3], after_space: bool) -> bool {
+        result.characters += starts.count_ones() as u64;
+        result.lines += newlines.count_ones() as u64;
+        let follows_space = spaces << 1 | after_space as u64;
+        result.words += (follows_space & !spaces).count_ones() as u64;
+        spaces >> 63 != 0
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use std::arch::aarch64::*;
+
+    use super::{count_all_scalar, count_scalar, CountResult, FLUSH_INTERVAL};
+
+    #[target_feature(enable = "neon")]
+    pub unsafe fn count_neon(bytes: &[u8]) -> u64 {
+        let threshold = vdupq_n_s8(-65);
+        let mut chunks = bytes.chunks_exact(16);
+        let mut total = 0u64;
+        let mut counts = vdupq_n_u8(0);
+        let mut pending = 0;
+        for chunk in &mut chunks {
+            let value = vreinterpretq_s8_u8(vld1q_u8(chunk.as_ptr()));
+            counts = vsubq_u8(counts, vcgtq_s8(value, threshold));
+            pending += 1;
+            if pending == FLUSH_INTERVAL {
+                total += vaddlvq_u8(counts) as u64;
+                counts = vdupq_n_u8(0);
+                pending = 0;
+            }
+        }
+        total += vaddlvq_u8(counts) as u64;
+        total + count_scalar(chunks.remainder())
+    }
+
+    // NEON has no movemask, so this counts in 8-bit lanes like count_neon(),
+    // and finds the bytes that follow whitespace by shifting in the last lane
+    // of the previous vector.
+    #[target_feature(enable = "neon")]
+    pub unsafe fn count_all_neon(bytes: &[u8], result: &mut CountResult, after_space: bool) -> bool {
+        let threshold = vdupq_n_s8(-65);
+        let mut chunks = bytes.chunks_exact(16);
+        let mut previous_spaces = vdupq_n_u8(if after_space { 0xFF } else { 0 });
+        let mut counts = [vdupq_n_u8(0); 3];
+        let mut pending = 0;
+        for chunk in &mut chunks {
+            let value = vld1q_u8(chunk.as_ptr());
+            let starts = vcgtq_s8(vreinterpretq_s8_u8(value), threshold);
+            let newlines = vceqq_u8(value, vdupq_n_u8(b'\n'));
+            let controls = vcleq_u8(vsubq_u8(value, vdupq_n_u8(b'\t')), vdupq_n_u8(4));
+            let spaces = vorrq_u8(vceqq_u8(value, vdupq_n_u8(b' ')), controls);
+            let word_starts = vbicq_u8(vextq_u8::<15>(previous_spaces, spaces), spaces);
+            previous_spaces = spaces;
+
+            for (count, lanes) in counts.iter_mut().zip([starts, newlines, word_starts]) {
+                *count = vsubq_u8(*count, lanes);
+            }
+            pending += 1;
+            if pending == FLUSH_INTERVAL {
+                flush(result, &mut counts);
+                pending = 0;
+            }
+        }
+        flush(result, &mut counts);
+        let after_space = vgetq_lane_u8::<15>(previous_spaces) != 0;
+        count_all_scalar(chunks.remainder(), result, after_space)
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn flush(result: &mut CountResult, counts: &mut [uint8x16_t; 3]) {
+        result.characters += vaddlvq_u8(counts[0]) as u64;
+        result.lines += vaddlvq_u8(counts[1]) as u64;
+        result.words += vaddlvq_u8(counts[2]) as u64;
+        *counts = [vdupq_n_u8(0); 3];
+    }
+}
@@ -0,0 +1,316 @@
+mod ffi {
+    use super::Counter;
+    use crate::modules::arena::Arena;
+    use crate::modules::count::CountResult;
+    use crate::modules::error::{self, Status};
+    use crate::{Command, Utf8Mode};
+    use std::alloc::Layout;
+    use std::{ptr, slice};
+
+    #[no_mangle]
+    pub extern "C" fn counter_new(command: Command, utf8: Utf8Mode) -> *mut Counter {
+        Box::into_raw(Box::new(Counter::new(command, utf8)))
+    }
+
+    /// Fails with `Status_InvalidUtf8` for invalid UTF-8 in strict mode,
+    /// after which the counter can only be finished, to free it.
+    #[no_mangle]
+    pub extern "C" fn counter_feed(counter: *mut Counter, data: *const u8, length: usize) -> Status {
+        let counter = unsafe { &mut *counter };
+        if length == 0 {
+            return Status::Ok;
+        }
+        error::status(|| counter.feed(unsafe { slice::from_raw_parts(data, length) }))
+    }
+
+    /// Writes the count to `result` and frees the counter. Fails like
+    /// `counter_feed()` for a sequence that the data ended in the middle of.
+    #[no_mangle]
+    pub extern "C" fn counter_finish(counter: *mut Counter, result: *mut CountResult) -> Status {
+        let counter = unsafe { Box::from_raw(counter) };
+        error::status(|| counter.finish().map(|counted| unsafe { *result = counted }))
+    }
+
+    /// Like `counter_new()`, but places the counter in `arena`. Must be
+    /// finished with `counter_finish_in()`.
+    #[no_mangle]
+    pub extern "C" fn counter_new_in(arena: *mut Arena, command: Command, utf8: Utf8Mode) -> *mut Counter {
+        let arena = unsafe { &mut *arena };
+        let layout = Layout::new::<Counter>();
+        let counter = arena.alloc(layout.size(), layout.align()) as *mut Counter;
+        unsafe { counter.write(Counter::new(command, utf8)) };
+        counter
+    }
+
+    /// Like `counter_finish()`, for a counter created by `counter_new_in()`.
+    /// Its memory is released along with the rest of the arena.
+    #[no_mangle]
+    pub extern "C" fn counter_finish_in(counter: *mut Counter, result: *mut CountResult) -> Status {
+        let counter = unsafe { ptr::read(counter) };
+        error::status(|| counter.finish().map(|counted| unsafe { *result = counted }))
+    }
+}
+
+use crate::modules::count::{self, CountResult, ALL, BYTES, CHARACTERS, LOSSY, RAW, STRICT};
+use crate::modules::error::{Error, Status};
+use crate::{Command, Utf8Mode};
+use std::fmt::Display;
+use std::str;
+
+/// Counts a stream of data that is fed to it chunk by chunk.
+///
+/// Chunks can be split anywhere, also in the middle of a UTF-8 sequence.
+pub struct Counter {
+    command: Command,
+    utf8: Utf8Mode,
+    result: CountResult,
+    // Whether the last byte was whitespace, so a word starts with the next one
+    after_space: bool,
+    // Start of a UTF-8 sequence that continues in the next chunk, only
+    // tracked when the input is validated.
+    pending: [u8; 4],
+    pending_len: usize,
+    // The instance of `feed_with()` for the command and UTF-8 mode
+    feed: fn(&mut Counter, &[u8]) -> Result<(), Error>,
+}
+
+impl Counter {
+    pub fn new(command: Command, utf8: Utf8Mode) -> Self {
+        Counter::continuing(command, utf8, true)
+    }
+
+    /// Like `new()`, for data that continues other data, which ended in
+    /// whitespace if `after_space` is set.
+    pub fn continuing(command: Command, utf8: Utf8Mode, after_space: bool) -> Self {
+        Counter {
+            command,
+            utf8,
+            result: CountResult::default(),
+            after_space,
+            pending: [0; 4],
+            pending_len: 0,
+            feed: match (command, utf8) {
+                (Command::Characters, Utf8Mode::Raw) => Counter::feed_with::<CHARACTERS, RAW>,
+                (Command::Characters, Utf8Mode::Lossy) => Counter::feed_with::<CHARACTERS, LOSSY>,
+                (Command::Characters, Utf8Mode::Strict) => Counter::feed_with::<CHARACTERS, STRICT>,
+                (Command::All, Utf8Mode::Raw) => Counter::feed_with::<ALL, RAW>,
+                (Command::All, Utf8Mode::Lossy) => Counter::feed_with::<ALL, LOSSY>,
+                (Command::All, Utf8Mode::Strict) => Counter::feed_with::<ALL, STRICT>,
+                // Only the bytes are counted, and `finish()` rejects the rest
+                _ => Counter::feed_with::<BYTES, RAW>,
+            },
+        }
+    }
+
+    /// Fails with `Status::InvalidUtf8` for invalid UTF-8 in strict mode.
+    pub fn feed(&mut self, data: &[u8]) -> Result<(), Error> {
+        (self.feed)(self, data)
+    }
+
+    fn feed_with<const COMMAND: u8, const UTF8: u8>(&mut self, data: &[u8]) -> Result<(), Error> {
+        self.result.bytes += data.len() as u64;
+        if COMMAND == BYTES {
+            return Ok(());
+        }
+        if UTF8 == RAW {
+            // Continuation bytes are never counted, and are never whitespace,
+            // so it makes no difference where the chunks are split.
+            self.tally::<COMMAND>(data);
+            Ok(())
+        } else {
+            self.feed_checked::<COMMAND>(data)
+        }
+    }
+
+    fn tally<const COMMAND: u8>(&mut self, text: &[u8]) {
+        if COMMAND == ALL {
+            self.after_space = count::count_all(text, &mut self.result, self.after_space);
+        } else {
+            self.result.characters += count::count_characters(text);
+        }
+    }
+
+    // Counts the valid parts of `data` like `tally()`, and hands the invalid
+    // sequences to `invalid()`. Nothing is copied, except for a sequence that
+    // is split between two chunks.
+    fn feed_checked<const COMMAND: u8>(&mut self, mut data: &[u8]) -> Result<(), Error> {
+        while self.pending_len > 0 {
+            let Some(&byte) = data.first() else { return Ok(()) };
+            let mut sequence = self.pending;
+            sequence[self.pending_len] = byte;
+            let length = self.pending_len + 1;
+            match str::from_utf8(&sequence[..length]) {
+                Ok(_) => {
+                    self.tally::<COMMAND>(&sequence[..length]);
+                    self.pending_len = 0;
+                }
+                Err(error) if error.error_len().is_none() => {
+                    self.pending = sequence;
+                    self.pending_len = length;
+                }
+                // The byte doesn't continue the sequence, so only the pending
+                // bytes are invalid, and the byte is looked at again below
+                Err(error) => {
+                    self.invalid(&error)?;
+                    self.pending_len = 0;
+                    continue;
+                }
+            }
+            data = &data[1..];
+        }
+
+        loop {
+            let error = match str::from_utf8(data) {
+                Ok(_) => {
+                    self.tally::<COMMAND>(data);
+                    return Ok(());
+                }
+                Err(error) => error,
+            };
+            let (valid, rest) = data.split_at(error.valid_up_to());
+            self.tally::<COMMAND>(valid);
+            match error.error_len() {
+                Some(length) => {
+                    self.invalid(&error)?;
+                    data = &rest[length..];
+                }
+                None => {
+                    self.pending[..rest.len()].copy_from_slice(rest);
+                    self.pending_len = rest.len();
+                    return Ok(());
+                }
+            }
+        }
+    }
+
+    // Counts an invalid sequence as the replacement character that a lossy
+    // conversion puts in its place, which is never whitespace. In strict
+    // mode, it fails the file. Invalid sequences are rare enough to look at the
+    // mode here.
+    fn invalid(&mut self, error: &dyn Display) -> Result<(), Error> {
+        if self.utf8 == Utf8Mode::Strict {
+            return Err(Error::new(Status::InvalidUtf8, format!("Unicode conversion failed: {error}")));
+        }
+        self.result.characters += 1;
+        if self.command == Command::All {
+            self.result.words += self.after_space as u64;
+            self.after_space = false;
+        }
+        Ok(())
+    }
+
+    /// Fails like `feed()` for a sequence that the data ended in the middle
+    /// of, and for a command that doesn't count.
+    pub fn finish(mut self) -> Result<CountResult, Error> {
+        if matches!(self.command, Command::Version | Command::Serve) {
+            return Err(count::nothing_to_count(self.command));
+        }
+        if self.pending_len > 0 {
+            self.invalid(&"incomplete sequence at end of input")?;
+        }
+        Ok(self.result)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Counter;
+    use crate::modules::count::{self, CountResult};
+    use crate::modules::error::{Error, Status};
+    use crate::{Command, Utf8Mode};
+
+    // Sequences of every length, next to whitespace and to each other
+    const TEXT: &str = "héllo wörld\n€uro\t\u{1D11E}clef  \r\nend€\u{1D11E}é\n";
+
+    // Valid UTF-8 around an invalid byte, an overlong encoding, a surrogate
+    // and a sequence that is cut off by whitespace
+    const INVALID: &[u8] = b"a\xFFb \xC0\xAF\xED\xA0\x80 \xE2\x82 c\xF0\x9D\x84\n";
+
+    fn count_chunks(data: &[u8], size: usize, command: Command, utf8: Utf8Mode) -> Result<CountResult, Error> {
+        let mut counter = Counter::new(command, utf8);
+        for chunk in data.chunks(size) {
+            counter.feed(chunk)?;
+        }
+        counter.finish()
+    }
+
+    // Counts `data` in one go, like `count_file()`
+    fn count_whole(data: &[u8], command: Command, utf8: Utf8Mode) -> CountResult {
+        let text = String::from_utf8_lossy(data);
+        let mut result = CountResult { bytes: data.len() as u64, ..CountResult::default() };
+        match (command, utf8) {
+            (Command::All, Utf8Mode::Raw) => {
+                count::count_all(data, &mut result, true);
+            }
+            (Command::All, _) => {
+                count::count_all(text.as_bytes(), &mut result, true);
+            }
+            (Command::Characters, Utf8Mode::Raw) => result.characters = count::count_characters(data),
+            (Command::Characters, _) => result.characters = count::count_characters_lossy(data),
+            _ => {}
+        }
+        result
+    }
+
+    #[test]
+    fn chunks_count_like_the_whole_text() {
+        // Long enough for the vector loops of the kernels
+        let data = TEXT.repeat(16);
+        let data = data.as_bytes();
+        for command in [Command::Bytes, Command::Characters, Command::All] {
+            for utf8 in [Utf8Mode::Raw, Utf8Mode::Lossy, Utf8Mode::Strict] {
+                let expected = count_whole(data, command, utf8);
+                for size in 1..=TEXT.len() + 1 {
+                    let counted = count_chunks(data, size, command, utf8).unwrap();
+                    assert_eq!(counted, expected, "chunks of {size}");
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn chunks_count_invalid_sequences_like_a_lossy_conversion() {
+        for command in [Command::Characters, Command::All] {
+            let expected = count_whole(INVALID, command, Utf8Mode::Lossy);
+            for size in 1..=INVALID.len() {
+                let counted = count_chunks(INVALID, size, command, Utf8Mode::Lossy).unwrap();
+                assert_eq!(counted, expected, "chunks of {size}");
+            }
+        }
+    }
+
+    #[test]
+    fn incomplete_sequence_at_the_end_counts_once() {
+        let data = "a€".as_bytes();
+        let data = &data[..data.len() - 1];
+        for size in 1..=data.len() {
+            let counted = count_chunks(data, size, Command::All, Utf8Mode::Lossy).unwrap();
+            assert_eq!(counted, CountResult { bytes: 3, characters: 2, lines: 0, words: 1 }, "chunks of {size}");
+        }
+    }
+
+    #[test]
+    fn strict_mode_fails_on_invalid_utf8() {
+        for size in 1..=INVALID.len() {
+            let error = count_chunks(INVALID, size, Command::Characters, Utf8Mode::Strict).unwrap_err();
+            assert_eq!(error.status, Status::InvalidUtf8, "chunks of {size}");
+        }
+        let error = count_chunks(b"a\xE2\x82", 1, Command::All, Utf8Mode::Strict).unwrap_err();
+        assert_eq!(error.status, Status::InvalidUtf8);
+    }
+
+    #[test]
+    fn continuing_after_a_word_doesnt_count_it_again() {
+        let mut counter = Counter::continuing(Command::All, Utf8Mode::Lossy, false);
+        counter.feed(b"rest of it").unwrap();
+        assert_eq!(counter.finish().unwrap(), CountResult { bytes: 10, characters: 10, lines: 0, words: 2 });
+    }
+
+    #[test]
+    fn commands_that_dont_count_fail() {
+        for command in [Command::Version, Command::Serve] {
+            let counter = Counter::new(command, Utf8Mode::Raw);
+            assert_eq!(counter.finish().unwrap_err().status, Status::Failed);
+        }
+    }
+}
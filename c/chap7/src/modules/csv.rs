@@ -1,50 +1,341 @@
-mod ffi {
-    use std::ffi::{c_void, CStr, CString};
+// The walk module runs the same C callbacks for the files it finds
+pub(super) mod ffi {
+    use crate::modules::count::CountResult;
+    use crate::modules::dedup::Dedup;
+    use crate::modules::error::{self, Error, Status};
+    use crate::modules::file;
+    use crate::modules::manifest::{Manifest, ValueQueue};
+    use crate::modules::pipeline;
+    use crate::{Command, Utf8Mode};
+    use std::cell::RefCell;
+    use std::ffi::c_void;
     use std::os::raw::c_char;
+    use std::sync::atomic::AtomicBool;
 
+    /// Calls `c_callback` for every file listed in the manifest at the path
+    /// `manifest`, which is read as it is parsed. Like the other functions
+    /// that read a manifest, this exits with a message if it can't be read.
+    ///
+    /// If `dedup` isn't NULL, the listings that repeat a file are left out,
+    /// to be printed through `dedup_pass()`. The same goes for the other
+    /// functions that take one.
     #[no_mangle]
     pub extern "C" fn csv_for_each_value(
-        csv: *const c_char,
+        manifest: *const c_char,
+        dedup: *const Dedup,
         c_callback: unsafe extern "C" fn(*const c_char, *const c_void),
         context: *const c_void,
     ) {
-        let csv = unsafe { CStr::from_ptr(csv) }.to_str().unwrap();
-        super::for_each_value(csv, |value| {
-            let value = CString::new(value).unwrap();
-            unsafe { c_callback(value.as_ptr(), context) };
+        let dedup = unsafe { dedup.as_ref() };
+        let mut scratch = ScratchString::new();
+        error::or_exit(|| {
+            let manifest = unsafe { file::c_path(manifest) }?;
+            super::for_each_value(manifest, |value| {
+                if dedup.map_or(true, |dedup| dedup.admit(value)) {
+                    unsafe { c_callback(scratch.set(value), context) };
+                }
+            })
         });
     }
 
+    /// Calls `c_calculate` for every value from `jobs` threads at once, and
+    /// passes each result on to `c_emit`, with the status that `c_calculate`
+    /// returned. For a status other than `Status_Ok`, the result is empty,
+    /// and `count_error_message()` returns the error's message during the
+    /// call, even though it was set on the worker's thread.
+    ///
+    /// `c_calculate` must be thread-safe. Its second argument is the index of
+    /// the calling worker, below `jobs`, which can be used to pick per-worker
+    /// state from `context`. `c_emit` is only ever called from the calling
+    /// thread, in list order if `ordered` is set, and otherwise as soon as
+    /// each result is ready.
     #[no_mangle]
-    pub extern "C" fn csv_merge_files(
-        csv: *mut c_char,
-        free_csv: unsafe extern "C" fn(*mut c_char),
-    ) -> *mut c_char {
-        let csv_str = unsafe { CStr::from_ptr(csv) }.to_str().unwrap();
-        let merged = super::merge_files(&csv_str);
-        unsafe { free_csv(csv); }
-        CString::new(merged).unwrap().into_raw()
+    pub extern "C" fn csv_for_each_value_parallel(
+        manifest: *const c_char,
+        dedup: *const Dedup,
+        c_calculate: unsafe extern "C" fn(*const c_char, usize, *const c_void, *mut CountResult) -> Status,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+        jobs: usize,
+        ordered: bool,
+    ) {
+        let dedup = unsafe { dedup.as_ref() };
+        error::or_exit(|| {
+            let manifest = Manifest::open(unsafe { file::c_path(manifest) }?)?;
+            for_each_value_parallel(
+                Dedup::filter(dedup, |values, consumers, cancelled| manifest.feed(values, consumers, cancelled)),
+                c_calculate,
+                c_emit,
+                context,
+                jobs,
+                ordered,
+            )
+        });
+    }
+
+    /// Counts the listed files in a pipeline of `readers` reading threads and
+    /// `counters` counting threads, and passes each file's result to `c_emit`
+    /// in list order, like `csv_for_each_value_parallel()`. `c_emit` is only
+    /// ever called from the calling thread.
+    #[no_mangle]
+    pub extern "C" fn csv_count_pipelined(
+        manifest: *const c_char,
+        dedup: *const Dedup,
+        command: Command,
+        utf8: Utf8Mode,
+        readers: usize,
+        counters: usize,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+    ) {
+        let dedup = unsafe { dedup.as_ref() };
+        error::or_exit(|| {
+            let manifest = Manifest::open(unsafe { file::c_path(manifest) }?)?;
+            count_pipelined(
+                Dedup::filter(dedup, |values, consumers, cancelled| manifest.feed(values, consumers, cancelled)),
+                command,
+                utf8,
+                readers,
+                counters,
+                c_emit,
+                context,
+            )
+        });
+    }
+
+    /// Like `csv_for_each_value()`, for values that `feed` produces on a
+    /// thread of its own.
+    pub fn for_each_fed_value(
+        feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+        c_callback: unsafe extern "C" fn(*const c_char, *const c_void),
+        context: *const c_void,
+    ) -> Result<(), Error> {
+        let mut scratch = ScratchString::new();
+        super::for_each_fed_value(feed, |value| {
+            unsafe { c_callback(scratch.set(value), context) };
+        })
+    }
+
+    /// `csv_for_each_value_parallel()` for values that `feed` produces.
+    pub fn for_each_value_parallel(
+        feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+        c_calculate: unsafe extern "C" fn(*const c_char, usize, *const c_void, *mut CountResult) -> Status,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+        jobs: usize,
+        ordered: bool,
+    ) -> Result<(), Error> {
+        let shared = SharedContext(context);
+        let mut scratch = ScratchString::new();
+        super::for_each_value_parallel(
+            feed,
+            jobs,
+            ordered,
+            |value, worker| {
+                let mut result = CountResult::default();
+                let status = WORKER_SCRATCH.with_borrow_mut(|scratch| unsafe {
+                    c_calculate(scratch.set(value), worker, shared.get(), &mut result)
+                });
+                // The message goes along with the result, to the emitting thread
+                if status == Status::Ok { Ok(result) } else { Err(error::take_last(status)) }
+            },
+            |value, result| emit(&mut scratch, c_emit, value, result, context),
+        )
+    }
+
+    /// `csv_count_pipelined()` for values that `feed` produces.
+    pub fn count_pipelined(
+        feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+        command: Command,
+        utf8: Utf8Mode,
+        readers: usize,
+        counters: usize,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+    ) -> Result<(), Error> {
+        let mut scratch = ScratchString::new();
+        pipeline::run(feed, command, utf8, readers, counters, |value, result| {
+            emit(&mut scratch, c_emit, value, result, context)
+        })
+    }
+
+    fn emit(
+        scratch: &mut ScratchString,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        value: &str,
+        result: Result<CountResult, Error>,
+        context: *const c_void,
+    ) {
+        let (status, result) = match result {
+            Ok(result) => (Status::Ok, result),
+            Err(error) => {
+                let status = error.status;
+                error::set_last(error);
+                (status, CountResult::default())
+            }
+        };
+        unsafe { c_emit(scratch.set(value), status, result, context) };
+    }
+
+    thread_local! {
+        static WORKER_SCRATCH: RefCell<ScratchString> = RefCell::new(ScratchString::new());
     }
 
+    /// Hands out values as NUL-terminated strings, reusing the same buffer
+    /// for all of them. The pointer is only valid until the next call.
+    struct ScratchString(Vec<u8>);
+
+    impl ScratchString {
+        fn new() -> Self {
+            ScratchString(Vec::new())
+        }
+
+        // A value with a NUL byte can't name a file, so it is cut off there.
+        fn set(&mut self, value: &str) -> *const c_char {
+            self.0.clear();
+            self.0.extend_from_slice(value.as_bytes());
+            self.0.push(0);
+            self.0.as_ptr() as *const c_char
+        }
+    }
+
+    // The caller promises that the context can be shared between the workers.
+    struct SharedContext(*const c_void);
+
+    unsafe impl Sync for SharedContext {}
+
+    impl SharedContext {
+        fn get(&self) -> *const c_void {
+            self.0
+        }
+    }
+
+    /// Counts the content of all listed files as if they were merged, loading
+    /// one file at a time. Since a file that can't be counted fails the
+    /// count, that exits with a message as well.
     #[no_mangle]
-    pub extern "C" fn csv_free_merged_file(merged: *mut c_char) {
-        unsafe { CString::from_raw(merged) };
+    pub extern "C" fn csv_count_merged(manifest: *const c_char, command: Command, utf8: Utf8Mode) -> CountResult {
+        error::or_exit(|| super::count_merged(unsafe { file::c_path(manifest) }?, command, utf8))
     }
 }
 
+use crate::modules::count::CountResult;
+use crate::modules::counter::Counter;
+use crate::modules::error::{self, Error};
 use crate::modules::file;
+use crate::modules::manifest::{Manifest, ValueQueue};
+use crate::modules::queue::{self, CancelOnPanic, Queue};
+use crate::modules::stats::{self, Phase};
+use crate::modules::trace;
+use crate::{Command, Utf8Mode};
+use std::collections::BTreeMap;
+use std::path::Path;
+use std::sync::atomic::AtomicBool;
+use std::sync::mpsc;
+use std::thread;
+
+// Values produced ahead of the threads that process them
+const VALUES_PER_JOB: usize = 16;
 
-fn for_each_value(csv: &str, callback: impl Fn(&str)) {
-    for value in csv.split(",") {
-        callback(value.trim());
+fn for_each_value(manifest: &Path, mut callback: impl FnMut(&str)) -> Result<(), Error> {
+    let mut manifest = Manifest::open(manifest)?;
+    while let Some(value) = manifest.next_value()? {
+        callback(value);
     }
+    Ok(())
+}
+
+fn for_each_fed_value(
+    feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+    mut callback: impl FnMut(&str),
+) -> Result<(), Error> {
+    let values: ValueQueue = Queue::with_capacity(VALUES_PER_JOB);
+    let cancelled = AtomicBool::new(false);
+    thread::scope(|scope| {
+        let feeder = scope.spawn(|| {
+            let _guard = CancelOnPanic(&cancelled);
+            queue::cancel_on_error(&cancelled, feed(&values, 1, &cancelled))
+        });
+        let _guard = CancelOnPanic(&cancelled);
+        while let Some(Some((_, value))) = values.pop_wait(&cancelled) {
+            callback(&value);
+        }
+        // An error of the feeder, like a manifest that can't be read, fails the
+        // whole run
+        error::join(feeder)
+    })
+}
+
+fn for_each_value_parallel(
+    feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+    jobs: usize,
+    ordered: bool,
+    calculate: impl Fn(&str, usize) -> Result<CountResult, Error> + Sync,
+    mut emit: impl FnMut(&str, Result<CountResult, Error>),
+) -> Result<(), Error> {
+    let jobs = jobs.max(1);
+    let values: ValueQueue = Queue::with_capacity(jobs * VALUES_PER_JOB);
+    let cancelled = AtomicBool::new(false);
+    let (sender, receiver) = mpsc::channel();
+
+    thread::scope(|scope| {
+        let feeder = scope.spawn(|| {
+            let _guard = CancelOnPanic(&cancelled);
+            queue::cancel_on_error(&cancelled, feed(&values, jobs, &cancelled))
+        });
+        for worker in 0..jobs {
+            let sender = sender.clone();
+            let (values, cancelled, calculate) = (&values, &cancelled, &calculate);
+            scope.spawn(move || {
+                let _guard = CancelOnPanic(cancelled);
+                while let Some(Some((index, value))) = values.pop_wait(cancelled) {
+                    let result = calculate(&value, worker);
+                    // Only fails once the emitting thread is gone, which
+                    // leaves nothing to count for
+                    if queue::cancel_on_error(cancelled, sender.send((index, value, result))).is_err() {
+                        break;
+                    }
+                }
+            });
+        }
+        drop(sender);
+
+        // Results that arrived before the ones preceding them in the list
+        let mut results = BTreeMap::new();
+        let mut next_emit = 0;
+        for (index, value, result) in receiver {
+            if !ordered {
+                emit(&value, result);
+                continue;
+            }
+            results.insert(index, (value, result));
+            while let Some((value, result)) = results.remove(&next_emit) {
+                emit(&value, result);
+                next_emit += 1;
+            }
+        }
+        error::join(feeder)
+    })
 }
 
-fn merge_files(csv: &str) -> String {
-    let mut merged = String::new();
-    for value in csv.split(",") {
-        let file = file::read_file(value.trim());
-        merged.push_str(file.to_str());
+fn count_merged(manifest: &Path, command: Command, utf8: Utf8Mode) -> Result<CountResult, Error> {
+    let mut manifest = Manifest::open(manifest)?;
+    let mut counter = Counter::new(command, utf8);
+    let mut reader = file::Reader::new();
+    while let Some(value) = manifest.next_value()? {
+        let value = Path::new(value);
+        let _span = trace::file_span("count_merged_file", value);
+        let mut bytes_read = 0;
+        reader
+            .for_each_chunk(value, |chunk| {
+                let start = stats::begin();
+                let fed = counter.feed(chunk);
+                stats::end(Phase::Count, start);
+                bytes_read += chunk.len() as u64;
+                fed
+            })
+            .map_err(error::in_file(value))?;
+        stats::add_file(bytes_read);
     }
-    merged
+    counter.finish()
 }
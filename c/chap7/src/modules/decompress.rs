@@ -0,0 +1,267 @@
+mod ffi {
+    use super::Decoder;
+    use crate::modules::error::{self, Status};
+    use crate::modules::file;
+    use std::os::raw::c_char;
+
+    /// Opens a file for reading its content, which is decompressed if the
+    /// file starts like gzip or zstd data, whatever its name. `decoder` is
+    /// only set if the file could be opened.
+    #[no_mangle]
+    pub extern "C" fn decoder_open(filename: *const c_char, decoder: *mut *mut Decoder) -> Status {
+        error::status(|| {
+            let filename = unsafe { file::c_path(filename) }?;
+            Decoder::open(filename).map(|opened| unsafe { *decoder = Box::into_raw(Box::new(opened)) })
+        })
+    }
+
+    /// Points `chunk` at the next part of the content, and sets `length` to
+    /// its length, or to 0 at the end. The chunk is valid until the next
+    /// call. After an error, the decoder can only be closed.
+    #[no_mangle]
+    pub extern "C" fn decoder_next(decoder: *mut Decoder, chunk: *mut *const u8, length: *mut usize) -> Status {
+        let decoder = unsafe { &mut *decoder };
+        error::status(|| {
+            let data = decoder.next()?;
+            unsafe {
+                *chunk = data.as_ptr();
+                *length = data.len();
+            }
+            Ok(())
+        })
+    }
+
+    /// Returns the number of bytes read from the file, which are fewer than
+    /// the content's if it was compressed, and frees the decoder.
+    #[no_mangle]
+    pub extern "C" fn decoder_close(decoder: *mut Decoder) -> u64 {
+        unsafe { Box::from_raw(decoder) }.finish()
+    }
+}
+
+use crate::modules::error::{Error, Status};
+use crate::modules::file::{self, CHUNK_SIZE};
+use crate::modules::stats::{self, Phase};
+use std::fs;
+use std::io::{self, Cursor, Read};
+use std::panic;
+use std::path::Path;
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::thread::{self, JoinHandle};
+
+// Chunks that are decompressed ahead of the counting, and then handed back
+// to be filled again
+const BUFFERS: usize = 4;
+
+#[derive(Clone, Copy)]
+enum Format {
+    Gzip,
+    Zstd,
+}
+
+impl Format {
+    // By the magic bytes that every gzip member and zstd frame starts with
+    fn detect(start: &[u8]) -> Option<Format> {
+        if start.starts_with(&[0x1f, 0x8b]) {
+            Some(Format::Gzip)
+        } else if start.starts_with(&[0x28, 0xb5, 0x2f, 0xfd]) {
+            Some(Format::Zstd)
+        } else {
+            None
+        }
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            Format::Gzip => "gzip",
+            Format::Zstd => "zstd",
+        }
+    }
+
+    fn supported(self) -> bool {
+        match self {
+            Format::Gzip => cfg!(feature = "gzip"),
+            Format::Zstd => cfg!(feature = "zstd"),
+        }
+    }
+}
+
+/// Reads the content of a file in chunks of at most `CHUNK_SIZE` bytes.
+/// Compressed files are decompressed on a thread of their own, so that it
+/// runs while the previous chunks are counted.
+pub struct Decoder {
+    source: Source,
+    bytes_read: u64,
+}
+
+enum Source {
+    Plain { file: fs::File, buffer: Box<[u8]>, first: Option<usize> },
+    Compressed(Decompression),
+}
+
+struct Decompression {
+    filled: Receiver<Vec<u8>>,
+    empty: Sender<Vec<u8>>,
+    // The chunk that was last handed out, which is sent back on the next call
+    current: Option<Vec<u8>>,
+    thread: Option<JoinHandle<Result<u64, Error>>>,
+}
+
+impl Decoder {
+    pub fn open(filename: &Path) -> Result<Self, Error> {
+        let mut file = file::open(filename)?;
+        let mut buffer = vec![0; CHUNK_SIZE].into_boxed_slice();
+        let first = file::read_full(&mut file, &mut buffer)?;
+        // Also for a compressed file, whose first chunk was read here
+        let bytes_read = first as u64;
+
+        let Some(format) = Format::detect(&buffer[..first]) else {
+            let source = Source::Plain { file, buffer, first: Some(first) };
+            return Ok(Decoder { source, bytes_read });
+        };
+        if !format.supported() {
+            let message = format!("Could not decompress file: count was built without {} support", format.name());
+            return Err(Error::new(Status::DecompressFailed, message));
+        }
+
+        let (filled_sender, filled) = mpsc::channel();
+        let (empty, empty_receiver) = mpsc::channel();
+        for _ in 0..BUFFERS {
+            empty.send(vec![0; CHUNK_SIZE]).unwrap();
+        }
+        // An error ends the chunks, and is passed on when the thread is joined
+        let thread = thread::spawn(move || {
+            let mut file = CountingReader { inner: file, bytes_read: 0 };
+            // The first chunk that was read is decompressed with the rest of the file
+            let compressed = Cursor::new(&buffer[..first]).chain(&mut file);
+            let mut reader = open_decoder(format, compressed)?;
+            while let Ok(mut buffer) = empty_receiver.recv() {
+                buffer.resize(CHUNK_SIZE, 0);
+                let start = stats::begin();
+                let length = read_chunk(&mut reader, &mut buffer);
+                stats::end(Phase::Decompress, start);
+                let length = length?;
+                buffer.truncate(length);
+                // Stops early once the decoder is closed
+                if length == 0 || filled_sender.send(buffer).is_err() {
+                    break;
+                }
+            }
+            drop(reader);
+            Ok(file.bytes_read)
+        });
+
+        let decompression = Decompression { filled, empty, current: None, thread: Some(thread) };
+        Ok(Decoder { source: Source::Compressed(decompression), bytes_read })
+    }
+
+    pub fn next(&mut self) -> Result<&[u8], Error> {
+        match &mut self.source {
+            Source::Plain { file, buffer, first } => {
+                let length = match first.take() {
+                    Some(length) => length,
+                    None => {
+                        let length = file::read_full(file, buffer)?;
+                        self.bytes_read += length as u64;
+                        length
+                    }
+                };
+                Ok(&buffer[..length])
+            }
+            Source::Compressed(decompression) => {
+                if let Some(buffer) = decompression.current.take() {
+                    // Fails once the thread is done, which doesn't need it
+                    let _ = decompression.empty.send(buffer);
+                }
+                // Waiting for the decompression counts as reading
+                let start = stats::begin();
+                let chunk = decompression.filled.recv();
+                stats::end(Phase::Read, start);
+                match chunk {
+                    Ok(buffer) => Ok(decompression.current.insert(buffer)),
+                    Err(_) => {
+                        self.bytes_read += join(&mut decompression.thread)?;
+                        Ok(&[])
+                    }
+                }
+            }
+        }
+    }
+
+    pub fn finish(self) -> u64 {
+        match self.source {
+            Source::Plain { .. } => self.bytes_read,
+            Source::Compressed(decompression) => {
+                // Without its channels, a thread that is still decompressing
+                // stops, in case the decoder is closed before the end. Its
+                // error was already passed on by `next()` if there was one.
+                let Decompression { filled, empty, current, mut thread } = decompression;
+                drop((filled, empty, current));
+                self.bytes_read + join(&mut thread).unwrap_or(0)
+            }
+        }
+    }
+}
+
+// Returns the bytes that the thread read, or 0 if it was already joined
+fn join(thread: &mut Option<JoinHandle<Result<u64, Error>>>) -> Result<u64, Error> {
+    match thread.take() {
+        // The thread returns its errors, so a panic is passed on as it is
+        Some(thread) => thread.join().unwrap_or_else(|payload| panic::resume_unwind(payload)),
+        None => Ok(0),
+    }
+}
+
+fn open_decoder<'a>(format: Format, source: impl Read + 'a) -> Result<Box<dyn Read + 'a>, Error> {
+    match format {
+        #[cfg(feature = "gzip")]
+        // gzip files can be several members one after the other, as written
+        // by pigz or by concatenating them
+        Format::Gzip => Ok(Box::new(flate2::read::MultiGzDecoder::new(source))),
+        #[cfg(feature = "zstd")]
+        Format::Zstd => {
+            let mut decoder = zstd::stream::read::Decoder::new(source).map_err(decompress_failed)?;
+            // Files compressed with --long use windows of up to 2 GiB
+            decoder.window_log_max(31).map_err(decompress_failed)?;
+            Ok(Box::new(decoder))
+        }
+        #[allow(unreachable_patterns)]
+        _ => {
+            // Unused when a format isn't built in
+            drop(source);
+            unreachable!("Checked by Format::supported()")
+        }
+    }
+}
+
+// Like `file::read_full()`, for the decompressed content
+fn read_chunk(reader: &mut impl Read, buffer: &mut [u8]) -> Result<usize, Error> {
+    let mut filled = 0;
+    while filled < buffer.len() {
+        match reader.read(&mut buffer[filled..]) {
+            Ok(0) => break,
+            Ok(length) => filled += length,
+            Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err(error) => return Err(decompress_failed(error)),
+        }
+    }
+    Ok(filled)
+}
+
+fn decompress_failed(error: io::Error) -> Error {
+    Error::new(Status::DecompressFailed, format!("Could not decompress file: {error}"))
+}
+
+// Counts the compressed bytes that the decoder reads
+struct CountingReader<R> {
+    inner: R,
+    bytes_read: u64,
+}
+
+impl<R: Read> Read for CountingReader<R> {
+    fn read(&mut self, buffer: &mut [u8]) -> io::Result<usize> {
+        let length = self.inner.read(buffer)?;
+        self.bytes_read += length as u64;
+        Ok(length)
+    }
+}
@@ -0,0 +1,473 @@
+mod ffi {
+    use super::Dedup;
+    use crate::modules::approx::Estimate;
+    use crate::modules::error::{self, Status};
+    use crate::DedupMode;
+    use std::ffi::{c_void, CStr};
+    use std::os::raw::c_char;
+
+    /// Starts collecting the files of a listing, to count each of them only
+    /// once. Must be released with `dedup_free()`.
+    #[no_mangle]
+    pub extern "C" fn dedup_new(mode: DedupMode) -> *mut Dedup {
+        Box::into_raw(Box::new(Dedup::new(mode)))
+    }
+
+    /// To be called just before the outcome of a file that the listing
+    /// passed on is printed, with that outcome: `estimate` holds the counts
+    /// (and no margins unless they were estimated) if `status` is
+    /// `Status_Ok`, and otherwise the message is the last error's.
+    ///
+    /// First calls `c_print` for the listings before the file that repeat a
+    /// file that is already printed, in list order, with the outcome of that
+    /// file. So with results in list order, every listing is printed in list
+    /// order. `c_print` gets the message of an error the same way, and must
+    /// not call back into `dedup_pass()`. The last error's message is
+    /// unchanged after the call.
+    #[no_mangle]
+    pub extern "C" fn dedup_pass(
+        dedup: *const Dedup,
+        filename: *const c_char,
+        status: Status,
+        estimate: *const Estimate,
+        c_print: unsafe extern "C" fn(*const c_char, Status, *const Estimate, *const c_void),
+        context: *const c_void,
+    ) {
+        let dedup = unsafe { &*dedup };
+        // Listed names are valid UTF-8, so one that isn't was never passed on
+        let filename = unsafe { CStr::from_ptr(filename) }.to_string_lossy();
+        let outcome = if status == Status::Ok { Ok(unsafe { *estimate }) } else { Err(error::take_last(status)) };
+        dedup.pass(&filename, outcome, |filename, outcome| unsafe { super::print(c_print, filename, outcome, context) });
+    }
+
+    /// Prints the repeating listings that are left, once every file that was
+    /// passed on is printed.
+    #[no_mangle]
+    pub extern "C" fn dedup_flush(
+        dedup: *const Dedup,
+        c_print: unsafe extern "C" fn(*const c_char, Status, *const Estimate, *const c_void),
+        context: *const c_void,
+    ) {
+        let dedup = unsafe { &*dedup };
+        dedup.flush(|filename, outcome| unsafe { super::print(c_print, filename, outcome, context) });
+    }
+
+    #[no_mangle]
+    pub extern "C" fn dedup_free(dedup: *mut Dedup) {
+        drop(unsafe { Box::from_raw(dedup) });
+    }
+}
+
+use crate::modules::approx::Estimate;
+use crate::modules::error::{self, Error, Status};
+use crate::modules::file;
+use crate::modules::manifest::ValueQueue;
+use crate::modules::queue::{self, CancelOnPanic, Queue};
+use crate::modules::trace;
+use crate::DedupMode;
+use std::collections::hash_map::RandomState;
+use std::collections::{HashMap, VecDeque};
+use std::ffi::{c_void, CString};
+use std::fs;
+use std::hash::{BuildHasher, Hasher};
+use std::os::raw::c_char;
+use std::path::Path;
+use std::sync::atomic::AtomicBool;
+use std::sync::Mutex;
+use std::thread;
+
+// Values taken from the listing ahead of the ones that are passed on
+const VALUES_AHEAD: usize = 64;
+
+type Outcome = Result<Estimate, Error>;
+
+/// Collapses the listings of a manifest or directory tree that name a file
+/// that was listed before, so that it is only read and counted once. The
+/// first listing is passed on, and the others repeat its outcome once it is
+/// printed.
+///
+/// A file is the same as one before it if it has the same path, and
+/// depending on the mode, the same device and inode (a hard link), or the
+/// same content. Content is only hashed for files with the same size as
+/// another one, so that listings without copies aren't read twice.
+pub struct Dedup {
+    mode: DedupMode,
+    // Only used by the thread that reads the listing
+    keys: Mutex<Keys>,
+    listings: Mutex<Listings>,
+}
+
+struct Keys {
+    // The listings that weren't passed on, to find repeats of those without
+    // looking at the file
+    repeated: HashMap<String, usize>,
+    inodes: HashMap<(u64, u64), usize>,
+    sizes: HashMap<u64, SizeClass>,
+    // Two independently keyed hashes make a 128-bit digest
+    digest_keys: (RandomState, RandomState),
+    reader: file::Reader,
+}
+
+// The files of one size, whose content is only hashed once there are two
+enum SizeClass {
+    One(usize, String),
+    Many(HashMap<u128, usize>),
+}
+
+#[derive(Default)]
+struct Listings {
+    // The index of every file that was passed on, in list order
+    passed: HashMap<String, usize>,
+    // Set once each of those files is printed
+    outcomes: Vec<Option<Outcome>>,
+    // The listings that repeat a passed file and aren't printed yet, in list
+    // order
+    repeats: VecDeque<Repeat>,
+}
+
+struct Repeat {
+    filename: String,
+    // The index of the passed file that it repeats
+    of: usize,
+    // How many files were passed on before it in the list
+    after: usize,
+}
+
+impl Dedup {
+    pub fn new(mode: DedupMode) -> Self {
+        let keys = Keys {
+            repeated: HashMap::new(),
+            inodes: HashMap::new(),
+            sizes: HashMap::new(),
+            digest_keys: (RandomState::new(), RandomState::new()),
+            reader: file::Reader::new(),
+        };
+        Dedup { mode, keys: Mutex::new(keys), listings: Mutex::default() }
+    }
+
+    /// Returns whether the listing `filename` is passed on to be counted, or
+    /// otherwise notes it as a repeat of the file that it names.
+    pub fn admit(&self, filename: &str) -> bool {
+        let mut keys = self.keys.lock().unwrap();
+        let passed = self.listings.lock().unwrap().passed.get(filename).copied();
+        let original = match keys.repeated.get(filename).copied().or(passed) {
+            Some(original) => Some(original),
+            // Looks at the file without holding on to the listings, which
+            // the printing thread needs
+            None if self.mode != DedupMode::Paths => self.find_same_file(&mut keys, filename),
+            None => None,
+        };
+
+        let mut listings = self.listings.lock().unwrap();
+        let Some(original) = original else {
+            let index = listings.outcomes.len();
+            listings.passed.insert(filename.to_owned(), index);
+            listings.outcomes.push(None);
+            return true;
+        };
+        keys.repeated.insert(filename.to_owned(), original);
+        let after = listings.outcomes.len();
+        listings.repeats.push_back(Repeat { filename: filename.to_owned(), of: original, after });
+        false
+    }
+
+    /// Passes on the values that `feed` produces, except for repeats, and
+    /// renumbers them in list order. Repeats are taken out on a thread of
+    /// their own, ahead of the ones that the values are passed on to.
+    pub fn feed(
+        &self,
+        feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+        values: &ValueQueue,
+        consumers: usize,
+        cancelled: &AtomicBool,
+    ) -> Result<(), Error> {
+        let listed: ValueQueue = Queue::with_capacity(VALUES_AHEAD);
+        thread::scope(|scope| {
+            let feeder = scope.spawn(|| {
+                let _guard = CancelOnPanic(cancelled);
+                queue::cancel_on_error(cancelled, feed(&listed, 1, cancelled))
+            });
+            let _guard = CancelOnPanic(cancelled);
+            let mut index = 0;
+            while let Some(Some((_, filename))) = listed.pop_wait(cancelled) {
+                if self.admit(&filename) {
+                    if values.push_wait(Some((index, filename)), cancelled).is_err() {
+                        break;
+                    }
+                    index += 1;
+                }
+            }
+            error::join(feeder)
+        })?;
+        for _ in 0..consumers {
+            let _ = values.push_wait(None, cancelled);
+        }
+        Ok(())
+    }
+
+    /// Like `feed()`, or `feed` itself without a `dedup`, for the functions
+    /// that take a feed.
+    pub fn filter<'a>(
+        dedup: Option<&'a Dedup>,
+        feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send + 'a,
+    ) -> impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send + 'a {
+        move |values, consumers, cancelled| match dedup {
+            Some(dedup) => dedup.feed(feed, values, consumers, cancelled),
+            None => feed(values, consumers, cancelled),
+        }
+    }
+
+    /// Keeps the outcome of the passed file `filename`, after calling `print`
+    /// for the repeats before it whose file has its outcome.
+    pub fn pass(&self, filename: &str, outcome: Outcome, mut print: impl FnMut(&str, &Outcome)) {
+        let mut listings = self.listings.lock().unwrap();
+        let Some(&index) = listings.passed.get(filename) else { return };
+        listings.print_repeats(index, &mut print);
+        // Printing the repeats changes the last error, which is this file's
+        if let Err(error) = &outcome {
+            error::set_last(error.clone());
+        }
+        listings.outcomes[index] = Some(outcome);
+    }
+
+    pub fn flush(&self, mut print: impl FnMut(&str, &Outcome)) {
+        self.listings.lock().unwrap().print_repeats(usize::MAX, &mut print);
+    }
+
+    // With inodes, the file that `filename` names is the same as one before
+    // it if it is a hard link to it, and with content, also if it is a copy
+    fn find_same_file(&self, keys: &mut Keys, filename: &str) -> Option<usize> {
+        // A file that can't be looked at is left to be reported when it's
+        // counted
+        let metadata = fs::metadata(filename).ok()?;
+        let inode = device_and_inode(&metadata);
+        if let Some(&original) = inode.and_then(|inode| keys.inodes.get(&inode)) {
+            return Some(original);
+        }
+        // The index that the file is passed on with, if it is
+        let next = self.listings.lock().unwrap().outcomes.len();
+        let original = if self.mode == DedupMode::Content { keys.find_copy(metadata.len(), filename, next) } else { None };
+        if let Some(inode) = inode {
+            keys.inodes.insert(inode, original.unwrap_or(next));
+        }
+        original
+    }
+}
+
+impl Keys {
+    fn find_copy(&mut self, size: u64, filename: &str, next: usize) -> Option<usize> {
+        match self.sizes.remove(&size) {
+            None => {
+                self.sizes.insert(size, SizeClass::One(next, filename.to_owned()));
+                None
+            }
+            Some(SizeClass::One(first, first_filename)) => {
+                let mut digests = HashMap::new();
+                if let Some(digest) = self.digest(&first_filename) {
+                    digests.insert(digest, first);
+                }
+                let original = self.add_digest(&mut digests, filename, next);
+                self.sizes.insert(size, SizeClass::Many(digests));
+                original
+            }
+            Some(SizeClass::Many(mut digests)) => {
+                let original = self.add_digest(&mut digests, filename, next);
+                self.sizes.insert(size, SizeClass::Many(digests));
+                original
+            }
+        }
+    }
+
+    // Returns the file with the same digest as `filename`, or adds it as the
+    // file `index`
+    fn add_digest(&mut self, digests: &mut HashMap<u128, usize>, filename: &str, index: usize) -> Option<usize> {
+        let digest = self.digest(filename)?;
+        match digests.get(&digest) {
+            Some(&original) => Some(original),
+            None => {
+                digests.insert(digest, index);
+                None
+            }
+        }
+    }
+
+    fn digest(&mut self, filename: &str) -> Option<u128> {
+        let _span = trace::file_span("dedup_digest", Path::new(filename));
+        let (mut high, mut low) = (self.digest_keys.0.build_hasher(), self.digest_keys.1.build_hasher());
+        self.reader
+            .for_each_chunk(Path::new(filename), |chunk| {
+                high.write(chunk);
+                low.write(chunk);
+                Ok(())
+            })
+            .ok()?;
+        Some((high.finish() as u128) << 64 | low.finish() as u128)
+    }
+}
+
+impl Listings {
+    // Prints the repeats that come before the passed file `index`, up to the
+    // first whose file has no outcome yet, which only happens for results
+    // that aren't printed in list order
+    fn print_repeats(&mut self, index: usize, print: &mut impl FnMut(&str, &Outcome)) {
+        while let Some(repeat) = self.repeats.front() {
+            let Some(outcome) = self.outcomes[repeat.of].as_ref().filter(|_| repeat.after <= index) else { break };
+            print(&repeat.filename, outcome);
+            self.repeats.pop_front();
+        }
+    }
+}
+
+unsafe fn print(
+    c_print: unsafe extern "C" fn(*const c_char, Status, *const Estimate, *const c_void),
+    filename: &str,
+    outcome: &Outcome,
+    context: *const c_void,
+) {
+    // Like the values that are passed on, a filename ends at a NUL byte
+    let filename = CString::new(filename.split('\0').next().unwrap()).unwrap();
+    match outcome {
+        Ok(estimate) => c_print(filename.as_ptr(), Status::Ok, estimate, context),
+        Err(error) => {
+            error::set_last(error.clone());
+            c_print(filename.as_ptr(), error.status, &Estimate::default(), context)
+        }
+    }
+}
+
+#[cfg(unix)]
+fn device_and_inode(metadata: &fs::Metadata) -> Option<(u64, u64)> {
+    use std::os::unix::fs::MetadataExt;
+    Some((metadata.dev(), metadata.ino()))
+}
+
+// Without inodes, only paths and content tell files apart
+#[cfg(not(unix))]
+fn device_and_inode(_metadata: &fs::Metadata) -> Option<(u64, u64)> {
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Dedup, Outcome};
+    use crate::modules::approx::Estimate;
+    use crate::modules::count::CountResult;
+    use crate::modules::error::{self, Error, Status};
+    use crate::modules::manifest::ValueQueue;
+    use crate::modules::queue::Queue;
+    use crate::DedupMode;
+    use std::sync::atomic::AtomicBool;
+    use std::{env, fs, process};
+
+    // The outcome of a passed file, told apart by its byte count
+    fn outcome(bytes: u64) -> Outcome {
+        Ok(Estimate { result: CountResult { bytes, ..CountResult::default() }, ..Estimate::default() })
+    }
+
+    fn bytes(outcome: &Outcome) -> Option<u64> {
+        outcome.as_ref().ok().map(|estimate| estimate.result.bytes)
+    }
+
+    // Passes the files in `order` (indices into the passed files), and
+    // returns every printed listing with the byte count of its outcome, as
+    // the callers print them: the repeats before a file, then the file.
+    fn print_in(dedup: &Dedup, passed: &[&str], order: &[usize]) -> Vec<(String, Option<u64>)> {
+        let mut printed = Vec::new();
+        for &index in order {
+            let mut print = |filename: &str, outcome: &Outcome| printed.push((filename.to_owned(), bytes(outcome)));
+            dedup.pass(passed[index], outcome(index as u64), &mut print);
+            print(passed[index], &outcome(index as u64));
+        }
+        dedup.flush(|filename, outcome| printed.push((filename.to_owned(), bytes(outcome))));
+        printed
+    }
+
+    fn listed(listings: &[(&str, u64)]) -> Vec<(String, Option<u64>)> {
+        listings.iter().map(|&(filename, bytes)| (filename.to_owned(), Some(bytes))).collect()
+    }
+
+    fn admit_all<'a>(dedup: &Dedup, listing: &[&'a str]) -> Vec<&'a str> {
+        listing.iter().copied().filter(|filename| dedup.admit(filename)).collect()
+    }
+
+    #[test]
+    fn repeats_are_printed_in_list_order() {
+        let listing = ["a", "b", "a", "c", "b", "a"];
+        let dedup = Dedup::new(DedupMode::Paths);
+        let passed = admit_all(&dedup, &listing);
+        assert_eq!(passed, ["a", "b", "c"]);
+
+        let printed = print_in(&dedup, &passed, &[0, 1, 2]);
+        assert_eq!(printed, listed(&[("a", 0), ("b", 1), ("a", 0), ("c", 2), ("b", 1), ("a", 0)]));
+    }
+
+    #[test]
+    fn repeats_wait_for_the_file_they_repeat() {
+        let listing = ["a", "b", "a", "c", "b", "a"];
+        let dedup = Dedup::new(DedupMode::Paths);
+        let passed = admit_all(&dedup, &listing);
+
+        // With results in completion order, a repeat waits for its file and
+        // for the passed files before it in the list, and the rest is
+        // flushed in list order
+        let printed = print_in(&dedup, &passed, &[2, 0, 1]);
+        assert_eq!(printed, listed(&[("c", 2), ("a", 0), ("b", 1), ("a", 0), ("b", 1), ("a", 0)]));
+    }
+
+    #[test]
+    fn repeats_of_errors_repeat_the_error() {
+        let dedup = Dedup::new(DedupMode::Paths);
+        assert!(dedup.admit("missing"));
+        assert!(!dedup.admit("missing"));
+        let mut printed = Vec::new();
+        let failed = Err(Error::new(Status::OpenFailed, "Could not open file: 'missing'"));
+        dedup.pass("missing", failed, |_, _| unreachable!());
+        dedup.flush(|filename, outcome| printed.push((filename.to_owned(), outcome.as_ref().err().unwrap().status)));
+        assert_eq!(printed, [("missing".to_owned(), Status::OpenFailed)]);
+        assert_eq!(error::take_last(Status::OpenFailed).message, "Could not open file: 'missing'");
+    }
+
+    #[test]
+    fn same_files_by_mode() {
+        let directory = env::temp_dir().join(format!("count-dedup-{}", process::id()));
+        fs::create_dir_all(&directory).unwrap();
+        let path = |name: &str| directory.join(name).to_str().unwrap().to_owned();
+        fs::write(path("file.txt"), "same content\n").unwrap();
+        fs::write(path("copy.txt"), "same content\n").unwrap();
+        fs::write(path("other.txt"), "more content\n").unwrap();
+        fs::hard_link(path("file.txt"), path("link.txt")).unwrap();
+        let listing = ["file.txt", "copy.txt", "other.txt", "link.txt", "file.txt", "missing.txt"].map(path);
+        let listing: Vec<&str> = listing.iter().map(String::as_str).collect();
+
+        let passed = |mode| {
+            let passed = admit_all(&Dedup::new(mode), &listing);
+            passed.iter().map(|filename| filename.rsplit('/').next().unwrap().to_owned()).collect::<Vec<_>>()
+        };
+        assert_eq!(passed(DedupMode::Paths), ["file.txt", "copy.txt", "other.txt", "link.txt", "missing.txt"]);
+        assert_eq!(passed(DedupMode::Inodes), ["file.txt", "copy.txt", "other.txt", "missing.txt"]);
+        assert_eq!(passed(DedupMode::Content), ["file.txt", "other.txt", "missing.txt"]);
+        fs::remove_dir_all(&directory).unwrap();
+    }
+
+    #[test]
+    fn passed_values_are_renumbered() {
+        let dedup = Dedup::new(DedupMode::Paths);
+        let values: ValueQueue = Queue::with_capacity(16);
+        let feed = |listed: &ValueQueue, consumers, cancelled: &AtomicBool| {
+            for (index, filename) in ["a", "b", "a", "c", "b"].into_iter().enumerate() {
+                let _ = listed.push_wait(Some((index, filename.to_owned())), cancelled);
+            }
+            for _ in 0..consumers {
+                let _ = listed.push_wait(None, cancelled);
+            }
+            Ok(())
+        };
+        dedup.feed(feed, &values, 2, &AtomicBool::new(false)).unwrap();
+        let mut received = Vec::new();
+        while let Some(value) = values.pop() {
+            received.push(value);
+        }
+        let expected = [Some((0, "a".to_owned())), Some((1, "b".to_owned())), Some((2, "c".to_owned())), None, None];
+        assert_eq!(received, expected);
+    }
+}
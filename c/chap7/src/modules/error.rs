@@ -0,0 +1,126 @@
+mod ffi {
+    use super::{Error, Status};
+    use std::ffi::CStr;
+    use std::os::raw::c_char;
+
+    /// Returns the message of the last error on the calling thread, or NULL
+    /// if there was none. Functions that return a status other than
+    /// `Status_Ok` leave their message here, and it stays valid until the
+    /// next error.
+    #[no_mangle]
+    pub extern "C" fn count_error_message() -> *const c_char {
+        super::last_message()
+    }
+
+    /// Makes `message` the last error on the calling thread, for the errors
+    /// that the C side runs into.
+    #[no_mangle]
+    pub extern "C" fn count_set_error(status: Status, message: *const c_char) {
+        let message = unsafe { CStr::from_ptr(message) }.to_string_lossy().into_owned();
+        super::set_last(Error { status, message });
+    }
+}
+
+use std::cell::RefCell;
+use std::ffi::CString;
+use std::os::raw::c_char;
+use std::panic::{self, AssertUnwindSafe};
+use std::path::Path;
+use std::process;
+use std::ptr;
+use std::thread;
+
+/// Why a file couldn't be counted.
+/// cbindgen:prefix-with-name
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum Status {
+    Ok,
+    OpenFailed,
+    ReadFailed,
+    /// With --utf8=strict
+    InvalidUtf8,
+    DecompressFailed,
+    /// Anything else
+    Failed,
+}
+
+/// An error that fails the file that is being counted, or for the errors
+/// that `or_exit()` reports, the whole run.
+///
+/// Errors are returned like any other, and turned into a status where they
+/// cross into C. Messages don't name the file, whoever reports the error
+/// does. Panics are left for bugs.
+#[derive(Clone, Debug)]
+pub struct Error {
+    pub status: Status,
+    pub message: String,
+}
+
+impl Error {
+    pub fn new(status: Status, message: impl Into<String>) -> Self {
+        Error { status, message: message.into() }
+    }
+}
+
+thread_local! {
+    static LAST: RefCell<Option<CString>> = const { RefCell::new(None) };
+}
+
+/// For the FFI functions that return a status: returns the status of the
+/// error that `f` fails with, and leaves its message as the thread's last
+/// error.
+pub fn status(f: impl FnOnce() -> Result<(), Error>) -> Status {
+    match guard(f) {
+        Ok(()) => Status::Ok,
+        Err(error) => {
+            let status = error.status;
+            set_last(error);
+            status
+        }
+    }
+}
+
+/// For the FFI functions whose errors fail the whole run, like a manifest
+/// that can't be read: prints the error and exits, instead of returning to
+/// C. Output that is still buffered on the C side is written out too.
+pub fn or_exit<T>(f: impl FnOnce() -> Result<T, Error>) -> T {
+    guard(f).unwrap_or_else(|error| {
+        eprintln!("{}", error.message);
+        process::exit(1)
+    })
+}
+
+/// Names the file `filename` in the message of an error, for `map_err()`
+/// on the errors that aren't reported per file.
+pub fn in_file(filename: &Path) -> impl FnOnce(Error) -> Error + '_ {
+    move |error| Error { message: format!("{}: {}", filename.display(), error.message), ..error }
+}
+
+/// Joins a scoped thread, and passes on its panic as it is, since the scope
+/// itself would only fail with a generic one.
+pub fn join<T>(handle: thread::ScopedJoinHandle<T>) -> T {
+    handle.join().unwrap_or_else(|payload| panic::resume_unwind(payload))
+}
+
+// A panic is a bug, which the panic hook has already reported, and must not
+// unwind into C.
+fn guard<T>(f: impl FnOnce() -> T) -> T {
+    panic::catch_unwind(AssertUnwindSafe(f)).unwrap_or_else(|_| process::abort())
+}
+
+pub fn set_last(error: Error) {
+    // A message can't hold a NUL byte as a C string
+    let message = CString::new(error.message.replace('\0', "")).unwrap();
+    LAST.with_borrow_mut(|last| *last = Some(message));
+}
+
+/// Takes the thread's last error, to pass it to another thread.
+pub fn take_last(status: Status) -> Error {
+    let message = LAST.with_borrow_mut(Option::take).map_or_else(String::new, |message| message.to_string_lossy().into_owned());
+    Error { status, message }
+}
+
+fn last_message() -> *const c_char {
+    LAST.with_borrow(|last| last.as_ref().map_or(ptr::null(), |message| message.as_ptr()))
+}
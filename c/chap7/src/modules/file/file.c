@@ -1,40 +1,235 @@
 #include "file.h"
+#include "bindings.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
-File file_read(const char* filename) {
+#if defined(__unix__) || defined(__APPLE__)
+#define FILE_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The first buffer for a file whose size isn't known, which is doubled as needed
+#define FILE_READ_INITIAL_CAPACITY (64 * 1024)
+
+static Status read_sized(FILE* file_handle, BufferPool* pool, size_t size, uint8_t** data, size_t* length);
+static Status read_to_end(FILE* file_handle, BufferPool* pool, uint8_t** data, size_t* length);
+static Status fail(Status status, const char* what);
+
+Status file_read(const char* filename, BufferPool* pool, File* file) {
     FILE* file_handle = fopen (filename, "rb");
     if (!file_handle) {
-        printf("Could not open file: '%s'\n", filename);
-        exit(1);
+        return fail(Status_OpenFailed, "Could not open file");
+    }
+    // Pipes and other special files can't seek, and are read until the end
+    long size = -1;
+    if (fseek(file_handle, 0, SEEK_END) == 0) {
+        size = ftell(file_handle);
+    }
+    uint8_t* data = NULL;
+    size_t length = 0;
+    const Status status = size >= 0 && fseek(file_handle, 0, SEEK_SET) == 0
+            ? read_sized(file_handle, pool, (size_t)size, &data, &length)
+            : read_to_end(file_handle, pool, &data, &length);
+    fclose(file_handle);
+    if (status != Status_Ok) {
+        return status;
+    }
+    *file = (File) {
+            filename,
+            data,
+            length,
+            false,
+            pool
+    };
+    return Status_Ok;
+}
+
+// Sets `length` to the size of the file without reading it, or to SIZE_MAX if
+// it isn't known up front (e.g. for pipes and other special files).
+Status file_length(const char* filename, size_t* length) {
+#ifdef FILE_HAS_MMAP
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return fail(Status_OpenFailed, "Could not open file");
+    }
+    *length = S_ISREG(st.st_mode) ? (size_t)st.st_size : SIZE_MAX;
+    return Status_Ok;
+#else
+    FILE* file_handle = fopen(filename, "rb");
+    if (!file_handle) {
+        return fail(Status_OpenFailed, "Could not open file");
+    }
+    fseek(file_handle, 0, SEEK_END);
+    long size = ftell(file_handle);
+    fclose(file_handle);
+    *length = size < 0 ? SIZE_MAX : (size_t)size;
+    return Status_Ok;
+#endif
+}
+
+// Maps the file read-only into memory, so the data can be viewed without
+// copying it into a buffer. Falls back to file_read() where mmap is
+// unavailable or fails (e.g. for pipes and other special files).
+Status file_map(const char* filename, BufferPool* pool, File* file) {
+#ifdef FILE_HAS_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return fail(Status_OpenFailed, "Could not open file");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return file_read(filename, pool, file);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        *file = (File) { filename, NULL, 0, false, NULL };
+        return Status_Ok;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return file_read(filename, pool, file);
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *file = (File) {
+            filename,
+            (uint8_t*)data,
+            (size_t)st.st_size,
+            true,
+            NULL
+    };
+    return Status_Ok;
+#else
+    return file_read(filename, pool, file);
+#endif
+}
+
+// Reads the file into memory allocated from `arena`, followed by a NUL byte
+// so that the data can also be used as a string. The data is released along
+// with the arena, and must not be passed to file_free().
+Status file_read_arena(const char* filename, Arena* arena, File* file) {
+    FILE* file_handle = fopen(filename, "rb");
+    if (!file_handle) {
+        return fail(Status_OpenFailed, "Could not open file");
     }
     fseek(file_handle, 0, SEEK_END);
     long length = ftell(file_handle);
     fseek(file_handle, 0, SEEK_SET);
-    uint8_t* data = (uint8_t*)malloc(length);
-    fread(data, 1, length, file_handle);
+    uint8_t* data = (uint8_t*)arena_alloc(arena, length + 1, 1);
+    length = (long)fread(data, 1, length, file_handle);
+    if (ferror(file_handle)) {
+        const int error = errno;
+        fclose(file_handle);
+        errno = error;
+        return fail(Status_ReadFailed, "Could not read file");
+    }
+    data[length] = '\0';
     fclose(file_handle);
-    return (File) {
+    *file = (File) {
             filename,
             data,
-            length
+            length,
+            false,
+            NULL
     };
+    return Status_Ok;
 }
 
-char* file_to_string(const File file) {
-    char* str = (char*)malloc(file.length + 1);
-    memcpy(str, file.data, file.length);
-    str[file.length] = '\0';
-    return str;
+void file_free(const File file) {
+    if (file.pool) {
+        buffer_pool_release(file.pool, file.data);
+    }
 }
 
-void file_free(const File file) {
-    free(file.data);
+void file_unmap(const File file) {
+#ifdef FILE_HAS_MMAP
+    if (file.mapped) {
+        munmap(file.data, file.length);
+        return;
+    }
+#endif
+    file_free(file);
+}
+
+// Opens the file for reading it in chunks with file_stream_read(), so that
+// files of any size can be processed in a fixed amount of memory.
+Status file_stream_open(const char* filename, FileStream* stream) {
+    FILE* file_handle = fopen(filename, "rb");
+    if (!file_handle) {
+        return fail(Status_OpenFailed, "Could not open file");
+    }
+    // The caller supplies the buffer, stdio's own would only add a copy
+    setvbuf(file_handle, NULL, _IONBF, 0);
+    *stream = (FileStream) {
+            filename,
+            file_handle
+    };
+    return Status_Ok;
+}
+
+// Reads the next chunk of at most `capacity` bytes into `buffer`, and sets
+// `length` to its length, which is 0 at the end of the file.
+Status file_stream_read(FileStream* stream, uint8_t* buffer, const size_t capacity, size_t* length) {
+    *length = fread(buffer, 1, capacity, stream->handle);
+    if (*length == 0 && ferror(stream->handle)) {
+        return fail(Status_ReadFailed, "Could not read file");
+    }
+    return Status_Ok;
+}
+
+void file_stream_close(const FileStream stream) {
+    fclose(stream.handle);
+}
+
+static Status read_sized(FILE* file_handle, BufferPool* pool, const size_t size, uint8_t** data, size_t* length) {
+    uint8_t* buffer = buffer_pool_alloc(pool, size);
+    *length = fread(buffer, 1, size, file_handle);
+    if (ferror(file_handle)) {
+        buffer_pool_release(pool, buffer);
+        return fail(Status_ReadFailed, "Could not read file");
+    }
+    *data = buffer;
+    return Status_Ok;
+}
+
+// The pool has no realloc(), so a full buffer is copied into one of twice the
+// size, as realloc() mostly has to for buffers this big anyway
+static Status read_to_end(FILE* file_handle, BufferPool* pool, uint8_t** data, size_t* length) {
+    size_t capacity = FILE_READ_INITIAL_CAPACITY;
+    size_t filled = 0;
+    uint8_t* buffer = buffer_pool_alloc(pool, capacity);
+    while (!feof(file_handle)) {
+        if (filled == capacity) {
+            uint8_t* grown = buffer_pool_alloc(pool, capacity * 2);
+            memcpy(grown, buffer, filled);
+            buffer_pool_release(pool, buffer);
+            buffer = grown;
+            capacity *= 2;
+        }
+        filled += fread(buffer + filled, 1, capacity - filled, file_handle);
+        if (ferror(file_handle)) {
+            buffer_pool_release(pool, buffer);
+            return fail(Status_ReadFailed, "Could not read file");
+        }
+    }
+    *data = buffer;
+    *length = filled;
+    return Status_Ok;
 }
 
-void file_free_string(char* file_string) {
-    free(file_string);
+// Leaves the reason in errno as the last error, worded like the Rust side's
+// messages for the same errors
+static Status fail(const Status status, const char* what) {
+    const int error = errno;
+    char message[256];
+    snprintf(message, sizeof message, "%s: %s (os error %d)", what, strerror(error), error);
+    count_set_error(status, message);
+    return status;
 }
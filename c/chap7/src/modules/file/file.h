@@ -1,14 +1,39 @@
 #pragma once
 
+#include "bindings.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 typedef struct File {
     const char* filename;
     uint8_t* data;
     size_t length;
+    bool mapped;
+    // The pool that file_free() gives the data back to, NULL for data that is
+    // mapped or owned by someone else, like an arena
+    BufferPool* pool;
 } File;
 
-File file_read(const char* filename);
-char* file_to_string(File file);
+typedef struct FileStream {
+    const char* filename;
+    FILE* handle;
+} FileStream;
+
+// The functions that return a status fail for a file that can't be opened or
+// read, like the Rust side's, and leave the reason as the last error, see
+// count_error_message(). Their output parameters are only set on success.
+// The ones that take a `pool` read the file into a buffer from it, which
+// file_free() gives back.
+Status file_read(const char* filename, BufferPool* pool, File* file);
+Status file_length(const char* filename, size_t* length);
+Status file_map(const char* filename, BufferPool* pool, File* file);
+Status file_read_arena(const char* filename, Arena* arena, File* file);
 void file_free(File file);
-void file_free_string(char* file_string);
+void file_unmap(File file);
+
+Status file_stream_open(const char* filename, FileStream* stream);
+Status file_stream_read(FileStream* stream, uint8_t* buffer, size_t capacity, size_t* length);
+void file_stream_close(FileStream stream);
@@ -1,17 +1,139 @@
-pub struct File(String);
-
-impl File {
-    pub fn to_str(&self) -> &str {
-        if self.0 == "chapter1.md" {
-            "# Getting started\n"
-        } else if self.0 == "chapter2.md" {
-            "# Wrapping up\n"
-        } else {
-            panic!("No content defined for file: {}", self.0);
+use crate::modules::error::{Error, Status};
+use crate::modules::stats::{self, Phase};
+use std::ffi::CStr;
+use std::fs;
+use std::io::{self, Read};
+use std::os::raw::c_char;
+use std::path::Path;
+
+/// Size of the chunks that files are streamed in, the same as on the C side.
+pub const CHUNK_SIZE: usize = 1024 * 1024;
+
+/// The path that a C string names, valid for as long as the string. Any bytes
+/// make a path on Unix, so every file there can be named, elsewhere they have
+/// to be valid UTF-8.
+pub unsafe fn c_path<'a>(path: *const c_char) -> Result<&'a Path, Error> {
+    path_from_bytes(CStr::from_ptr(path).to_bytes())
+}
+
+/// Like `c_path()`, for the paths that are kept as text, which have to be
+/// valid UTF-8 everywhere.
+pub unsafe fn c_path_text<'a>(path: *const c_char) -> Result<&'a str, Error> {
+    let path = CStr::from_ptr(path);
+    path.to_str().map_err(|_| not_utf8(path.to_bytes()))
+}
+
+#[cfg(unix)]
+pub fn path_from_bytes(bytes: &[u8]) -> Result<&Path, Error> {
+    use std::ffi::OsStr;
+    use std::os::unix::ffi::OsStrExt;
+    Ok(Path::new(OsStr::from_bytes(bytes)))
+}
+
+#[cfg(not(unix))]
+pub fn path_from_bytes(bytes: &[u8]) -> Result<&Path, Error> {
+    std::str::from_utf8(bytes).map(Path::new).map_err(|_| not_utf8(bytes))
+}
+
+fn not_utf8(path: &[u8]) -> Error {
+    Error::new(Status::Failed, format!("Path is not valid UTF-8: '{}'", String::from_utf8_lossy(path)))
+}
+
+/// Reads files through a single buffer, which is reused (and only grows)
+/// from one file to the next.
+pub struct Reader {
+    buffer: Vec<u8>,
+}
+
+impl Reader {
+    pub fn new() -> Self {
+        Reader { buffer: Vec::new() }
+    }
+
+    /// Streams the file in chunks of at most `CHUNK_SIZE` bytes, so that
+    /// files of any size can be processed in a fixed amount of memory.
+    /// Stops at the first error of `callback`, and returns it.
+    pub fn for_each_chunk(&mut self, filename: &Path, mut callback: impl FnMut(&[u8]) -> Result<(), Error>) -> Result<(), Error> {
+        self.buffer.resize(CHUNK_SIZE, 0);
+        let mut file = open(filename)?;
+        loop {
+            let start = stats::begin();
+            let read = file.read(&mut self.buffer);
+            stats::end(Phase::Read, start);
+            let length = match read {
+                Ok(0) => return Ok(()),
+                Ok(length) => length,
+                Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+                Err(error) => return Err(read_failed(error)),
+            };
+            callback(&self.buffer[..length])?;
         }
     }
 }
 
-pub fn read_file(filename: &str) -> File {
-    File(filename.to_owned())
+pub fn open(filename: &Path) -> Result<fs::File, Error> {
+    fs::File::open(filename).map_err(open_failed)
+}
+
+/// Reads from `file` until `buffer` is full, or the file ends. Returns the
+/// number of bytes read, which is less than the buffer's length only at the
+/// end of the file.
+pub fn read_full(file: &mut fs::File, buffer: &mut [u8]) -> Result<usize, Error> {
+    let start = stats::begin();
+    let mut filled = 0;
+    while filled < buffer.len() {
+        match file.read(&mut buffer[filled..]) {
+            Ok(0) => break,
+            Ok(length) => filled += length,
+            Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err(error) => {
+                stats::end(Phase::Read, start);
+                return Err(read_failed(error));
+            }
+        }
+    }
+    stats::end(Phase::Read, start);
+    Ok(filled)
+}
+
+/// Like `read_full()`, but reads at `offset` without using the file's
+/// position, so that blocks can be read in any order.
+pub fn read_at(file: &fs::File, offset: u64, buffer: &mut [u8]) -> Result<usize, Error> {
+    let start = stats::begin();
+    let mut filled = 0;
+    while filled < buffer.len() {
+        match read_at_once(file, offset + filled as u64, &mut buffer[filled..]) {
+            Ok(0) => break,
+            Ok(length) => filled += length,
+            Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err(error) => {
+                stats::end(Phase::Read, start);
+                return Err(read_failed(error));
+            }
+        }
+    }
+    stats::end(Phase::Read, start);
+    Ok(filled)
+}
+
+#[cfg(unix)]
+fn read_at_once(file: &fs::File, offset: u64, buffer: &mut [u8]) -> io::Result<usize> {
+    use std::os::unix::fs::FileExt;
+    file.read_at(buffer, offset)
+}
+
+#[cfg(not(unix))]
+fn read_at_once(mut file: &fs::File, offset: u64, buffer: &mut [u8]) -> io::Result<usize> {
+    use std::io::{Seek, SeekFrom};
+    file.seek(SeekFrom::Start(offset))?;
+    file.read(buffer)
+}
+
+/// The error for a file that can't be opened, or looked at.
+pub fn open_failed(error: io::Error) -> Error {
+    Error::new(Status::OpenFailed, format!("Could not open file: {error}"))
+}
+
+pub fn read_failed(error: io::Error) -> Error {
+    Error::new(Status::ReadFailed, format!("Could not read file: {error}"))
 }
@@ -0,0 +1,550 @@
+#include "loader.h"
+#include "bindings.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LOADER_HAS_THREADS 1
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define LOADER_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// The thread pool never starts more threads than this
+#define LOADER_MAX_THREADS 16
+// Queued io_uring reads are submitted once there are this many, or when the
+// loader has to wait for one
+#define LOADER_SUBMIT_BATCH 8
+
+// A file that is being loaded, or waits to be passed to the callback
+typedef struct Slot {
+    char* filename;
+    size_t filename_capacity;
+    uint8_t* data;
+    size_t capacity;
+    size_t length;
+    // How much of the file has been read so far
+    size_t offset;
+    int fd;
+    bool loaded;
+    bool done;
+#ifdef LOADER_HAS_IO_URING
+    struct iovec iov;
+#endif
+} Slot;
+
+#ifdef LOADER_HAS_IO_URING
+// The rings shared with the kernel. There's no liburing dependency, the
+// setup is the few mmap calls described in io_uring_setup(2).
+typedef struct Uring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Reads that are queued, but not submitted to the kernel yet, and reads
+    // that are submitted, but not reaped yet
+    unsigned pending;
+    unsigned in_flight;
+} Uring;
+#endif
+
+struct Loader {
+    Slot* slots;
+    size_t depth;
+    size_t file_limit;
+    // The oldest slot that hasn't been passed to the callback, and the
+    // number of slots in use from there on
+    size_t head;
+    size_t count;
+    LoaderCallback callback;
+    void* ctx;
+    // Where the slots' buffers come from. Only used by the thread that
+    // submits the files.
+    BufferPool* pool;
+#ifdef LOADER_HAS_IO_URING
+    bool uring;
+    Uring ring;
+#endif
+#ifdef LOADER_HAS_THREADS
+    pthread_t* threads;
+    size_t thread_count;
+    pthread_mutex_t lock;
+    // Signalled when a slot is queued for reading, or the loader finishes
+    pthread_cond_t work;
+    // Signalled when a slot has been read
+    pthread_cond_t done;
+    // Indices of the slots queued for reading
+    size_t* jobs;
+    size_t job_head;
+    size_t job_count;
+    bool stopping;
+#endif
+};
+
+static void open_slot(const Loader* loader, Slot* slot);
+static void start_read(Loader* loader, size_t index);
+static void wait_for(Loader* loader, Slot* slot);
+static void deliver_head(Loader* loader);
+
+#ifdef LOADER_HAS_IO_URING
+static bool uring_init(Uring* ring, unsigned entries);
+static void uring_free(Uring* ring);
+static void uring_queue_read(Uring* ring, Slot* slot, size_t index);
+static bool uring_enter(Loader* loader, bool wait);
+static void uring_reap(Loader* loader);
+static void uring_fall_back(Loader* loader);
+#endif
+
+#ifdef LOADER_HAS_THREADS
+static void threads_start(Loader* loader);
+static void threads_stop(Loader* loader);
+static void* worker_run(void* loader_ptr);
+static void read_slot(Slot* slot);
+#endif
+
+Loader* loader_new(const size_t queue_depth, const size_t file_limit, const LoaderCallback callback, void* ctx) {
+    Loader* loader = (Loader*) calloc(1, sizeof(Loader));
+    loader->depth = queue_depth > 0 ? queue_depth : 1;
+    loader->slots = (Slot*) calloc(loader->depth, sizeof(Slot));
+    loader->file_limit = file_limit;
+    loader->callback = callback;
+    loader->ctx = ctx;
+    loader->pool = buffer_pool_new();
+#ifdef LOADER_HAS_IO_URING
+    // Fails on kernels before 5.1, or where seccomp filters io_uring out
+    loader->uring = uring_init(&loader->ring, (unsigned) loader->depth);
+    if (loader->uring) {
+        return loader;
+    }
+#endif
+#ifdef LOADER_HAS_THREADS
+    threads_start(loader);
+#endif
+    return loader;
+}
+
+// Queues the file for loading. If all slots are in use, this first waits for
+// the oldest file and passes it to the callback.
+void loader_submit(Loader* loader, const char* filename) {
+    if (loader->count == loader->depth) {
+        deliver_head(loader);
+    }
+    const size_t index = (loader->head + loader->count) % loader->depth;
+    Slot* slot = &loader->slots[index];
+    loader->count++;
+
+    const size_t filename_size = strlen(filename) + 1;
+    if (slot->filename_capacity < filename_size) {
+        slot->filename = (char*) realloc(slot->filename, filename_size);
+        slot->filename_capacity = filename_size;
+    }
+    memcpy(slot->filename, filename, filename_size);
+
+    const uint64_t start = stats_begin();
+    open_slot(loader, slot);
+    stats_end(Phase_Read, start);
+    if (!slot->done) {
+        start_read(loader, index);
+    }
+}
+
+// Passes all remaining files to the callback, and frees the loader.
+void loader_finish(Loader* loader) {
+    while (loader->count > 0) {
+        deliver_head(loader);
+    }
+#ifdef LOADER_HAS_IO_URING
+    if (loader->uring) {
+        uring_free(&loader->ring);
+    }
+#endif
+#ifdef LOADER_HAS_THREADS
+    threads_stop(loader);
+#endif
+    for (size_t i = 0; i < loader->depth; i++) {
+        free(loader->slots[i].filename);
+    }
+    // Along with the slots' buffers
+    buffer_pool_free(loader->pool);
+    free(loader->slots);
+    free(loader);
+}
+
+// Opens the file and makes room for its content. Marks the slot done if there
+// is nothing to read, and leaves it unloaded if the file can't be opened.
+// The callback reads such a file itself, and runs into the error then.
+static void open_slot(const Loader* loader, Slot* slot) {
+    slot->length = 0;
+    slot->offset = 0;
+    slot->fd = -1;
+    slot->loaded = false;
+    slot->done = true;
+#ifdef LOADER_HAS_THREADS
+    const int fd = open(slot->filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size > loader->file_limit) {
+        close(fd);
+        return;
+    }
+    slot->fd = fd;
+    slot->length = (size_t) st.st_size;
+#else
+    size_t length;
+    if (file_length(slot->filename, &length) != Status_Ok || length > loader->file_limit) {
+        return;
+    }
+    slot->length = length;
+#endif
+    if (slot->capacity < slot->length) {
+        if (slot->data) {
+            buffer_pool_release(loader->pool, slot->data);
+        }
+        slot->data = buffer_pool_alloc(loader->pool, slot->length);
+        slot->capacity = slot->length;
+    }
+    slot->loaded = true;
+    slot->done = slot->length == 0;
+}
+
+static void start_read(Loader* loader, const size_t index) {
+    Slot* slot = &loader->slots[index];
+#ifdef LOADER_HAS_IO_URING
+    if (loader->uring) {
+        uring_queue_read(&loader->ring, slot, index);
+        if (loader->ring.pending >= LOADER_SUBMIT_BATCH && !uring_enter(loader, false)) {
+            uring_fall_back(loader);
+        }
+        return;
+    }
+#endif
+#ifdef LOADER_HAS_THREADS
+    pthread_mutex_lock(&loader->lock);
+    loader->jobs[(loader->job_head + loader->job_count) % loader->depth] = index;
+    loader->job_count++;
+    pthread_cond_signal(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+#else
+    // Without threads, the file is simply read right away
+    FILE* file_handle = fopen(slot->filename, "rb");
+    if (file_handle) {
+        slot->length = fread(slot->data, 1, slot->length, file_handle);
+        slot->loaded = !ferror(file_handle);
+        fclose(file_handle);
+    } else {
+        slot->loaded = false;
+    }
+    slot->done = true;
+#endif
+}
+
+static void wait_for(Loader* loader, Slot* slot) {
+#ifdef LOADER_HAS_IO_URING
+    if (loader->uring) {
+        while (!slot->done) {
+            uring_reap(loader);
+            if (!slot->done && !uring_enter(loader, true)) {
+                uring_fall_back(loader);
+                break;
+            }
+        }
+        return;
+    }
+#endif
+#ifdef LOADER_HAS_THREADS
+    pthread_mutex_lock(&loader->lock);
+    while (!slot->done) {
+        pthread_cond_wait(&loader->done, &loader->lock);
+    }
+    pthread_mutex_unlock(&loader->lock);
+#else
+    (void) loader;
+    (void) slot;
+#endif
+}
+
+static void deliver_head(Loader* loader) {
+    Slot* slot = &loader->slots[loader->head];
+    const uint64_t start = stats_begin();
+    wait_for(loader, slot);
+#ifdef LOADER_HAS_THREADS
+    if (slot->fd >= 0) {
+        close(slot->fd);
+    }
+#endif
+    stats_end(Phase_Read, start);
+
+    if (slot->loaded) {
+        const File file = { slot->filename, slot->data, slot->length, false, NULL };
+        loader->callback(slot->filename, &file, loader->ctx);
+    } else {
+        loader->callback(slot->filename, NULL, loader->ctx);
+    }
+    loader->head = (loader->head + 1) % loader->depth;
+    loader->count--;
+}
+
+#ifdef LOADER_HAS_IO_URING
+static bool uring_init(Uring* ring, const unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings at once
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    ring->cq_ring = single_mmap
+            ? ring->sq_ring
+            : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if (!single_mmap && ring->cq_ring != MAP_FAILED) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return false;
+    }
+
+    char* sq = (char*) ring->sq_ring;
+    char* cq = (char*) ring->cq_ring;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_free(Uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Queues a read of the rest of the slot's file. Every slot has at most one
+// read queued or in flight, so the rings never fill up.
+static void uring_queue_read(Uring* ring, Slot* slot, const size_t index) {
+    slot->iov.iov_base = slot->data + slot->offset;
+    slot->iov.iov_len = slot->length - slot->offset;
+
+    // Only this thread writes the tail, the kernel reads it
+    const unsigned tail = *ring->sq_tail;
+    const unsigned entry = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[entry];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    ring->sq_array[entry] = entry;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+// Submits the queued reads, and if `wait` is set, waits for a completion.
+// When the kernel takes no more reads for now (EAGAIN), or has completions
+// it can't post (EBUSY), this waits for a completion and reaps it instead,
+// and the reads are submitted on the next call. Returns false if the ring
+// can't be used any more, or nothing is in flight that could free it up.
+static bool uring_enter(Loader* loader, const bool wait) {
+    Uring* ring = &loader->ring;
+    long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait ? 1 : 0,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted < 0 && (errno == EAGAIN || errno == EBUSY) && ring->in_flight > 0) {
+        submitted = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        // EBUSY again still leaves completions in the ring to reap
+        if (submitted >= 0 || errno == EINTR || errno == EBUSY) {
+            uring_reap(loader);
+            return true;
+        }
+    }
+    if (submitted < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        fprintf(stderr, "Could not submit reads, loading files on threads instead: %s\n", strerror(errno));
+        return false;
+    }
+    ring->pending -= (unsigned) submitted;
+    ring->in_flight += (unsigned) submitted;
+    return true;
+}
+
+static void uring_reap(Loader* loader) {
+    Uring* ring = &loader->ring;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        const size_t index = (size_t) cqe->user_data;
+        const int result = cqe->res;
+        head++;
+        ring->in_flight--;
+
+        Slot* slot = &loader->slots[index];
+        if (result < 0) {
+            // Left to the callback, like a file that can't be opened
+            slot->loaded = false;
+            slot->done = true;
+            continue;
+        }
+        slot->offset += (size_t) result;
+        if (result == 0 || slot->offset == slot->length) {
+            // A read of 0 bytes means the file got shorter since it was opened
+            slot->length = slot->offset;
+            slot->done = true;
+        } else {
+            uring_queue_read(ring, slot, index);
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Switches the loader to the thread pool. The files that are still being
+// read are left to the callback, like a file that can't be opened, and keep
+// their buffers away from later files, since the kernel may still write to
+// them. The pool frees them with the others.
+static void uring_fall_back(Loader* loader) {
+    for (size_t i = 0; i < loader->count; i++) {
+        Slot* slot = &loader->slots[(loader->head + i) % loader->depth];
+        if (!slot->done) {
+            slot->loaded = false;
+            slot->done = true;
+            slot->data = NULL;
+            slot->capacity = 0;
+        }
+    }
+    uring_free(&loader->ring);
+    loader->uring = false;
+    threads_start(loader);
+}
+#endif
+
+#ifdef LOADER_HAS_THREADS
+static void threads_start(Loader* loader) {
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->work, NULL);
+    pthread_cond_init(&loader->done, NULL);
+    loader->jobs = (size_t*) malloc(loader->depth * sizeof(size_t));
+    loader->thread_count = loader->depth < LOADER_MAX_THREADS ? loader->depth : LOADER_MAX_THREADS;
+    loader->threads = (pthread_t*) malloc(loader->thread_count * sizeof(pthread_t));
+    for (size_t i = 0; i < loader->thread_count; i++) {
+        pthread_create(&loader->threads[i], NULL, worker_run, loader);
+    }
+}
+
+static void threads_stop(Loader* loader) {
+    if (!loader->threads) {
+        return;
+    }
+    pthread_mutex_lock(&loader->lock);
+    loader->stopping = true;
+    pthread_cond_broadcast(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+    for (size_t i = 0; i < loader->thread_count; i++) {
+        pthread_join(loader->threads[i], NULL);
+    }
+    free(loader->threads);
+    free(loader->jobs);
+    pthread_cond_destroy(&loader->done);
+    pthread_cond_destroy(&loader->work);
+    pthread_mutex_destroy(&loader->lock);
+}
+
+static void* worker_run(void* loader_ptr) {
+    Loader* loader = (Loader*) loader_ptr;
+    pthread_mutex_lock(&loader->lock);
+    while (true) {
+        while (loader->job_count == 0 && !loader->stopping) {
+            pthread_cond_wait(&loader->work, &loader->lock);
+        }
+        if (loader->job_count == 0) {
+            break;
+        }
+        Slot* slot = &loader->slots[loader->jobs[loader->job_head]];
+        loader->job_head = (loader->job_head + 1) % loader->depth;
+        loader->job_count--;
+        pthread_mutex_unlock(&loader->lock);
+
+        read_slot(slot);
+
+        pthread_mutex_lock(&loader->lock);
+        slot->done = true;
+        pthread_cond_broadcast(&loader->done);
+    }
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+static void read_slot(Slot* slot) {
+    while (slot->offset < slot->length) {
+        const ssize_t length = pread(slot->fd, slot->data + slot->offset, slot->length - slot->offset,
+                                     (off_t) slot->offset);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0) {
+            // Left to the callback, like a file that can't be opened
+            slot->loaded = false;
+            break;
+        }
+        if (length == 0) {
+            slot->length = slot->offset;
+            break;
+        }
+        slot->offset += (size_t) length;
+    }
+}
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "../file/file.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Called for every submitted file, in submission order. `file` holds the
+// whole content of the file, and is only valid during the call. It is NULL
+// for files that weren't loaded because they exceed the loader's file limit,
+// their size isn't known up front, or they couldn't be opened or read, so the
+// callback has to read them, and report the error if there is one.
+typedef void (*LoaderCallback)(const char* filename, const File* file, void* ctx);
+
+// Loads files asynchronously, with up to `queue_depth` reads in flight at
+// once. Uses io_uring on Linux, and a thread pool where it isn't available.
+typedef struct Loader Loader;
+
+Loader* loader_new(size_t queue_depth, size_t file_limit, LoaderCallback callback, void* ctx);
+void loader_submit(Loader* loader, const char* filename);
+void loader_finish(Loader* loader);
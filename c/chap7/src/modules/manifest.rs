@@ -0,0 +1,355 @@
+use crate::modules::error::{self, Error, Status};
+use crate::modules::file;
+use crate::modules::queue::Queue;
+use crate::modules::stats::{self, Phase};
+use std::fs;
+use std::io::{self, Read};
+use std::path::Path;
+use std::str;
+use std::sync::atomic::AtomicBool;
+
+// How much of the manifest is read at a time
+const BUFFER_SIZE: usize = 64 * 1024;
+
+/// Reads the filenames from a CSV manifest (RFC 4180) as it is parsed.
+///
+/// Every field of every row is a filename. Fields can be quoted, and then
+/// contain commas, line breaks and `""` for a quote. Whitespace around
+/// unquoted fields is ignored, and so are empty fields, since they can't
+/// name a file.
+pub struct Manifest<R> {
+    reader: R,
+    buffer: Box<[u8]>,
+    // The part of the buffer that is read, but not parsed yet
+    start: usize,
+    end: usize,
+    value: Vec<u8>,
+}
+
+/// Values as they are handed from the thread that parses the manifest to the
+/// ones that process them: the index in the list and the filename, or `None`
+/// once there are no more.
+pub type ValueQueue = Queue<Option<(usize, String)>>;
+
+impl Manifest<fs::File> {
+    pub fn open(path: &Path) -> Result<Self, Error> {
+        file::open(path).map(Manifest::new).map_err(error::in_file(path))
+    }
+}
+
+impl<R: Read> Manifest<R> {
+    pub fn new(reader: R) -> Self {
+        Manifest { reader, buffer: vec![0; BUFFER_SIZE].into_boxed_slice(), start: 0, end: 0, value: Vec::new() }
+    }
+
+    /// Returns the next filename, which is valid until the next call, or
+    /// `None` at the end. Fails for a manifest that can't be read or parsed.
+    pub fn next_value(&mut self) -> Result<Option<&str>, Error> {
+        let start = stats::begin();
+        let length = self.next_length();
+        stats::end(Phase::Csv, start);
+        let Some(length) = length? else { return Ok(None) };
+        match str::from_utf8(&self.value[..length]) {
+            Ok(value) => Ok(Some(value)),
+            Err(_) => Err(Error::new(Status::Failed, "Manifest is not valid UTF-8.")),
+        }
+    }
+
+    fn next_length(&mut self) -> Result<Option<usize>, Error> {
+        loop {
+            self.value.clear();
+            let Some(quoted) = self.read_field()? else { return Ok(None) };
+            if !quoted {
+                let trimmed = self.value.trim_ascii_end().len();
+                self.value.truncate(trimmed);
+            }
+            if !self.value.is_empty() {
+                return Ok(Some(self.value.len()));
+            }
+        }
+    }
+
+    /// Parses the manifest, handing each value to one of `consumers` threads
+    /// through `values`, and then a `None` to each of them. Stops early once
+    /// `cancelled` is set.
+    pub fn feed(mut self, values: &ValueQueue, consumers: usize, cancelled: &AtomicBool) -> Result<(), Error> {
+        let mut count = 0;
+        while let Some(value) = self.next_value()? {
+            if values.push_wait(Some((count, value.to_owned())), cancelled).is_err() {
+                return Ok(());
+            }
+            count += 1;
+        }
+        for _ in 0..consumers {
+            let _ = values.push_wait(None, cancelled);
+        }
+        Ok(())
+    }
+
+    // Reads one field into `value`, and returns whether it was quoted, or
+    // `None` at the end of the manifest.
+    fn read_field(&mut self) -> Result<Option<bool>, Error> {
+        loop {
+            let Some(byte) = self.peek()? else { return Ok(None) };
+            match byte {
+                b' ' | b'\t' => self.start += 1,
+                b'"' => {
+                    self.start += 1;
+                    self.read_quoted()?;
+                    return Ok(Some(true));
+                }
+                _ => {
+                    self.read_unquoted()?;
+                    return Ok(Some(false));
+                }
+            }
+        }
+    }
+
+    fn read_unquoted(&mut self) -> Result<(), Error> {
+        loop {
+            let window = &self.buffer[self.start..self.end];
+            match find_special(window) {
+                Some(position) => {
+                    let byte = window[position];
+                    self.value.extend_from_slice(&window[..position]);
+                    self.start += position + 1;
+                    match byte {
+                        // A line break ends the field just like a comma does,
+                        // and an empty field between \r and \n is skipped
+                        b',' | b'\n' | b'\r' => return Ok(()),
+                        // Not allowed in an unquoted field, but taken literally
+                        _ => self.value.push(byte),
+                    }
+                }
+                None => {
+                    self.value.extend_from_slice(window);
+                    self.start = self.end;
+                    if self.peek()?.is_none() {
+                        return Ok(());
+                    }
+                }
+            }
+        }
+    }
+
+    fn read_quoted(&mut self) -> Result<(), Error> {
+        loop {
+            let window = &self.buffer[self.start..self.end];
+            match find_special(window) {
+                Some(position) => {
+                    let byte = window[position];
+                    self.value.extend_from_slice(&window[..position]);
+                    self.start += position + 1;
+                    if byte != b'"' {
+                        self.value.push(byte);
+                    } else if self.peek()? == Some(b'"') {
+                        self.value.push(b'"');
+                        self.start += 1;
+                    } else {
+                        return self.skip_to_separator();
+                    }
+                }
+                None => {
+                    self.value.extend_from_slice(window);
+                    self.start = self.end;
+                    if self.peek()?.is_none() {
+                        return Err(Error::new(Status::Failed, "Manifest ends in a quoted field."));
+                    }
+                }
+            }
+        }
+    }
+
+    // Anything between a closing quote and the next separator is ignored
+    fn skip_to_separator(&mut self) -> Result<(), Error> {
+        while let Some(byte) = self.peek()? {
+            self.start += 1;
+            if matches!(byte, b',' | b'\n' | b'\r') {
+                break;
+            }
+        }
+        Ok(())
+    }
+
+    // Returns the next byte without consuming it, reading more if needed.
+    // Reading is timed as part of the parsing, which it is interleaved with.
+    fn peek(&mut self) -> Result<Option<u8>, Error> {
+        if self.start == self.end {
+            let read = loop {
+                match self.reader.read(&mut self.buffer) {
+                    Err(error) if error.kind() == io::ErrorKind::Interrupted => continue,
+                    read => break read,
+                }
+            };
+            self.end = read.map_err(|error| Error::new(Status::ReadFailed, format!("Could not read manifest: {error}")))?;
+            self.start = 0;
+        }
+        Ok((self.start < self.end).then(|| self.buffer[self.start]))
+    }
+}
+
+#[inline]
+fn is_special(byte: u8) -> bool {
+    matches!(byte, b',' | b'\n' | b'\r' | b'"')
+}
+
+/// Finds the first comma, line break or quote, 16 bytes at a time where
+/// the baseline instruction set allows it.
+fn find_special(bytes: &[u8]) -> Option<usize> {
+    let mut chunks = bytes.chunks_exact(16);
+    let mut offset = 0;
+    for chunk in &mut chunks {
+        if let Some(position) = simd::find_special(chunk.try_into().unwrap()) {
+            return Some(offset + position);
+        }
+        offset += 16;
+    }
+    chunks.remainder().iter().position(|&byte| is_special(byte)).map(|position| offset + position)
+}
+
+// SSE2 and NEON are part of the x86_64 and aarch64 baselines, so they need no
+// runtime detection.
+#[cfg(all(target_arch = "x86_64", target_feature = "sse2"))]
+mod simd {
+    use std::arch::x86_64::*;
+
+    #[inline]
+    pub fn find_special(chunk: &[u8; 16]) -> Option<usize> {
+        unsafe {
+            let value = _mm_loadu_si128(chunk.as_ptr() as *const __m128i);
+            let matches = [b',', b'\n', b'\r', b'"']
+                .map(|byte| _mm_cmpeq_epi8(value, _mm_set1_epi8(byte as i8)))
+                .into_iter()
+                .reduce(|a, b| _mm_or_si128(a, b))
+                .unwrap();
+            let mask = _mm_movemask_epi8(matches) as u32;
+            (mask != 0).then(|| mask.trailing_zeros() as usize)
+        }
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+mod simd {
+    use std::arch::aarch64::*;
+
+    #[inline]
+    pub fn find_special(chunk: &[u8; 16]) -> Option<usize> {
+        unsafe {
+            let value = vld1q_u8(chunk.as_ptr());
+            let matches = [b',', b'\n', b'\r', b'"']
+                .map(|byte| vceqq_u8(value, vdupq_n_u8(byte)))
+                .into_iter()
+                .reduce(|a, b| vorrq_u8(a, b))
+                .unwrap();
+            // Most chunks have no match, which one horizontal max tells
+            if vmaxvq_u8(matches) == 0 {
+                return None;
+            }
+            chunk.iter().position(|&byte| super::is_special(byte))
+        }
+    }
+}
+
+#[cfg(not(any(all(target_arch = "x86_64", target_feature = "sse2"), target_arch = "aarch64")))]
+mod simd {
+    #[inline]
+    pub fn find_special(chunk: &[u8; 16]) -> Option<usize> {
+        chunk.iter().position(|&byte| super::is_special(byte))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Manifest;
+    use crate::modules::error::{Error, Status};
+    use std::io::{self, Read};
+
+    // Hands out the manifest at most `size` bytes at a time, so that fields
+    // and quotes are split across reads at every position
+    struct Chunked<'a> {
+        data: &'a [u8],
+        size: usize,
+    }
+
+    impl Read for Chunked<'_> {
+        fn read(&mut self, buffer: &mut [u8]) -> io::Result<usize> {
+            let length = self.size.min(buffer.len()).min(self.data.len());
+            buffer[..length].copy_from_slice(&self.data[..length]);
+            self.data = &self.data[length..];
+            Ok(length)
+        }
+    }
+
+    fn parse(data: &[u8], size: usize) -> Result<Vec<String>, Error> {
+        let mut manifest = Manifest::new(Chunked { data, size });
+        let mut values = Vec::new();
+        while let Some(value) = manifest.next_value()? {
+            values.push(value.to_owned());
+        }
+        Ok(values)
+    }
+
+    fn assert_parses(data: &str, expected: &[&str]) {
+        for size in 1..=data.len() {
+            assert_eq!(parse(data.as_bytes(), size).unwrap(), expected, "{data:?} in reads of {size}");
+        }
+    }
+
+    #[test]
+    fn fields_and_rows() {
+        assert_parses("a.txt,b.txt\nc.txt\n", &["a.txt", "b.txt", "c.txt"]);
+        assert_parses("a.txt,b.txt", &["a.txt", "b.txt"]);
+        assert_parses("", &[]);
+    }
+
+    #[test]
+    fn whitespace_and_empty_fields_are_skipped() {
+        assert_parses(" a.txt , ,\t b c \n\n,\n", &["a.txt", "b c"]);
+    }
+
+    #[test]
+    fn crlf_line_breaks() {
+        assert_parses("a.txt\r\nb.txt\r\n", &["a.txt", "b.txt"]);
+        assert_parses("\"a.txt\"\r\n\"b.txt\"\r\n", &["a.txt", "b.txt"]);
+    }
+
+    #[test]
+    fn quoted_fields() {
+        assert_parses(
+            "\"a, b.txt\",\"say \"\"hi\"\".txt\"\n\"line\r\nbreak.txt\",\" padded \"",
+            &["a, b.txt", "say \"hi\".txt", "line\r\nbreak.txt", " padded "],
+        );
+        assert_parses("\"\"\"\"", &["\""]);
+        // An empty quoted field can't name a file either
+        assert_parses("\"\",a.txt", &["a.txt"]);
+    }
+
+    #[test]
+    fn stray_quotes_are_taken_literally() {
+        // After a closing quote everything up to the separator is ignored,
+        // and a quote inside an unquoted field is part of it
+        assert_parses("\"a.txt\"junk,b\"c.txt\n", &["a.txt", "b\"c.txt"]);
+    }
+
+    #[test]
+    fn long_fields() {
+        let long = "directory/".repeat(20) + "file.txt";
+        let data = format!("{long},\"{long}\"\n{long}");
+        assert_parses(&data, &[&long, &long, &long]);
+    }
+
+    #[test]
+    fn unterminated_quotes_fail() {
+        for size in 1..=10 {
+            let error = parse(b"a.txt,\"b.txt\n", size).unwrap_err();
+            assert_eq!(error.status, Status::Failed);
+        }
+    }
+
+    #[test]
+    fn invalid_utf8_fails() {
+        let error = parse(b"a.txt,b\xFF.txt\n", 64).unwrap_err();
+        assert_eq!(error.status, Status::Failed);
+    }
+}
@@ -0,0 +1,347 @@
+#include "output.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OUTPUT_HAS_WRITE 1
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+// Digits of the largest uint64_t
+#define OUTPUT_MAX_DIGITS 20
+
+struct Output {
+    FILE* stream;
+    OutputFormat format;
+    uint8_t* buffer;
+    size_t length;
+    size_t errors;
+};
+
+// The output that is flushed when the program exits
+static Output* exit_output = NULL;
+
+static void flush_at_exit(void);
+static void append(Output* output, const void* data, size_t length);
+static void append_byte(Output* output, uint8_t byte);
+static void append_string(Output* output, const char* string);
+static void append_decimal(Output* output, uint64_t value);
+static void append_json_string(Output* output, const char* string);
+static void append_le(Output* output, uint64_t value, size_t size);
+static void append_counts(Output* output, Command command, const CountResult* counts, const char* prefix);
+static void append_json_counts(Output* output, Command command, const CountResult* counts);
+static void write_text(Output* output, Command command, const CountResult* result, const CountResult* margin,
+                       const char* filename);
+static void write_ndjson(Output* output, Command command, const CountResult* result, const CountResult* margin,
+                         const char* filename);
+static void write_binary(Output* output, const CountResult* result, const CountResult* margin, const char* filename);
+static void write_all(FILE* stream, const uint8_t* data, size_t length);
+
+Output* output_open(FILE* stream, const OutputFormat format) {
+    Output* output = malloc(sizeof *output);
+    output->stream = stream;
+    output->format = format;
+    output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    output->length = 0;
+    output->errors = 0;
+
+    static bool registered = false;
+    if (!registered) {
+        atexit(flush_at_exit);
+        registered = true;
+    }
+    exit_output = output;
+    return output;
+}
+
+void output_result(Output* output, const Command command, const CountResult* result, const char* filename) {
+    output_estimate(output, command, result, NULL, filename);
+}
+
+void output_estimate(Output* output, const Command command, const CountResult* result, const CountResult* margin,
+                     const char* filename) {
+    switch (output->format) {
+        case OutputFormat_Text:
+            write_text(output, command, result, margin, filename);
+            break;
+        case OutputFormat_Ndjson:
+            write_ndjson(output, command, result, margin, filename);
+            break;
+        case OutputFormat_Binary:
+            write_binary(output, result, margin, filename);
+            break;
+    }
+}
+
+void output_error(Output* output, const char* filename, const char* message) {
+    output->errors++;
+    if (output->format == OutputFormat_Ndjson) {
+        append_string(output, "{\"filename\":");
+        append_json_string(output, filename);
+        append_string(output, ",\"error\":");
+        append_json_string(output, message);
+        append_string(output, "}\n");
+        return;
+    }
+    // After the results before it, in case both streams go to the same place
+    output_flush(output);
+    fprintf(stderr, "%s: %s\n", filename, message);
+}
+
+size_t output_error_count(const Output* output) {
+    return output->errors;
+}
+
+void output_flush(Output* output) {
+    if (output->length == 0) {
+        return;
+    }
+    // Emptied first, so a failed write doesn't write it again on exit
+    const size_t length = output->length;
+    output->length = 0;
+    write_all(output->stream, output->buffer, length);
+}
+
+void output_close(Output* output) {
+    output_flush(output);
+    if (exit_output == output) {
+        exit_output = NULL;
+    }
+    free(output->buffer);
+    free(output);
+}
+
+static void flush_at_exit(void) {
+    if (exit_output) {
+        output_flush(exit_output);
+    }
+}
+
+// Prints what `command` counts, in the same order as wc for `all`, and
+// the margins of an estimate after them
+static void write_text(Output* output, const Command command, const CountResult* result, const CountResult* margin,
+                       const char* filename) {
+    append_counts(output, command, result, "");
+    if (margin) {
+        append_string(output, " (");
+        append_counts(output, command, margin, "\u00b1");
+        append_byte(output, ')');
+    }
+    if (filename) {
+        append_byte(output, ' ');
+        append_string(output, filename);
+    }
+    append_byte(output, '\n');
+}
+
+static void write_ndjson(Output* output, const Command command, const CountResult* result, const CountResult* margin,
+                         const char* filename) {
+    append_byte(output, '{');
+    if (filename) {
+        append_string(output, "\"filename\":");
+        append_json_string(output, filename);
+        append_byte(output, ',');
+    }
+    append_json_counts(output, command, result);
+    if (margin) {
+        append_string(output, ",\"margin\":{");
+        append_json_counts(output, command, margin);
+        append_byte(output, '}');
+    }
+    append_string(output, "}\n");
+}
+
+static void write_binary(Output* output, const CountResult* result, const CountResult* margin, const char* filename) {
+    const size_t filename_length = filename ? strlen(filename) : 0;
+    const CountResult* counts[] = {result, margin};
+    for (size_t i = 0; i < (margin ? 2 : 1); i++) {
+        append_le(output, counts[i]->bytes, 8);
+        append_le(output, counts[i]->characters, 8);
+        append_le(output, counts[i]->lines, 8);
+        append_le(output, counts[i]->words, 8);
+    }
+    append_le(output, filename_length, 4);
+    if (filename) {
+        append(output, filename, filename_length);
+    }
+}
+
+// Separated by spaces, each one after `prefix`
+static void append_counts(Output* output, const Command command, const CountResult* counts, const char* prefix) {
+    switch (command) {
+        case Command_Bytes:
+            append_string(output, prefix);
+            append_decimal(output, counts->bytes);
+            break;
+        case Command_Characters:
+            append_string(output, prefix);
+            append_decimal(output, counts->characters);
+            break;
+        case Command_All: {
+            const uint64_t values[] = {counts->lines, counts->words, counts->characters, counts->bytes};
+            for (size_t i = 0; i < 4; i++) {
+                if (i > 0) {
+                    append_byte(output, ' ');
+                }
+                append_string(output, prefix);
+                append_decimal(output, values[i]);
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "Unrecognized command: %i\n", command);
+            exit(1);
+    }
+}
+
+static void append_json_counts(Output* output, const Command command, const CountResult* counts) {
+    switch (command) {
+        case Command_Bytes:
+            append_string(output, "\"bytes\":");
+            append_decimal(output, counts->bytes);
+            break;
+        case Command_Characters:
+            append_string(output, "\"characters\":");
+            append_decimal(output, counts->characters);
+            break;
+        case Command_All:
+            append_string(output, "\"lines\":");
+            append_decimal(output, counts->lines);
+            append_string(output, ",\"words\":");
+            append_decimal(output, counts->words);
+            append_string(output, ",\"characters\":");
+            append_decimal(output, counts->characters);
+            append_string(output, ",\"bytes\":");
+            append_decimal(output, counts->bytes);
+            break;
+        default:
+            fprintf(stderr, "Unrecognized command: %i\n", command);
+            exit(1);
+    }
+}
+
+static void append(Output* output, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    while (length > OUTPUT_BUFFER_SIZE - output->length) {
+        // Only filenames can be longer than what's left of the buffer
+        const size_t part = OUTPUT_BUFFER_SIZE - output->length;
+        memcpy(output->buffer + output->length, bytes, part);
+        output->length += part;
+        output_flush(output);
+        bytes += part;
+        length -= part;
+    }
+    memcpy(output->buffer + output->length, bytes, length);
+    output->length += length;
+}
+
+static void append_byte(Output* output, const uint8_t byte) {
+    if (output->length == OUTPUT_BUFFER_SIZE) {
+        output_flush(output);
+    }
+    output->buffer[output->length++] = byte;
+}
+
+static void append_string(Output* output, const char* string) {
+    append(output, string, strlen(string));
+}
+
+// Two digits per division, from a table, without printf()'s format parsing
+// and locale handling
+static void append_decimal(Output* output, uint64_t value) {
+    static const char pairs[201] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+    char digits[OUTPUT_MAX_DIGITS];
+    size_t start = OUTPUT_MAX_DIGITS;
+    while (value >= 100) {
+        const size_t pair = (size_t)(value % 100) * 2;
+        value /= 100;
+        digits[--start] = pairs[pair + 1];
+        digits[--start] = pairs[pair];
+    }
+    if (value >= 10) {
+        digits[--start] = pairs[value * 2 + 1];
+        digits[--start] = pairs[value * 2];
+    } else {
+        digits[--start] = (char)('0' + value);
+    }
+    append(output, digits + start, OUTPUT_MAX_DIGITS - start);
+}
+
+// Filenames and messages are UTF-8, which JSON strings can hold as-is, except
+// for quotes, backslashes and control characters
+static void append_json_string(Output* output, const char* string) {
+    static const char hex[] = "0123456789abcdef";
+    append_byte(output, '"');
+    const char* plain = string;
+    for (const char* c = string; *c; c++) {
+        const uint8_t byte = (uint8_t)*c;
+        if (byte >= 0x20 && byte != '"' && byte != '\\') {
+            continue;
+        }
+        append(output, plain, (size_t)(c - plain));
+        plain = c + 1;
+        switch (byte) {
+            case '"':
+                append_string(output, "\\\"");
+                break;
+            case '\\':
+                append_string(output, "\\\\");
+                break;
+            case '\n':
+                append_string(output, "\\n");
+                break;
+            case '\r':
+                append_string(output, "\\r");
+                break;
+            case '\t':
+                append_string(output, "\\t");
+                break;
+            default: {
+                const char escape[] = {'\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 0xf]};
+                append(output, escape, sizeof escape);
+            }
+        }
+    }
+    append_string(output, plain);
+    append_byte(output, '"');
+}
+
+static void append_le(Output* output, const uint64_t value, const size_t size) {
+    uint8_t bytes[8];
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    append(output, bytes, size);
+}
+
+// Bypasses the stream's own buffer, which only ever holds the error message
+// printed before an exit. exit() flushes it after the results.
+static void write_all(FILE* stream, const uint8_t* data, size_t length) {
+#ifdef OUTPUT_HAS_WRITE
+    const int fd = fileno(stream);
+    while (length > 0) {
+        const ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            fprintf(stderr, "Could not write output\n");
+            exit(1);
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+#else
+    if (fwrite(data, 1, length, stream) != length || fflush(stream) != 0) {
+        fprintf(stderr, "Could not write output\n");
+        exit(1);
+    }
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "bindings.h"
+
+#include <stdio.h>
+
+// Writes results to a stream through a buffer of its own, with one write()
+// whenever it's full, instead of a printf() per file. Output that is still
+// buffered when the program exits after an error is written out as well.
+//
+// With OutputFormat_Binary, every result is a record of little-endian
+// integers: the bytes, characters, lines and words as u64, counts that the
+// command doesn't include being 0, then the filename's length as u32, and
+// the filename, which is empty for a single file. The margins of an
+// estimate follow the counts, as four more u64 in the same order.
+typedef struct Output Output;
+
+Output* output_open(FILE* stream, OutputFormat format);
+// `filename` is NULL when there's only one result, which isn't labeled
+void output_result(Output* output, Command command, const CountResult* result, const char* filename);
+// Like output_result(), for counts that are estimated within `margin`
+void output_estimate(Output* output, Command command, const CountResult* result, const CountResult* margin,
+                     const char* filename);
+// Reports a file that couldn't be counted, which is named whether or not its
+// result would be. With OutputFormat_Ndjson, that's a line with "filename"
+// and "error" fields in place of the counts. The other formats only hold
+// results, so the error is printed to stderr instead.
+void output_error(Output* output, const char* filename, const char* message);
+// The number of errors reported so far
+size_t output_error_count(const Output* output);
+void output_flush(Output* output);
+// Flushes the output as well
+void output_close(Output* output);
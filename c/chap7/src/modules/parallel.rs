@@ -0,0 +1,140 @@
+mod ffi {
+    use crate::modules::count::CountResult;
+    use crate::modules::error::{self, Status};
+    use crate::{Command, Utf8Mode};
+    use std::slice;
+
+    /// Writes the count to `result`, or fails like `counter_feed()`.
+    #[no_mangle]
+    pub extern "C" fn count_parallel(
+        data: *const u8,
+        length: usize,
+        command: Command,
+        utf8: Utf8Mode,
+        threads: usize,
+        result: *mut CountResult,
+    ) -> Status {
+        let data = if length == 0 { &[] } else { unsafe { slice::from_raw_parts(data, length) } };
+        error::status(|| super::count_parallel(data, command, utf8, threads).map(|counted| unsafe { *result = counted }))
+    }
+}
+
+use crate::modules::count::{self, CountResult};
+use crate::modules::counter::Counter;
+use crate::modules::error::{self, Error};
+use crate::{Command, Utf8Mode};
+use std::thread;
+
+// Ranges smaller than this aren't worth starting a thread for
+const MIN_RANGE_LENGTH: usize = 256 * 1024;
+
+/// Splits `data` into up to `threads` ranges, counts them in parallel, and
+/// sums up the results.
+pub fn count_parallel(data: &[u8], command: Command, utf8: Utf8Mode, threads: usize) -> Result<CountResult, Error> {
+    let threads = threads.clamp(1, (data.len() / MIN_RANGE_LENGTH).max(1));
+    let ranges = split_ranges(data, threads);
+    if ranges.len() == 1 {
+        return count_range(data, command, utf8, true);
+    }
+
+    thread::scope(|scope| {
+        let handles: Vec<_> = ranges
+            .iter()
+            .enumerate()
+            .map(|(i, range)| {
+                // A word that spans two ranges is counted by the first one
+                let after_space = i == 0 || count::is_space(*ranges[i - 1].last().unwrap());
+                scope.spawn(move || count_range(range, command, utf8, after_space))
+            })
+            .collect();
+        // The error of a range fails the whole count
+        handles.into_iter().map(error::join).sum()
+    })
+}
+
+fn count_range(range: &[u8], command: Command, utf8: Utf8Mode, after_space: bool) -> Result<CountResult, Error> {
+    let mut counter = Counter::continuing(command, utf8, after_space);
+    counter.feed(range)?;
+    counter.finish()
+}
+
+/// Splits `data` into `count` ranges of roughly equal length. The ranges never
+/// start with a continuation byte, so no (valid) UTF-8 sequence is split.
+fn split_ranges(data: &[u8], count: usize) -> Vec<&[u8]> {
+    let mut ranges = Vec::with_capacity(count);
+    let mut start = 0;
+    for i in 1..count {
+        let mut end = (data.len() * i / count).max(start);
+        // A UTF-8 sequence has at most three continuation bytes
+        for _ in 0..3 {
+            if end >= data.len() || !is_continuation(data[end]) {
+                break;
+            }
+            end += 1;
+        }
+        ranges.push(&data[start..end]);
+        start = end;
+    }
+    ranges.push(&data[start..]);
+    ranges
+}
+
+fn is_continuation(byte: u8) -> bool {
+    byte & 0b1100_0000 == 0b1000_0000
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{count_parallel, split_ranges, MIN_RANGE_LENGTH};
+    use crate::modules::counter::Counter;
+    use crate::{Command, Utf8Mode};
+
+    #[test]
+    fn ranges_cover_the_data_in_order() {
+        let data: Vec<u8> = (0..1000u32).map(|i| (i % 251) as u8).collect();
+        for count in 1..=20 {
+            let ranges = split_ranges(&data, count);
+            assert_eq!(ranges.len(), count);
+            assert_eq!(ranges.concat(), data);
+        }
+    }
+
+    #[test]
+    fn ranges_dont_start_with_a_continuation_byte() {
+        let text = "ab€\u{1D11E}é".repeat(50);
+        for count in 1..=40 {
+            for range in split_ranges(text.as_bytes(), count) {
+                assert!(std::str::from_utf8(range).is_ok(), "{count} ranges");
+            }
+        }
+    }
+
+    #[test]
+    fn ranges_of_continuation_bytes_move_on_after_three() {
+        let data = [0x80; 16];
+        let ranges = split_ranges(&data, 4);
+        assert_eq!(ranges.iter().map(|range| range.len()).collect::<Vec<_>>(), [7, 4, 4, 1]);
+    }
+
+    #[test]
+    fn more_ranges_than_bytes_are_empty() {
+        let ranges = split_ranges(b"ab", 5);
+        assert_eq!(ranges.concat(), b"ab");
+        assert_eq!(ranges.iter().filter(|range| !range.is_empty()).count(), 2);
+    }
+
+    #[test]
+    fn parallel_counts_match_a_single_counter() {
+        // Words and sequences across every range boundary
+        let text = "wörds  across\u{1D11E}ranges\n".repeat(4 * MIN_RANGE_LENGTH / 20);
+        for utf8 in [Utf8Mode::Raw, Utf8Mode::Lossy, Utf8Mode::Strict] {
+            let mut counter = Counter::new(Command::All, utf8);
+            counter.feed(text.as_bytes()).unwrap();
+            let expected = counter.finish().unwrap();
+            for threads in [1, 2, 3, 4] {
+                let counted = count_parallel(text.as_bytes(), Command::All, utf8, threads).unwrap();
+                assert_eq!(counted, expected, "{threads} threads");
+            }
+        }
+    }
+}
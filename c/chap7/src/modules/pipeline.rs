@@ -0,0 +1,329 @@
+use crate::modules::count::{self, CountResult};
+use crate::modules::counter::Counter;
+use crate::modules::error::{self, Error};
+use crate::modules::file::{self, CHUNK_SIZE};
+use crate::modules::manifest::ValueQueue;
+use crate::modules::queue::{self, CancelOnPanic, Queue};
+use crate::modules::stats::{self, Phase};
+use crate::modules::trace;
+use crate::{Command, Utf8Mode};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::thread;
+
+// Buffers in the pool per thread, so that every thread can work on one while
+// the next one waits in a queue
+const BUFFERS_PER_THREAD: usize = 2;
+
+// Filenames parsed ahead of the readers
+const VALUES_PER_READER: usize = 16;
+
+/// A piece of a file, in a buffer from the pool.
+struct Chunk {
+    file: usize,
+    buffer: Vec<u8>,
+    length: usize,
+    // Whether the chunk follows whitespace, or starts the file
+    after_space: bool,
+    end: Option<FileEnd>,
+}
+
+struct Counted {
+    file: usize,
+    result: Result<CountResult, Error>,
+    end: Option<FileEnd>,
+}
+
+/// Comes with the last chunk of a file.
+struct FileEnd {
+    filename: String,
+    chunks: usize,
+    // Why the file couldn't be read to the end, in which case the last chunk
+    // is empty
+    error: Option<Error>,
+}
+
+/// Counts the files that `feed` lists in three stages that run at the same
+/// time, connected by bounded queues: `readers` threads read the files in
+/// chunks, `counters` threads count the chunks, and the calling thread adds
+/// up the chunks of each file and passes its result to `emit`, in list order.
+/// `feed` runs on one more thread, ahead of the readers. A file that can't be
+/// counted is passed to `emit` with its error, and the others go on.
+///
+/// The chunks are read into a fixed pool of recycled buffers, so a stage that
+/// falls behind makes the others wait instead of letting memory grow. Only
+/// an error of `feed` fails the whole run.
+pub fn run(
+    feed: impl FnOnce(&ValueQueue, usize, &AtomicBool) -> Result<(), Error> + Send,
+    command: Command,
+    utf8: Utf8Mode,
+    readers: usize,
+    counters: usize,
+    mut emit: impl FnMut(&str, Result<CountResult, Error>),
+) -> Result<(), Error> {
+    let (readers, counters) = (readers.max(1), counters.max(1));
+    let buffer_count = (readers + counters) * BUFFERS_PER_THREAD;
+    let pool = Queue::with_capacity(buffer_count);
+    for _ in 0..buffer_count {
+        let _ = pool.push(vec![0; CHUNK_SIZE]);
+    }
+    let values: ValueQueue = Queue::with_capacity(readers * VALUES_PER_READER);
+    // Every chunk holds a buffer, so there is always room, also for the
+    // markers that stop the next stage
+    let chunks = Queue::with_capacity(buffer_count + counters);
+    let counted = Queue::with_capacity(buffer_count + 1);
+    let readers_left = AtomicUsize::new(readers);
+    let counters_left = AtomicUsize::new(counters);
+    let cancelled = AtomicBool::new(false);
+
+    thread::scope(|scope| {
+        let feeder = scope.spawn(|| {
+            let _guard = CancelOnPanic(&cancelled);
+            queue::cancel_on_error(&cancelled, feed(&values, readers, &cancelled))
+        });
+        for _ in 0..readers {
+            scope.spawn(|| {
+                let _guard = CancelOnPanic(&cancelled);
+                read_files(&values, &pool, &chunks, &cancelled);
+                if readers_left.fetch_sub(1, Ordering::AcqRel) == 1 {
+                    for _ in 0..counters {
+                        let _ = chunks.push_wait(None, &cancelled);
+                    }
+                }
+            });
+        }
+        for _ in 0..counters {
+            scope.spawn(|| {
+                let _guard = CancelOnPanic(&cancelled);
+                count_chunks(command, utf8, &pool, &chunks, &counted, &cancelled);
+                if counters_left.fetch_sub(1, Ordering::AcqRel) == 1 {
+                    let _ = counted.push_wait(None, &cancelled);
+                }
+            });
+        }
+        emit_in_order(&counted, &cancelled, &mut emit);
+        error::join(feeder)
+    })
+}
+
+fn read_files(values: &ValueQueue, pool: &Queue<Vec<u8>>, chunks: &Queue<Option<Chunk>>, cancelled: &AtomicBool) {
+    while let Some(Some((index, filename))) = values.pop_wait(cancelled) {
+        let _span = trace::file_span("read_file", Path::new(&filename));
+        read_file(index, filename, pool, chunks, cancelled);
+    }
+}
+
+fn read_file(index: usize, filename: String, pool: &Queue<Vec<u8>>, chunks: &Queue<Option<Chunk>>, cancelled: &AtomicBool) {
+    let mut file = match file::open(Path::new(&filename)) {
+        Ok(file) => file,
+        Err(error) => {
+            let Some(buffer) = pool.pop_wait(cancelled) else { return };
+            let end = Some(FileEnd { filename, chunks: 1, error: Some(error) });
+            let _ = chunks.push_wait(Some(Chunk { file: index, buffer, length: 0, after_space: true, end }), cancelled);
+            return;
+        }
+    };
+    // The start of a UTF-8 sequence that the previous buffer cut off
+    let mut carry = [0u8; 3];
+    let mut carry_len = 0;
+    let mut after_space = true;
+    let mut count = 0;
+    let mut bytes_read = 0;
+    loop {
+        let Some(mut buffer) = pool.pop_wait(cancelled) else { return };
+        buffer[..carry_len].copy_from_slice(&carry[..carry_len]);
+        // The buffer is kept on an error, to go back to the pool
+        let read = match file::read_full(&mut file, &mut buffer[carry_len..]) {
+            Ok(read) => read,
+            Err(error) => {
+                let end = Some(FileEnd { filename, chunks: count + 1, error: Some(error) });
+                let _ = chunks.push_wait(Some(Chunk { file: index, buffer, length: 0, after_space, end }), cancelled);
+                return;
+            }
+        };
+        bytes_read += read as u64;
+
+        // Only a buffer that isn't full ends the file
+        let mut length = carry_len + read;
+        let last = length < buffer.len();
+        carry_len = if last { 0 } else { incomplete_tail(&buffer[..length]) };
+        length -= carry_len;
+        carry[..carry_len].copy_from_slice(&buffer[length..length + carry_len]);
+
+        count += 1;
+        let next_after_space = buffer[..length].last().map_or(after_space, |&byte| count::is_space(byte));
+        if last {
+            let end = Some(FileEnd { filename, chunks: count, error: None });
+            let _ = chunks.push_wait(Some(Chunk { file: index, buffer, length, after_space, end }), cancelled);
+            stats::add_file(bytes_read);
+            return;
+        }
+        let chunk = Chunk { file: index, buffer, length, after_space, end: None };
+        if chunks.push_wait(Some(chunk), cancelled).is_err() {
+            return;
+        }
+        after_space = next_after_space;
+    }
+}
+
+/// Returns the length of the UTF-8 sequence at the end of `data` that is cut
+/// off, so that every chunk can be validated on its own.
+fn incomplete_tail(data: &[u8]) -> usize {
+    for back in 1..=data.len().min(3) {
+        let byte = data[data.len() - back];
+        if byte & 0b1100_0000 == 0b1000_0000 {
+            continue;
+        }
+        let length = match byte {
+            0xC0..=0xDF => 2,
+            0xE0..=0xEF => 3,
+            0xF0..=0xF7 => 4,
+            _ => 1,
+        };
+        return if length > back { back } else { 0 };
+    }
+    0
+}
+
+fn count_chunks(
+    command: Command,
+    utf8: Utf8Mode,
+    pool: &Queue<Vec<u8>>,
+    chunks: &Queue<Option<Chunk>>,
+    counted: &Queue<Option<Counted>>,
+    cancelled: &AtomicBool,
+) {
+    while let Some(Some(chunk)) = chunks.pop_wait(cancelled) {
+        let start = stats::begin();
+        let mut counter = Counter::continuing(command, utf8, chunk.after_space);
+        let result = counter.feed(&chunk.buffer[..chunk.length]).and_then(|()| counter.finish());
+        stats::end(Phase::Count, start);
+
+        // The pool has room for all buffers
+        let _ = pool.push(chunk.buffer);
+        let counted_chunk = Counted { file: chunk.file, result, end: chunk.end };
+        if counted.push_wait(Some(counted_chunk), cancelled).is_err() {
+            return;
+        }
+    }
+}
+
+fn emit_in_order(
+    counted: &Queue<Option<Counted>>,
+    cancelled: &AtomicBool,
+    emit: &mut impl FnMut(&str, Result<CountResult, Error>),
+) {
+    // For every file from the next one to emit on: the sum of its counted
+    // chunks, or the first error of one, their number, and the end of the
+    // file, once that is counted
+    let mut progress: Vec<(Result<CountResult, Error>, usize, Option<FileEnd>)> = Vec::new();
+    let mut next_emit = 0;
+    while let Some(Some(chunk)) = counted.pop_wait(cancelled) {
+        let slot = chunk.file - next_emit;
+        if slot >= progress.len() {
+            progress.resize_with(slot + 1, || (Ok(CountResult::default()), 0, None));
+        }
+        let (sum, received, end) = &mut progress[slot];
+        match (&mut *sum, chunk.result) {
+            (Ok(sum), Ok(result)) => *sum += result,
+            (Ok(_), Err(error)) => *sum = Err(error),
+            (Err(_), _) => {}
+        }
+        *received += 1;
+        if chunk.end.is_some() {
+            *end = chunk.end;
+        }
+        let ready = progress
+            .iter()
+            .take_while(|(_, received, end)| end.as_ref().is_some_and(|end| *received == end.chunks))
+            .count();
+        for (result, _, end) in progress.drain(..ready) {
+            let end = end.unwrap();
+            emit(&end.filename, end.error.map_or(result, Err));
+        }
+        next_emit += ready;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{incomplete_tail, run, ValueQueue};
+    use crate::modules::counter::Counter;
+    use crate::modules::error::Status;
+    use crate::modules::file::CHUNK_SIZE;
+    use crate::{Command, Utf8Mode};
+    use std::{env, fs, process};
+
+    #[test]
+    fn complete_text_has_no_tail() {
+        assert_eq!(incomplete_tail(b""), 0);
+        assert_eq!(incomplete_tail(b"ascii"), 0);
+        for text in ["é", "€", "\u{1D11E}", "a\u{1D11E}"] {
+            assert_eq!(incomplete_tail(text.as_bytes()), 0, "{text}");
+        }
+    }
+
+    #[test]
+    fn cut_off_sequences_are_the_tail() {
+        for text in ["é", "€", "\u{1D11E}"] {
+            let bytes = format!("ab{text}").into_bytes();
+            for cut in 1..text.len() {
+                assert_eq!(incomplete_tail(&bytes[..bytes.len() - cut]), text.len() - cut, "{text} without {cut}");
+            }
+        }
+    }
+
+    #[test]
+    fn invalid_bytes_arent_carried() {
+        // Continuation bytes without a start, and a start that can't be one
+        assert_eq!(incomplete_tail(b"a\x80\x80\x80"), 0);
+        assert_eq!(incomplete_tail(b"\x80\x80\x80\x80"), 0);
+        assert_eq!(incomplete_tail(b"a\xF8\x80"), 0);
+        // A sequence of two that the data doesn't cut off
+        assert_eq!(incomplete_tail(b"\xC3\x80\x80"), 0);
+    }
+
+    #[test]
+    fn chunks_across_sequences_count_like_the_whole_file() {
+        // Sequences of every length over the chunk boundaries, at every
+        // offset, and a file that can't be opened in between
+        let mut text = String::new();
+        while text.len() < 3 * CHUNK_SIZE {
+            text.push_str("a wörd €uro \u{1D11E}\n");
+        }
+        let directory = env::temp_dir().join(format!("count-pipeline-{}", process::id()));
+        fs::create_dir_all(&directory).unwrap();
+        let mut filenames = Vec::new();
+        for shift in 0..4 {
+            let path = directory.join(format!("text{shift}.txt"));
+            fs::write(&path, &text.as_bytes()[shift..]).unwrap();
+            filenames.push(path.to_str().unwrap().to_owned());
+        }
+        filenames.insert(2, directory.join("missing.txt").to_str().unwrap().to_owned());
+
+        let mut emitted = Vec::new();
+        let listed = filenames.clone();
+        let feed = move |values: &ValueQueue, consumers, cancelled: &_| {
+            for (index, filename) in listed.into_iter().enumerate() {
+                let _ = values.push_wait(Some((index, filename)), cancelled);
+            }
+            for _ in 0..consumers {
+                let _ = values.push_wait(None, cancelled);
+            }
+            Ok(())
+        };
+        run(feed, Command::All, Utf8Mode::Strict, 2, 3, |filename, result| emitted.push((filename.to_owned(), result)))
+            .unwrap();
+        fs::remove_dir_all(&directory).unwrap();
+
+        let emitted_filenames: Vec<_> = emitted.iter().map(|(filename, _)| filename.clone()).collect();
+        assert_eq!(emitted_filenames, filenames);
+        let (_, missing) = emitted.remove(2);
+        assert_eq!(missing.unwrap_err().status, Status::OpenFailed);
+        for (shift, (_, result)) in emitted.into_iter().enumerate() {
+            let mut counter = Counter::new(Command::All, Utf8Mode::Strict);
+            counter.feed(&text.as_bytes()[shift..]).unwrap();
+            assert_eq!(result.unwrap(), counter.finish().unwrap(), "shifted by {shift}");
+        }
+    }
+}
@@ -0,0 +1,251 @@
+mod ffi {
+    use super::BufferPool;
+
+    /// Creates a pool of buffers that are reused from one file to the next.
+    /// A pool may only be used by one thread at a time. Must be released
+    /// with `buffer_pool_free()`.
+    #[no_mangle]
+    pub extern "C" fn buffer_pool_new() -> *mut BufferPool {
+        Box::into_raw(Box::new(BufferPool::new()))
+    }
+
+    /// Returns a buffer of at least `size` bytes, aligned to a cache line,
+    /// whose content is undefined. It is taken from the buffers that were
+    /// released on the calling thread's NUMA node if there is one.
+    #[no_mangle]
+    pub extern "C" fn buffer_pool_alloc(pool: *mut BufferPool, size: usize) -> *mut u8 {
+        let pool = unsafe { &mut *pool };
+        pool.alloc(size)
+    }
+
+    /// Gives a buffer from `buffer_pool_alloc()` back to the pool.
+    #[no_mangle]
+    pub extern "C" fn buffer_pool_release(pool: *mut BufferPool, data: *mut u8) {
+        let pool = unsafe { &mut *pool };
+        pool.release(data);
+    }
+
+    /// Frees the pool, along with the buffers that weren't released.
+    #[no_mangle]
+    pub extern "C" fn buffer_pool_free(pool: *mut BufferPool) {
+        drop(unsafe { Box::from_raw(pool) });
+    }
+}
+
+use std::collections::HashMap;
+use std::ptr::NonNull;
+
+// Sizes are rounded up to a power of two from 64 KiB to 256 MiB, so that a
+// buffer can be reused for any size of its class. Bigger buffers are
+// allocated for every use.
+const MIN_CLASS_SHIFT: u32 = 16;
+const MAX_CLASS_SHIFT: u32 = 28;
+const CLASSES: usize = (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1) as usize;
+// Free buffers that are kept per class and node, more are freed
+const MAX_FREE: usize = 8;
+// Buffers of at least this size are aligned to it, so that the kernel can
+// back them with transparent huge pages, which take 512 times fewer page
+// faults to fill
+const HUGE_PAGE_SIZE: usize = 2 * 1024 * 1024;
+
+/// Buffers for file content, which are kept when they are released, to be
+/// reused for the next file instead of being allocated, and faulted in,
+/// again.
+///
+/// Free buffers are kept per NUMA node. Linux places the pages of a buffer
+/// on the node of the thread that first writes to them, so a buffer that is
+/// reused on the same node stays local to the thread that reads into it.
+/// Since a pool has a single owner, every worker has one of its own, and its
+/// free lists need no locking.
+pub struct BufferPool {
+    // By NUMA node, then by class
+    free: Vec<[Vec<Buffer>; CLASSES]>,
+    // The buffers that were handed out, by address
+    used: HashMap<usize, Buffer>,
+}
+
+struct Buffer {
+    data: NonNull<u8>,
+    size: usize,
+    // The node that it was allocated on, whose free list it goes back to
+    node: usize,
+}
+
+impl BufferPool {
+    pub fn new() -> Self {
+        BufferPool { free: (0..numa::nodes()).map(|_| Default::default()).collect(), used: HashMap::new() }
+    }
+
+    pub fn alloc(&mut self, size: usize) -> *mut u8 {
+        let node = numa::current_node().min(self.free.len() - 1);
+        let buffer = match class(size) {
+            Some(class) => self.free[node][class].pop().unwrap_or_else(|| Buffer::new(class_size(class), node)),
+            None => Buffer::new(size.next_multiple_of(HUGE_PAGE_SIZE), node),
+        };
+        let data = buffer.data.as_ptr();
+        self.used.insert(data as usize, buffer);
+        data
+    }
+
+    pub fn release(&mut self, data: *mut u8) {
+        let buffer = self.used.remove(&(data as usize)).expect("Buffer was not allocated from this pool");
+        // Buffers that are too big for a class don't go back to a free list
+        if let Some(class) = class(buffer.size).filter(|&class| class_size(class) == buffer.size) {
+            let free = &mut self.free[buffer.node][class];
+            if free.len() < MAX_FREE {
+                free.push(buffer);
+            }
+        }
+    }
+}
+
+// None for sizes that are too big to be pooled
+fn class(size: usize) -> Option<usize> {
+    let shift = size.max(1).checked_next_power_of_two()?.trailing_zeros().max(MIN_CLASS_SHIFT);
+    (shift <= MAX_CLASS_SHIFT).then(|| (shift - MIN_CLASS_SHIFT) as usize)
+}
+
+fn class_size(class: usize) -> usize {
+    1 << (class as u32 + MIN_CLASS_SHIFT)
+}
+
+impl Buffer {
+    fn new(size: usize, node: usize) -> Self {
+        Buffer { data: memory::allocate(size), size, node }
+    }
+}
+
+impl Drop for Buffer {
+    fn drop(&mut self) {
+        unsafe { memory::free(self.data, self.size) };
+    }
+}
+
+// Anonymous mappings, which start out as untouched pages, so that they end
+// up on the node of the thread that fills them. Being aligned to pages, they
+// are aligned to cache lines as well.
+#[cfg(unix)]
+mod memory {
+    use super::HUGE_PAGE_SIZE;
+    use std::alloc::{self, Layout};
+    use std::ptr::{self, NonNull};
+
+    pub fn allocate(size: usize) -> NonNull<u8> {
+        if size < HUGE_PAGE_SIZE {
+            return map(size);
+        }
+        // Sizes this big are multiples of a huge page. More is mapped, and
+        // what's around the aligned part is unmapped again.
+        let mapped = map(size + HUGE_PAGE_SIZE).as_ptr() as usize;
+        let start = mapped.next_multiple_of(HUGE_PAGE_SIZE);
+        unsafe {
+            if start > mapped {
+                libc::munmap(mapped as *mut libc::c_void, start - mapped);
+            }
+            libc::munmap((start + size) as *mut libc::c_void, mapped + HUGE_PAGE_SIZE - start);
+            // Only a hint, which kernels without transparent huge pages reject
+            #[cfg(target_os = "linux")]
+            libc::madvise(start as *mut libc::c_void, size, libc::MADV_HUGEPAGE);
+        }
+        NonNull::new(start as *mut u8).unwrap()
+    }
+
+    pub unsafe fn free(data: NonNull<u8>, size: usize) {
+        libc::munmap(data.as_ptr() as *mut libc::c_void, size);
+    }
+
+    fn map(size: usize) -> NonNull<u8> {
+        let protection = libc::PROT_READ | libc::PROT_WRITE;
+        let data = unsafe { libc::mmap(ptr::null_mut(), size, protection, libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1, 0) };
+        if data == libc::MAP_FAILED {
+            alloc::handle_alloc_error(Layout::from_size_align(size, HUGE_PAGE_SIZE).unwrap());
+        }
+        NonNull::new(data as *mut u8).unwrap()
+    }
+}
+
+#[cfg(not(unix))]
+mod memory {
+    use super::HUGE_PAGE_SIZE;
+    use std::alloc::{self, Layout};
+    use std::ptr::NonNull;
+
+    const CACHE_LINE: usize = 64;
+
+    pub fn allocate(size: usize) -> NonNull<u8> {
+        let layout = layout(size);
+        NonNull::new(unsafe { alloc::alloc(layout) }).unwrap_or_else(|| alloc::handle_alloc_error(layout))
+    }
+
+    pub unsafe fn free(data: NonNull<u8>, size: usize) {
+        alloc::dealloc(data.as_ptr(), layout(size));
+    }
+
+    fn layout(size: usize) -> Layout {
+        let align = if size < HUGE_PAGE_SIZE { CACHE_LINE } else { HUGE_PAGE_SIZE };
+        Layout::from_size_align(size, align).unwrap()
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod numa {
+    use std::fs;
+    use std::sync::OnceLock;
+
+    // The node of every CPU, by index
+    static NODES: OnceLock<Vec<usize>> = OnceLock::new();
+
+    pub fn nodes() -> usize {
+        cpu_nodes().iter().max().map_or(1, |&node| node + 1)
+    }
+
+    /// The node of the CPU that the thread runs on, which is 0 where it
+    /// isn't known.
+    pub fn current_node() -> usize {
+        let cpu = unsafe { libc::sched_getcpu() };
+        if cpu < 0 { 0 } else { cpu_nodes().get(cpu as usize).copied().unwrap_or(0) }
+    }
+
+    fn cpu_nodes() -> &'static [usize] {
+        NODES.get_or_init(|| {
+            let mut nodes = Vec::new();
+            let Ok(entries) = fs::read_dir("/sys/devices/system/node") else { return nodes };
+            for entry in entries.flatten() {
+                let name = entry.file_name();
+                let Some(node) = name.to_str().and_then(|name| name.strip_prefix("node")?.parse::<usize>().ok()) else {
+                    continue;
+                };
+                let Ok(cpus) = fs::read_to_string(entry.path().join("cpulist")) else { continue };
+                for cpu in parse_cpu_list(&cpus) {
+                    if nodes.len() <= cpu {
+                        nodes.resize(cpu + 1, 0);
+                    }
+                    nodes[cpu] = node;
+                }
+            }
+            nodes
+        })
+    }
+
+    // Like "0-3,8-11", see cpuset(7)
+    fn parse_cpu_list(list: &str) -> impl Iterator<Item = usize> + '_ {
+        list.trim().split(',').filter(|range| !range.is_empty()).flat_map(|range| {
+            let (first, last) = range.split_once('-').unwrap_or((range, range));
+            match (first.parse::<usize>(), last.parse::<usize>()) {
+                (Ok(first), Ok(last)) => first..last + 1,
+                _ => 0..0,
+            }
+        })
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+mod numa {
+    pub fn nodes() -> usize {
+        1
+    }
+
+    pub fn current_node() -> usize {
+        0
+    }
+}
@@ -0,0 +1,187 @@
+use std::cell::UnsafeCell;
+use std::hint;
+use std::mem::MaybeUninit;
+use std::ops::Deref;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::thread;
+use std::time::Duration;
+
+/// A bounded lock-free queue for any number of producers and consumers
+/// (Dmitry Vyukov's MPMC queue).
+///
+/// Every slot has a sequence number that tells whether it is ready to be
+/// written or read in the current lap, so producers and consumers only
+/// contend on their own index.
+pub struct Queue<T> {
+    slots: Box<[Slot<T>]>,
+    mask: usize,
+    enqueue: CachePadded<AtomicUsize>,
+    dequeue: CachePadded<AtomicUsize>,
+}
+
+struct Slot<T> {
+    sequence: AtomicUsize,
+    value: UnsafeCell<MaybeUninit<T>>,
+}
+
+// Values are moved in and out of the slots by one thread at a time.
+unsafe impl<T: Send> Send for Queue<T> {}
+unsafe impl<T: Send> Sync for Queue<T> {}
+
+impl<T> Queue<T> {
+    /// Creates a queue for at least `capacity` values, rounded up to a power
+    /// of two.
+    pub fn with_capacity(capacity: usize) -> Self {
+        let capacity = capacity.max(2).next_power_of_two();
+        let slots = (0..capacity)
+            .map(|i| Slot { sequence: AtomicUsize::new(i), value: UnsafeCell::new(MaybeUninit::uninit()) })
+            .collect();
+        Queue {
+            slots,
+            mask: capacity - 1,
+            enqueue: CachePadded(AtomicUsize::new(0)),
+            dequeue: CachePadded(AtomicUsize::new(0)),
+        }
+    }
+
+    /// Adds `value` to the queue, or hands it back if the queue is full.
+    pub fn push(&self, value: T) -> Result<(), T> {
+        let mut position = self.enqueue.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[position & self.mask];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+            match sequence.wrapping_sub(position) as isize {
+                0 => match self.enqueue.compare_exchange_weak(position, position + 1, Ordering::Relaxed, Ordering::Relaxed) {
+                    Ok(_) => {
+                        unsafe { (*slot.value.get()).write(value) };
+                        slot.sequence.store(position + 1, Ordering::Release);
+                        return Ok(());
+                    }
+                    Err(current) => position = current,
+                },
+                // The slot still holds a value from the previous lap
+                lag if lag < 0 => return Err(value),
+                _ => position = self.enqueue.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    /// Takes the oldest value from the queue, if there is one.
+    pub fn pop(&self) -> Option<T> {
+        let mut position = self.dequeue.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[position & self.mask];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+            match sequence.wrapping_sub(position + 1) as isize {
+                0 => match self.dequeue.compare_exchange_weak(position, position + 1, Ordering::Relaxed, Ordering::Relaxed) {
+                    Ok(_) => {
+                        let value = unsafe { (*slot.value.get()).assume_init_read() };
+                        slot.sequence.store(position + self.mask + 1, Ordering::Release);
+                        return Some(value);
+                    }
+                    Err(current) => position = current,
+                },
+                // Nothing has been written to the slot in this lap yet
+                lag if lag < 0 => return None,
+                _ => position = self.dequeue.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    /// Like `push()`, but waits while the queue is full. Gives up, and hands
+    /// the value back, once `cancelled` is set.
+    pub fn push_wait(&self, mut value: T, cancelled: &AtomicBool) -> Result<(), T> {
+        let mut backoff = Backoff::new();
+        loop {
+            match self.push(value) {
+                Ok(()) => return Ok(()),
+                Err(rejected) if cancelled.load(Ordering::Relaxed) => return Err(rejected),
+                Err(rejected) => value = rejected,
+            }
+            backoff.wait();
+        }
+    }
+
+    /// Like `pop()`, but waits while the queue is empty. Returns `None` once
+    /// `cancelled` is set.
+    pub fn pop_wait(&self, cancelled: &AtomicBool) -> Option<T> {
+        let mut backoff = Backoff::new();
+        loop {
+            if let Some(value) = self.pop() {
+                return Some(value);
+            }
+            if cancelled.load(Ordering::Relaxed) {
+                return None;
+            }
+            backoff.wait();
+        }
+    }
+}
+
+impl<T> Drop for Queue<T> {
+    fn drop(&mut self) {
+        while self.pop().is_some() {}
+    }
+}
+
+/// Waits a little longer every time: first by spinning, then by yielding to
+/// other threads, and finally by sleeping, so that a thread waiting for a slow
+/// one doesn't keep a core busy.
+pub struct Backoff(u32);
+
+impl Backoff {
+    const SPIN_LIMIT: u32 = 6;
+    const YIELD_LIMIT: u32 = 10;
+
+    pub fn new() -> Self {
+        Backoff(0)
+    }
+
+    pub fn wait(&mut self) {
+        if self.0 < Self::SPIN_LIMIT {
+            for _ in 0..1 << self.0 {
+                hint::spin_loop();
+            }
+        } else if self.0 < Self::YIELD_LIMIT {
+            thread::yield_now();
+        } else {
+            thread::sleep(Duration::from_micros(50));
+            return;
+        }
+        self.0 += 1;
+    }
+}
+
+// Keeps the producer and consumer indices on separate cache lines
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+impl<T> Deref for CachePadded<T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.0
+    }
+}
+
+/// Stops the other threads working on the same queues if the thread panics.
+/// The panic is passed on once all threads have stopped.
+pub struct CancelOnPanic<'a>(pub &'a AtomicBool);
+
+impl Drop for CancelOnPanic<'_> {
+    fn drop(&mut self) {
+        if thread::panicking() {
+            self.0.store(true, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Like `CancelOnPanic`, for a thread that fails with an error, e.g. on a
+/// manifest that can't be read: sets `cancelled` if `result` is an error,
+/// and passes it on.
+pub fn cancel_on_error<T, E>(cancelled: &AtomicBool, result: Result<T, E>) -> Result<T, E> {
+    if result.is_err() {
+        cancelled.store(true, Ordering::Relaxed);
+    }
+    result
+}
@@ -0,0 +1,324 @@
+mod ffi {
+    use super::Server;
+    use crate::modules::cache::Cache;
+    use crate::modules::error;
+    use crate::modules::file;
+    use std::os::raw::c_char;
+
+    /// Serves count requests on the Unix socket at `path` with `workers`
+    /// counting threads, until a client asks the server to shut down. Files
+    /// are looked up in the cache at `cache` first, unless it is NULL. Exits
+    /// with a message if the socket can't be listened on.
+    #[no_mangle]
+    pub extern "C" fn server_run(path: *const c_char, workers: usize, cache: *const c_char) {
+        error::or_exit(|| {
+            let path = unsafe { file::c_path(path) }?;
+            let cache = if cache.is_null() { None } else { Some(Cache::open(unsafe { file::c_path(cache) }?)) };
+            Server::bind(path, cache).map(|server| server.run(workers))
+        });
+    }
+}
+
+use crate::modules::cache::Cache;
+use crate::modules::count::CountResult;
+use crate::modules::counter::Counter;
+use crate::modules::error::{Error, Status};
+use crate::modules::file;
+use crate::{Command, Utf8Mode};
+use std::collections::HashMap;
+use std::fs;
+use std::io::{self, Read, Write};
+use std::mem;
+use std::net::Shutdown;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::slice;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{self, Sender};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+
+// The protocol, which src/modules/client/client.c implements for C. Every
+// message starts with a header, and all fields are in native byte order,
+// since both ends are on the same machine.
+//
+// A request is a RequestHeader followed by `count` filenames, each one a u32
+// length and that many bytes. The response is a ResponseHeader followed by a
+// ResponseRecord for every filename, in request order, each one followed by
+// `message_length` bytes of the message of a file that couldn't be counted.
+const MAGIC: u32 = u32::from_le_bytes(*b"CNT2");
+const KIND_COUNT: u32 = 1;
+const KIND_SHUTDOWN: u32 = 2;
+const STATUS_OK: u32 = 0;
+const STATUS_FAILED: u32 = 1;
+
+// Requests with more files, or longer filenames, are rejected
+const MAX_FILES: u32 = 1 << 20;
+const MAX_FILENAME_LENGTH: u32 = 1 << 16;
+// Longer messages are cut off
+const MAX_MESSAGE_LENGTH: usize = 1 << 16;
+
+#[repr(C)]
+#[derive(Default)]
+struct RequestHeader {
+    magic: u32,
+    kind: u32,
+    command: u32,
+    utf8: u32,
+    count: u32,
+    reserved: u32,
+}
+
+#[repr(C)]
+struct ResponseHeader {
+    magic: u32,
+    status: u32,
+    count: u32,
+    reserved: u32,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct ResponseRecord {
+    status: u32,
+    message_length: u32,
+    result: CountResult,
+}
+
+/// A file to count, which one of the workers picks up.
+struct Task {
+    // Names a file on this machine, whichever bytes it is made of
+    filename: Vec<u8>,
+    command: Command,
+    utf8: Utf8Mode,
+    index: usize,
+    request: Arc<PendingRequest>,
+}
+
+/// The results of a request, and how many of them are still being counted.
+struct PendingRequest {
+    state: Mutex<(Vec<Result<CountResult, Error>>, usize)>,
+    done: Condvar,
+}
+
+impl PendingRequest {
+    fn complete(&self, index: usize, result: Result<CountResult, Error>) {
+        let mut state = self.state.lock().unwrap();
+        state.0[index] = result;
+        state.1 -= 1;
+        if state.1 == 0 {
+            self.done.notify_one();
+        }
+    }
+}
+
+pub struct Server {
+    path: PathBuf,
+    listener: UnixListener,
+    cache: Option<Cache>,
+    stopping: AtomicBool,
+    // Clones of the open connections, to close them on shutdown
+    connections: Mutex<HashMap<usize, UnixStream>>,
+}
+
+impl Server {
+    /// Listens at `path`, replacing a socket that is left over from a server
+    /// that has stopped.
+    pub fn bind(path: &Path, cache: Option<Cache>) -> Result<Self, Error> {
+        let listener = match UnixListener::bind(path) {
+            Err(error) if error.kind() == io::ErrorKind::AddrInUse && UnixStream::connect(path).is_err() => {
+                let _ = fs::remove_file(path);
+                UnixListener::bind(path)
+            }
+            listener => listener,
+        };
+        let listener = listener.map_err(|error| Error::new(Status::OpenFailed, format!("Could not listen on socket: '{}': {error}", path.display())))?;
+        Ok(Server { path: path.to_owned(), listener, cache, stopping: AtomicBool::new(false), connections: Mutex::new(HashMap::new()) })
+    }
+
+    /// Starts the `workers` threads, and handles every connection on a thread
+    /// of its own, which hands the requested files to the workers. Returns
+    /// once a client asks for a shutdown, after writing back the cache.
+    pub fn run(self, workers: usize) {
+        let (sender, receiver) = mpsc::channel::<Task>();
+        let receiver = Mutex::new(receiver);
+        let server = &self;
+
+        thread::scope(|scope| {
+            for _ in 0..workers.max(1) {
+                scope.spawn(|| {
+                    let mut reader = file::Reader::new();
+                    loop {
+                        // The lock is only held while waiting, not while counting
+                        let task = receiver.lock().unwrap().recv();
+                        let Ok(task) = task else { break };
+                        let result = server.count(&mut reader, &task);
+                        task.request.complete(task.index, result);
+                    }
+                });
+            }
+
+            for (id, stream) in server.listener.incoming().enumerate() {
+                if server.stopping.load(Ordering::Acquire) {
+                    break;
+                }
+                let Ok(stream) = stream else { continue };
+                if let Ok(clone) = stream.try_clone() {
+                    server.connections.lock().unwrap().insert(id, clone);
+                }
+                let sender = sender.clone();
+                scope.spawn(move || {
+                    if let Err(error) = server.serve(stream, &sender) {
+                        eprintln!("Connection closed: {error}");
+                    }
+                    server.connections.lock().unwrap().remove(&id);
+                });
+            }
+
+            // Ends the connections, and then the workers, once nothing is left
+            // to send them
+            for (_, connection) in server.connections.lock().unwrap().drain() {
+                let _ = connection.shutdown(Shutdown::Both);
+            }
+            drop(sender);
+        });
+
+        let _ = fs::remove_file(&self.path);
+        if let Some(cache) = self.cache {
+            cache.save();
+        }
+    }
+
+    fn serve(&self, mut stream: UnixStream, sender: &Sender<Task>) -> io::Result<()> {
+        loop {
+            let mut header = RequestHeader::default();
+            match stream.read_exact(as_bytes_mut(slice::from_mut(&mut header))) {
+                Err(error) if error.kind() == io::ErrorKind::UnexpectedEof => return Ok(()),
+                read => read?,
+            }
+            let parsed = (header.magic == MAGIC).then(|| (command_from(header.command), utf8_from(header.utf8)));
+            match (header.kind, parsed) {
+                (KIND_SHUTDOWN, Some(_)) => {
+                    self.stopping.store(true, Ordering::Release);
+                    respond(&mut stream, STATUS_OK, &[])?;
+                    // Wakes up the accepting thread, so it sees the flag
+                    let _ = UnixStream::connect(&self.path);
+                    return Ok(());
+                }
+                (KIND_COUNT, Some((Some(command), Some(utf8)))) if header.count <= MAX_FILES => {
+                    let filenames = read_filenames(&mut stream, header.count)?;
+                    let results = self.count_all(filenames, command, utf8, sender);
+                    respond(&mut stream, STATUS_OK, &results)?;
+                }
+                // The rest of a bad request can't be told from the next one
+                _ => {
+                    respond(&mut stream, STATUS_FAILED, &[])?;
+                    return Ok(());
+                }
+            }
+        }
+    }
+
+    fn count_all(
+        &self,
+        filenames: Vec<Vec<u8>>,
+        command: Command,
+        utf8: Utf8Mode,
+        sender: &Sender<Task>,
+    ) -> Vec<Result<CountResult, Error>> {
+        let count = filenames.len();
+        let request = Arc::new(PendingRequest {
+            state: Mutex::new((vec![Ok(CountResult::default()); count], count)),
+            done: Condvar::new(),
+        });
+        for (index, filename) in filenames.into_iter().enumerate() {
+            let task = Task { filename, command, utf8, index, request: request.clone() };
+            // Only fails once the workers are gone, which leaves the file
+            // uncounted
+            if let Err(mpsc::SendError(task)) = sender.send(task) {
+                task.request.complete(task.index, Err(Error::new(Status::Failed, "The server is shutting down.")));
+            }
+        }
+        let mut state = request.done.wait_while(request.state.lock().unwrap(), |state| state.1 > 0).unwrap();
+        mem::take(&mut state.0)
+    }
+
+    // A file that can't be counted, because it can't be read or isn't valid
+    // UTF-8 in strict mode, only fails its own record.
+    fn count(&self, reader: &mut file::Reader, task: &Task) -> Result<CountResult, Error> {
+        let filename = file::path_from_bytes(&task.filename)?;
+        let Some(cache) = &self.cache else {
+            return count_file(reader, filename, task.command, task.utf8);
+        };
+        let (identity, found) = cache.lookup(filename, task.command, task.utf8)?;
+        if let Some(result) = found {
+            return Ok(result);
+        }
+        let result = count_file(reader, filename, task.command, task.utf8)?;
+        cache.store(&identity, task.command, task.utf8, result);
+        Ok(result)
+    }
+}
+
+fn count_file(reader: &mut file::Reader, filename: &Path, command: Command, utf8: Utf8Mode) -> Result<CountResult, Error> {
+    if command == Command::Bytes {
+        let metadata = fs::metadata(filename).map_err(file::open_failed)?;
+        return Ok(CountResult { bytes: metadata.len(), ..CountResult::default() });
+    }
+    let mut counter = Counter::new(command, utf8);
+    reader.for_each_chunk(filename, |chunk| counter.feed(chunk))?;
+    counter.finish()
+}
+
+fn read_filenames(stream: &mut UnixStream, count: u32) -> io::Result<Vec<Vec<u8>>> {
+    let mut filenames = Vec::with_capacity(count as usize);
+    for _ in 0..count {
+        let mut length = 0u32;
+        stream.read_exact(as_bytes_mut(slice::from_mut(&mut length)))?;
+        if length > MAX_FILENAME_LENGTH {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "filename too long"));
+        }
+        let mut filename = vec![0; length as usize];
+        stream.read_exact(&mut filename)?;
+        filenames.push(filename);
+    }
+    Ok(filenames)
+}
+
+// Writes the whole response at once, so the client gets it in one read where
+// possible
+fn respond(stream: &mut UnixStream, status: u32, results: &[Result<CountResult, Error>]) -> io::Result<()> {
+    let header = ResponseHeader { magic: MAGIC, status, count: results.len() as u32, reserved: 0 };
+    let mut response = Vec::with_capacity(mem::size_of_val(&header) + mem::size_of::<ResponseRecord>() * results.len());
+    response.extend_from_slice(as_bytes(slice::from_ref(&header)));
+    for result in results {
+        let (record, message) = match result {
+            Ok(result) => (ResponseRecord { status: STATUS_OK, message_length: 0, result: *result }, &[][..]),
+            Err(error) => {
+                let message = &error.message.as_bytes()[..error.message.len().min(MAX_MESSAGE_LENGTH)];
+                let record = ResponseRecord { status: STATUS_FAILED, message_length: message.len() as u32, ..ResponseRecord::default() };
+                (record, message)
+            }
+        };
+        response.extend_from_slice(as_bytes(slice::from_ref(&record)));
+        response.extend_from_slice(message);
+    }
+    stream.write_all(&response)
+}
+
+fn command_from(value: u32) -> Option<Command> {
+    [Command::Bytes, Command::Characters, Command::All].into_iter().find(|&command| command as u32 == value)
+}
+
+fn utf8_from(value: u32) -> Option<Utf8Mode> {
+    [Utf8Mode::Raw, Utf8Mode::Lossy, Utf8Mode::Strict].into_iter().find(|&utf8| utf8 as u32 == value)
+}
+
+// Only used for the plain-data types of the protocol
+fn as_bytes<T>(values: &[T]) -> &[u8] {
+    unsafe { slice::from_raw_parts(values.as_ptr() as *const u8, mem::size_of_val(values)) }
+}
+
+fn as_bytes_mut<T>(values: &mut [T]) -> &mut [u8] {
+    unsafe { slice::from_raw_parts_mut(values.as_mut_ptr() as *mut u8, mem::size_of_val(values)) }
+}
@@ -0,0 +1,186 @@
+mod ffi {
+    use super::Phase;
+
+    /// Returns a timestamp for `stats_end()`, or 0 if stats are disabled.
+    #[no_mangle]
+    pub extern "C" fn stats_begin() -> u64 {
+        super::begin()
+    }
+
+    /// Adds the time since `start` to `phase`.
+    #[no_mangle]
+    pub extern "C" fn stats_end(phase: Phase, start: u64) {
+        super::end(phase, start);
+    }
+
+    #[no_mangle]
+    pub extern "C" fn stats_add_file(bytes_read: u64) {
+        super::add_file(bytes_read);
+    }
+
+    /// Prints the collected stats to stderr, if they were enabled.
+    #[no_mangle]
+    pub extern "C" fn stats_print() {
+        super::print();
+    }
+}
+
+use crate::modules::trace;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::fs;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::OnceLock;
+use std::time::Instant;
+
+/// The phases that run time is accounted to. Phases that run on several
+/// threads at once add up the time of all threads.
+/// cbindgen:prefix-with-name
+#[repr(C)]
+#[derive(Clone, Copy)]
+#[allow(dead_code)] // Some phases are only timed from C
+pub enum Phase {
+    Read,
+    Csv,
+    Count,
+    Output,
+    /// Spent by the threads that decompress files for --decompress,
+    /// including reading them
+    Decompress,
+}
+
+const PHASE_NAMES: [&str; 5] = ["read", "csv", "count", "output", "decompress"];
+
+static JSON: AtomicBool = AtomicBool::new(false);
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static EPOCH: OnceLock<Instant> = OnceLock::new();
+static PHASE_NANOS: [AtomicU64; 5] = [const { AtomicU64::new(0) }; 5];
+static FILES: AtomicU64 = AtomicU64::new(0);
+static BYTES_READ: AtomicU64 = AtomicU64::new(0);
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+/// Counts the heap allocations made by the Rust code while stats are
+/// enabled. Otherwise an allocation only reads the flag, instead of every
+/// thread adding to the same counter.
+struct CountingAllocator;
+
+impl CountingAllocator {
+    #[inline]
+    fn count() {
+        if ENABLED.load(Ordering::Relaxed) {
+            ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        Self::count();
+        System.alloc(layout)
+    }
+
+    // Forwarded so that zeroed memory still comes from the system zeroed,
+    // without the default's extra write
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        Self::count();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        Self::count();
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+/// Starts collecting stats, and the wall clock. `json` selects the output format.
+pub fn enable(json: bool) {
+    EPOCH.get_or_init(Instant::now);
+    JSON.store(json, Ordering::Relaxed);
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+#[inline]
+pub fn begin() -> u64 {
+    if ENABLED.load(Ordering::Relaxed) || trace::enabled() { now() } else { 0 }
+}
+
+#[inline]
+pub fn end(phase: Phase, start: u64) {
+    if ENABLED.load(Ordering::Relaxed) {
+        PHASE_NANOS[phase as usize].fetch_add(now().saturating_sub(start), Ordering::Relaxed);
+    }
+    // Every timed phase is a span of the trace as well
+    trace::phase(PHASE_NAMES[phase as usize], start);
+}
+
+pub fn add_file(bytes_read: u64) {
+    if ENABLED.load(Ordering::Relaxed) {
+        FILES.fetch_add(1, Ordering::Relaxed);
+        BYTES_READ.fetch_add(bytes_read, Ordering::Relaxed);
+    }
+}
+
+/// Number of heap allocations made by the Rust code since stats were enabled.
+pub fn allocations() -> u64 {
+    ALLOCATIONS.load(Ordering::Relaxed)
+}
+
+/// Nanoseconds since the stats or the trace were enabled.
+pub fn now() -> u64 {
+    EPOCH.get_or_init(Instant::now).elapsed().as_nanos() as u64
+}
+
+fn print() {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return;
+    }
+    let wall = now();
+    let phases = PHASE_NANOS.each_ref().map(|nanos| nanos.load(Ordering::Relaxed));
+    let files = FILES.load(Ordering::Relaxed);
+    let bytes_read = BYTES_READ.load(Ordering::Relaxed);
+    let allocations = allocations();
+    let peak_rss = peak_rss();
+
+    if JSON.load(Ordering::Relaxed) {
+        let phases: Vec<String> = PHASE_NAMES
+            .iter()
+            .zip(phases)
+            .map(|(name, nanos)| format!("\"{name}\":{nanos}"))
+            .collect();
+        eprintln!(
+            "{{\"wall_ns\":{wall},\"phase_ns\":{{{}}},\"files\":{files},\"bytes_read\":{bytes_read},\"allocations\":{allocations},\"peak_rss_bytes\":{}}}",
+            phases.join(","),
+            peak_rss.map_or("null".to_owned(), |bytes| bytes.to_string()),
+        );
+    } else {
+        eprintln!("wall time:   {:>12.3} ms", millis(wall));
+        for (name, nanos) in PHASE_NAMES.iter().zip(phases) {
+            eprintln!("  {name:<9}  {:>12.3} ms", millis(nanos));
+        }
+        eprintln!("files:       {files:>12}");
+        eprintln!("bytes read:  {bytes_read:>12}");
+        eprintln!("allocations: {allocations:>12}");
+        match peak_rss {
+            Some(bytes) => eprintln!("peak rss:    {:>12} KiB", bytes / 1024),
+            None => eprintln!("peak rss:    {:>12}", "n/a"),
+        }
+    }
+}
+
+fn millis(nanos: u64) -> f64 {
+    nanos as f64 / 1e6
+}
+
+// Only known on Linux, where the kernel tracks it as VmHWM
+fn peak_rss() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    let kib: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kib * 1024)
+}
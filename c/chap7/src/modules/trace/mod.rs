@@ -0,0 +1,193 @@
+mod ffi {
+    use std::ffi::CStr;
+    use std::os::raw::c_char;
+
+    /// Returns a timestamp for `trace_end()`, or 0 if there is no trace.
+    #[no_mangle]
+    pub extern "C" fn trace_begin() -> u64 {
+        super::begin()
+    }
+
+    /// Records a span named `name` from `start` until now, for the file
+    /// `filename` unless it is NULL.
+    #[no_mangle]
+    pub extern "C" fn trace_end(name: *const c_char, filename: *const c_char, start: u64) {
+        if start == 0 {
+            return;
+        }
+        let name = unsafe { CStr::from_ptr(name) }.to_string_lossy().into_owned();
+        let filename = (!filename.is_null()).then(|| unsafe { CStr::from_ptr(filename) }.to_string_lossy());
+        super::record(name.into(), filename.map(Box::from), start);
+    }
+
+    /// Writes the trace, if there is one.
+    #[no_mangle]
+    pub extern "C" fn trace_finish() {
+        super::finish();
+    }
+}
+
+use crate::modules::stats;
+use std::borrow::Cow;
+use std::cell::Cell;
+use std::fmt::Write as _;
+use std::fs;
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use std::sync::{Mutex, OnceLock};
+use std::thread;
+
+// Spans are only recorded by builds with the trace feature. Without it,
+// `begin()` is always 0, and the spans compile to nothing.
+const BUILT: bool = cfg!(feature = "trace");
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static PATH: OnceLock<PathBuf> = OnceLock::new();
+static EVENTS: Mutex<Vec<Event>> = Mutex::new(Vec::new());
+static THREADS: Mutex<Vec<String>> = Mutex::new(Vec::new());
+static NEXT_THREAD: AtomicU32 = AtomicU32::new(0);
+
+thread_local! {
+    // Numbered as threads record their first span
+    static THREAD: Cell<Option<u32>> = const { Cell::new(None) };
+}
+
+struct Event {
+    name: Cow<'static, str>,
+    filename: Option<Box<str>>,
+    thread: u32,
+    start: u64,
+    end: u64,
+}
+
+/// A span of time that is recorded when it is dropped, named after what the
+/// thread did in it, and possibly the file it did it for.
+pub struct Span {
+    name: &'static str,
+    filename: Option<Box<str>>,
+    start: u64,
+}
+
+impl Drop for Span {
+    #[inline]
+    fn drop(&mut self) {
+        if self.start != 0 {
+            record(self.name.into(), self.filename.take(), self.start);
+        }
+    }
+}
+
+/// Records spans from now on, to write them to `path` as a Chrome trace
+/// (the JSON Trace Event Format), which Perfetto and chrome://tracing open,
+/// and Tracy's import-chrome tool converts.
+pub fn enable(path: &Path) {
+    stats::now();
+    let _ = PATH.set(path.to_owned());
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+#[inline]
+pub fn enabled() -> bool {
+    BUILT && ENABLED.load(Ordering::Relaxed)
+}
+
+#[inline]
+pub fn begin() -> u64 {
+    if enabled() { now() } else { 0 }
+}
+
+/// A span for the file `filename`, which is only copied if there is a trace.
+#[inline]
+pub fn file_span(name: &'static str, filename: &Path) -> Span {
+    let start = begin();
+    Span { name, filename: (start != 0).then(|| filename.to_string_lossy().into()), start }
+}
+
+/// Records a span that `stats` timed, which is one of its phases.
+#[inline]
+pub fn phase(name: &'static str, start: u64) {
+    if enabled() {
+        record(name.into(), None, start);
+    }
+}
+
+// On the clock of the stats, but never 0, which stands for no trace
+fn now() -> u64 {
+    stats::now() + 1
+}
+
+fn record(name: Cow<'static, str>, filename: Option<Box<str>>, start: u64) {
+    let end = now();
+    let event = Event { name, filename, thread: thread_number(), start, end };
+    EVENTS.lock().unwrap().push(event);
+}
+
+fn thread_number() -> u32 {
+    THREAD.with(|number| {
+        number.get().unwrap_or_else(|| {
+            let next = NEXT_THREAD.fetch_add(1, Ordering::Relaxed);
+            let current = thread::current();
+            THREADS.lock().unwrap().push(current.name().map_or_else(|| format!("thread {next}"), str::to_owned));
+            number.set(Some(next));
+            next
+        })
+    })
+}
+
+fn finish() {
+    if !enabled() {
+        return;
+    }
+    let events = mem::take(&mut *EVENTS.lock().unwrap());
+    let threads = THREADS.lock().unwrap();
+
+    let mut json = String::from("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (thread, name) in threads.iter().enumerate() {
+        let _ = writeln!(json, "{{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":{thread},\"args\":{{\"name\":{}}}}},", json_string(name));
+    }
+    for event in &events {
+        // Timestamps are in microseconds
+        let _ = write!(
+            json,
+            "{{\"ph\":\"X\",\"name\":{},\"pid\":1,\"tid\":{},\"ts\":{:.3},\"dur\":{:.3}",
+            json_string(&event.name),
+            event.thread,
+            event.start as f64 / 1e3,
+            (event.end - event.start) as f64 / 1e3,
+        );
+        match &event.filename {
+            Some(filename) => {
+                let _ = writeln!(json, ",\"args\":{{\"filename\":{}}}}},", json_string(filename));
+            }
+            None => json.push_str("},\n"),
+        }
+    }
+    // No trailing comma after the last event
+    if json.ends_with(",\n") {
+        json.truncate(json.len() - 2);
+    }
+    json.push_str("\n]}\n");
+
+    let path = PATH.get().unwrap();
+    if let Err(error) = fs::write(path, json) {
+        eprintln!("Could not write trace: '{}': {error}", path.display());
+    }
+}
+
+fn json_string(value: &str) -> String {
+    let mut json = String::with_capacity(value.len() + 2);
+    json.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => json.push_str("\\\""),
+            '\\' => json.push_str("\\\\"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(json, "\\u{:04x}", c as u32);
+            }
+            c => json.push(c),
+        }
+    }
+    json.push('"');
+    json
+}
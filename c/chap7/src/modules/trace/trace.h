@@ -0,0 +1,20 @@
+#pragma once
+
+#include "bindings.h"
+
+// Spans for --trace, around what a thread does for a file. They are only
+// recorded when count is built with COUNT_TRACE, which also builds the Rust
+// library with its trace feature, and compile to nothing otherwise.
+//
+//     TRACE_BEGIN(span);
+//     ...
+//     TRACE_END(span, "name", filename);
+//
+// `name` must be a string literal, `filename` can be NULL.
+#ifdef COUNT_TRACE
+#define TRACE_BEGIN(span) const uint64_t span = trace_begin()
+#define TRACE_END(span, name, filename) trace_end(name, filename, span)
+#else
+#define TRACE_BEGIN(span) ((void) 0)
+#define TRACE_END(span, name, filename) ((void) 0)
+#endif
@@ -0,0 +1,534 @@
+mod ffi {
+    use super::Walk;
+    use crate::modules::count::CountResult;
+    use crate::modules::csv;
+    use crate::modules::dedup::Dedup;
+    use crate::modules::error::{self, Error, Status};
+    use crate::modules::file;
+    use crate::{Command, Utf8Mode};
+    use std::ffi::c_void;
+    use std::os::raw::c_char;
+
+    /// Calls `c_callback` for every regular file in the directory tree at
+    /// `path`, or if `glob` is set, for every file that matches the pattern
+    /// `path`. The tree is walked by several threads, in no particular order,
+    /// while `c_callback` is called from the calling thread. Exits with a
+    /// message if the directory can't be read.
+    #[no_mangle]
+    pub extern "C" fn walk_for_each_file(
+        path: *const c_char,
+        glob: bool,
+        dedup: *const Dedup,
+        c_callback: unsafe extern "C" fn(*const c_char, *const c_void),
+        context: *const c_void,
+    ) {
+        let dedup = unsafe { dedup.as_ref() };
+        error::or_exit(|| {
+            let walk = walk_for(path, glob)?;
+            csv::ffi::for_each_fed_value(
+                Dedup::filter(dedup, move |values, consumers, cancelled| walk.feed(values, consumers, cancelled)),
+                c_callback,
+                context,
+            )
+        });
+    }
+
+    /// Like `csv_for_each_value_parallel()`, for the files that
+    /// `walk_for_each_file()` finds. The list order is the order in which
+    /// they are found.
+    #[no_mangle]
+    pub extern "C" fn walk_for_each_file_parallel(
+        path: *const c_char,
+        glob: bool,
+        dedup: *const Dedup,
+        c_calculate: unsafe extern "C" fn(*const c_char, usize, *const c_void, *mut CountResult) -> Status,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+        jobs: usize,
+        ordered: bool,
+    ) {
+        let dedup = unsafe { dedup.as_ref() };
+        error::or_exit(|| {
+            let walk = walk_for(path, glob)?;
+            csv::ffi::for_each_value_parallel(
+                Dedup::filter(dedup, move |values, consumers, cancelled| walk.feed(values, consumers, cancelled)),
+                c_calculate,
+                c_emit,
+                context,
+                jobs,
+                ordered,
+            )
+        });
+    }
+
+    /// Like `csv_count_pipelined()`, for the files that `walk_for_each_file()`
+    /// finds.
+    #[no_mangle]
+    pub extern "C" fn walk_count_pipelined(
+        path: *const c_char,
+        glob: bool,
+        dedup: *const Dedup,
+        command: Command,
+        utf8: Utf8Mode,
+        readers: usize,
+        counters: usize,
+        c_emit: unsafe extern "C" fn(*const c_char, Status, CountResult, *const c_void),
+        context: *const c_void,
+    ) {
+        let dedup = unsafe { dedup.as_ref() };
+        error::or_exit(|| {
+            let walk = walk_for(path, glob)?;
+            csv::ffi::count_pipelined(
+                Dedup::filter(dedup, move |values, consumers, cancelled| walk.feed(values, consumers, cancelled)),
+                command,
+                utf8,
+                readers,
+                counters,
+                c_emit,
+                context,
+            )
+        });
+    }
+
+    // Listed paths are text, like the ones of a manifest
+    fn walk_for(path: *const c_char, glob: bool) -> Result<Walk, Error> {
+        let path = unsafe { file::c_path_text(path) }?;
+        Ok(if glob { Walk::glob(path) } else { Walk::recursive(path) })
+    }
+}
+
+use crate::modules::error::{self, Error, Status};
+use crate::modules::manifest::ValueQueue;
+use crate::modules::queue::{self, Backoff, CancelOnPanic};
+use crate::modules::stats::{self, Phase};
+use std::collections::VecDeque;
+use std::fs;
+use std::num::NonZeroUsize;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::thread;
+
+// Reading directories is mostly waiting for the file system, which more
+// threads than this don't make any faster
+const MAX_WALKERS: usize = 8;
+
+/// Finds the files in a directory tree, or the ones that match a glob pattern.
+///
+/// Listed paths start with the directory, or for a pattern, with the part of
+/// it that has no wildcards, so they can be opened from the current directory.
+/// Symbolic links are not followed.
+pub struct Walk {
+    // Where the walk starts, empty for the current directory
+    root: String,
+    // The components of the pattern relative to `root`, if there is one
+    pattern: Option<Vec<String>>,
+}
+
+/// A directory that is yet to be read, shared between the walkers.
+struct Directory {
+    path: String,
+    depth: usize,
+}
+
+/// What the walker threads share: a deque of directories for each of them,
+/// which the others steal from once theirs is empty.
+struct Walkers {
+    deques: Box<[Mutex<VecDeque<Directory>>]>,
+    // Directories that were found, but aren't read completely yet
+    pending: AtomicUsize,
+    next_index: AtomicUsize,
+}
+
+impl Walk {
+    pub fn recursive(directory: &str) -> Self {
+        let root = if directory.len() > 1 { directory.trim_end_matches('/') } else { directory };
+        Walk { root: root.to_owned(), pattern: None }
+    }
+
+    /// Supports `*` and `?` within a name, `[...]` and `[!...]` classes, and
+    /// `**` for any number of directories. Like with a shell, wildcards don't
+    /// match names that start with a dot.
+    pub fn glob(pattern: &str) -> Self {
+        let mut components: Vec<&str> = pattern.split('/').collect();
+        // The last component names the files, even if it has no wildcards
+        let literal = components[..components.len() - 1].iter().take_while(|component| !has_wildcards(component)).count();
+        let root = components.drain(..literal).collect::<Vec<_>>().join("/");
+        let root = if root.is_empty() && pattern.starts_with('/') { "/".to_owned() } else { root };
+        let pattern = components.into_iter().filter(|component| !component.is_empty()).map(str::to_owned).collect();
+        Walk { root, pattern: Some(pattern) }
+    }
+
+    /// Walks the tree with several threads, handing each file found to one of
+    /// `consumers` threads through `values`, and then a `None` to each of them.
+    /// The calling thread is one of the walkers. Fails if the root can't be
+    /// read.
+    pub fn feed(self, values: &ValueQueue, consumers: usize, cancelled: &AtomicBool) -> Result<(), Error> {
+        let walkers = thread::available_parallelism().map_or(1, NonZeroUsize::get).min(MAX_WALKERS);
+        let shared = Walkers {
+            deques: (0..walkers).map(|_| Mutex::new(VecDeque::new())).collect(),
+            pending: AtomicUsize::new(1),
+            next_index: AtomicUsize::new(0),
+        };
+        shared.deques[0].lock().unwrap().push_back(Directory { path: self.root.clone(), depth: 0 });
+
+        thread::scope(|scope| {
+            let handles: Vec<_> = (1..walkers)
+                .map(|walker| {
+                    let (walk, shared) = (&self, &shared);
+                    scope.spawn(move || {
+                        let _guard = CancelOnPanic(cancelled);
+                        queue::cancel_on_error(cancelled, walk.run(walker, shared, values, cancelled))
+                    })
+                })
+                .collect();
+            let _guard = CancelOnPanic(cancelled);
+            let walked = queue::cancel_on_error(cancelled, self.run(0, &shared, values, cancelled));
+            // Any walker may be the one that fails to read the root
+            handles.into_iter().map(error::join).fold(walked, Result::and)
+        })?;
+        for _ in 0..consumers {
+            let _ = values.push_wait(None, cancelled);
+        }
+        Ok(())
+    }
+
+    fn run(&self, walker: usize, shared: &Walkers, values: &ValueQueue, cancelled: &AtomicBool) -> Result<(), Error> {
+        let mut backoff = Backoff::new();
+        while !cancelled.load(Ordering::Relaxed) {
+            match shared.next_directory(walker) {
+                Some(directory) => {
+                    self.read_directory(directory, walker, shared, values, cancelled)?;
+                    shared.pending.fetch_sub(1, Ordering::AcqRel);
+                    backoff = Backoff::new();
+                }
+                // Another walker may still find more directories
+                None if shared.pending.load(Ordering::Acquire) > 0 => backoff.wait(),
+                None => break,
+            }
+        }
+        Ok(())
+    }
+
+    fn read_directory(
+        &self,
+        directory: Directory,
+        walker: usize,
+        shared: &Walkers,
+        values: &ValueQueue,
+        cancelled: &AtomicBool,
+    ) -> Result<(), Error> {
+        let start = stats::begin();
+        let entries = match fs::read_dir(if directory.path.is_empty() { "." } else { &directory.path }) {
+            Ok(entries) => entries,
+            Err(error) if directory.depth == 0 => {
+                return Err(Error::new(Status::OpenFailed, format!("Could not read directory: '{}': {error}", directory.path)));
+            }
+            // Like find, skip what can't be read, and carry on with the rest
+            Err(error) => {
+                eprintln!("Could not read directory: '{}': {error}", directory.path);
+                return Ok(());
+            }
+        };
+        let mut found = Vec::new();
+        for entry in entries {
+            let Ok(entry) = entry else { continue };
+            let Ok(file_type) = entry.file_type() else { continue };
+            let name = entry.file_name();
+            let Some(name) = name.to_str() else {
+                eprintln!("Skipping path that is not valid UTF-8: '{}'", entry.path().display());
+                continue;
+            };
+            let path = match directory.path.as_str() {
+                "" => name.to_owned(),
+                parent if parent.ends_with('/') => format!("{parent}{name}"),
+                parent => format!("{parent}/{name}"),
+            };
+            if file_type.is_dir() && self.may_contain(&path) {
+                shared.pending.fetch_add(1, Ordering::AcqRel);
+                shared.deques[walker].lock().unwrap().push_back(Directory { path, depth: directory.depth + 1 });
+            } else if file_type.is_file() && self.matches(&path) {
+                found.push(path);
+            }
+        }
+        stats::end(Phase::Csv, start);
+
+        for path in found {
+            let index = shared.next_index.fetch_add(1, Ordering::Relaxed);
+            if values.push_wait(Some((index, path)), cancelled).is_err() {
+                break;
+            }
+        }
+        Ok(())
+    }
+
+    // The components of `path` below the root
+    fn relative<'a>(&self, path: &'a str) -> impl Iterator<Item = &'a str> {
+        let skip = self.root.len() + (!self.root.is_empty() && !self.root.ends_with('/')) as usize;
+        path[skip..].split('/')
+    }
+
+    fn matches(&self, path: &str) -> bool {
+        let Some(pattern) = &self.pattern else { return true };
+        let path: Vec<&str> = self.relative(path).collect();
+        matches_components(pattern, &path)
+    }
+
+    fn may_contain(&self, directory: &str) -> bool {
+        let Some(pattern) = &self.pattern else { return true };
+        let directory: Vec<&str> = self.relative(directory).collect();
+        may_contain(pattern, &directory)
+    }
+}
+
+impl Walkers {
+    // Takes the most recently found directory of the walker's own deque, which
+    // keeps its walk depth-first, or else the oldest one of another walker,
+    // which is likely to hold the most work.
+    fn next_directory(&self, walker: usize) -> Option<Directory> {
+        if let Some(directory) = self.deques[walker].lock().unwrap().pop_back() {
+            return Some(directory);
+        }
+        let count = self.deques.len();
+        (1..count).find_map(|offset| self.deques[(walker + offset) % count].lock().unwrap().pop_front())
+    }
+}
+
+fn has_wildcards(component: &str) -> bool {
+    component.contains(['*', '?', '['])
+}
+
+fn matches_components(pattern: &[String], path: &[&str]) -> bool {
+    match pattern.split_first() {
+        None => path.is_empty(),
+        Some((first, rest)) if first == "**" => {
+            // Any number of directories, but no hidden ones
+            (0..=path.len())
+                .take_while(|&skip| skip == 0 || !path[skip - 1].starts_with('.'))
+                .any(|skip| matches_components(rest, &path[skip..]))
+        }
+        Some((first, rest)) => match path.split_first() {
+            Some((name, path)) => matches_name(first.as_bytes(), name.as_bytes()) && matches_components(rest, path),
+            None => false,
+        },
+    }
+}
+
+// Whether files below `directory` can match `pattern`, so it is worth reading
+fn may_contain(pattern: &[String], directory: &[&str]) -> bool {
+    match (pattern.split_first(), directory.split_first()) {
+        (None, _) => false,
+        (Some((first, _)), _) if first == "**" => directory.iter().all(|name| !name.starts_with('.')),
+        (Some(_), None) => true,
+        (Some((first, rest)), Some((name, directory))) => {
+            matches_name(first.as_bytes(), name.as_bytes()) && may_contain(rest, directory)
+        }
+    }
+}
+
+fn matches_name(pattern: &[u8], name: &[u8]) -> bool {
+    if name.first() == Some(&b'.') && pattern.first() != Some(&b'.') {
+        return false;
+    }
+    // Positions to go back to on a mismatch: after the last `*`, and the part
+    // of the name that it matches so far
+    let (mut p, mut n) = (0, 0);
+    let mut backtrack = None;
+    while n < name.len() {
+        match pattern.get(p) {
+            Some(b'*') => {
+                backtrack = Some((p + 1, n));
+                p += 1;
+                continue;
+            }
+            Some(b'?') => {
+                p += 1;
+                n += 1;
+                continue;
+            }
+            Some(b'[') => {
+                if let Some((matched, length)) = match_class(&pattern[p..], name[n]) {
+                    if matched {
+                        p += length;
+                        n += 1;
+                        continue;
+                    }
+                } else if name[n] == b'[' {
+                    // An unclosed bracket is taken literally
+                    p += 1;
+                    n += 1;
+                    continue;
+                }
+            }
+            Some(&byte) if byte == name[n] => {
+                p += 1;
+                n += 1;
+                continue;
+            }
+            _ => {}
+        }
+        match backtrack {
+            Some((star, matched)) => {
+                p = star;
+                n = matched + 1;
+                backtrack = Some((star, matched + 1));
+            }
+            None => return false,
+        }
+    }
+    pattern[p..].iter().all(|&byte| byte == b'*')
+}
+
+// Matches `byte` against the class at the start of `pattern`, and returns
+// whether it matched and the length of the class, or `None` if it isn't closed
+fn match_class(pattern: &[u8], byte: u8) -> Option<(bool, usize)> {
+    let negated = matches!(pattern.get(1), Some(b'!' | b'^'));
+    let mut i = 1 + negated as usize;
+    let mut matched = false;
+    let mut first = true;
+    loop {
+        match *pattern.get(i)? {
+            // A `]` right after the opening bracket is part of the class
+            b']' if !first => return Some((matched != negated, i + 1)),
+            low => {
+                if pattern.get(i + 1) == Some(&b'-') && pattern.get(i + 2).is_some_and(|&high| high != b']') {
+                    matched |= (low..=pattern[i + 2]).contains(&byte);
+                    i += 3;
+                } else {
+                    matched |= low == byte;
+                    i += 1;
+                }
+            }
+        }
+        first = false;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{matches_name, Walk};
+    use crate::modules::manifest::ValueQueue;
+    use crate::modules::queue::Queue;
+    use std::sync::atomic::AtomicBool;
+    use std::{env, fs, process};
+
+    fn matches(pattern: &str, name: &str) -> bool {
+        matches_name(pattern.as_bytes(), name.as_bytes())
+    }
+
+    fn matches_path(pattern: &str, path: &str) -> bool {
+        Walk::glob(pattern).matches(path)
+    }
+
+    #[test]
+    fn stars_and_question_marks() {
+        assert!(matches("*", "file.txt"));
+        assert!(matches("*.txt", "file.txt"));
+        assert!(!matches("*.txt", ".txt.txt"));
+        assert!(matches("f*e*.txt", "file.txt"));
+        assert!(matches("*a*a*", "banana"));
+        assert!(!matches("*.txt", "file.md"));
+        assert!(!matches("*.txt", "file.txt.md"));
+        assert!(matches("file.???", "file.txt"));
+        assert!(!matches("file.??", "file.txt"));
+        assert!(matches("file.txt", "file.txt"));
+        assert!(!matches("file.txt", "file.txtx"));
+        assert!(matches("file*", "file"));
+    }
+
+    #[test]
+    fn classes() {
+        assert!(matches("[abc].txt", "b.txt"));
+        assert!(!matches("[abc].txt", "d.txt"));
+        assert!(matches("[a-c][0-9].txt", "c7.txt"));
+        assert!(!matches("[a-c][0-9].txt", "c.txt"));
+        assert!(matches("[!abc].txt", "d.txt"));
+        assert!(!matches("[^abc].txt", "a.txt"));
+        // A leading `]` or a trailing `-` is part of the class
+        assert!(matches("[]x].txt", "].txt"));
+        assert!(matches("[a-].txt", "-.txt"));
+        // An unclosed bracket is taken literally
+        assert!(matches("[ab", "[ab"));
+        assert!(!matches("[ab", "a"));
+    }
+
+    #[test]
+    fn wildcards_dont_match_hidden_names() {
+        assert!(!matches("*", ".hidden"));
+        assert!(!matches("?hidden", ".hidden"));
+        assert!(!matches("[.]hidden", ".hidden"));
+        assert!(matches(".*", ".hidden"));
+        assert!(matches(".hidden", ".hidden"));
+    }
+
+    #[test]
+    fn double_stars_match_any_number_of_directories() {
+        assert!(matches_path("src/**/*.rs", "src/lib.rs"));
+        assert!(matches_path("src/**/*.rs", "src/modules/file/mod.rs"));
+        assert!(!matches_path("src/**/*.rs", "src/modules/file.c"));
+        assert!(matches_path("**", "src/lib.rs"));
+        assert!(matches_path("src/**/mod.rs", "src/a/b/c/mod.rs"));
+        // ... but not hidden ones
+        assert!(!matches_path("src/**/*.rs", "src/.git/hooks.rs"));
+        assert!(matches_path("src/.git/*.rs", "src/.git/hooks.rs"));
+    }
+
+    #[test]
+    fn wildcards_stay_within_a_component() {
+        assert!(!matches_path("src/*.rs", "src/modules/count.rs"));
+        assert!(matches_path("src/*/count.rs", "src/modules/count.rs"));
+        assert!(!matches_path("src/*/count.rs", "src/count.rs"));
+    }
+
+    #[test]
+    fn only_directories_that_may_contain_matches_are_read() {
+        let walk = Walk::glob("src/*/file/*.c");
+        assert!(walk.may_contain("src/modules"));
+        assert!(walk.may_contain("src/modules/file"));
+        assert!(!walk.may_contain("src/modules/loader"));
+        assert!(!walk.may_contain("src/modules/file/more"));
+        let walk = Walk::glob("src/**/*.c");
+        assert!(walk.may_contain("src/a/b/c"));
+        assert!(!walk.may_contain("src/a/.b"));
+    }
+
+    #[test]
+    fn walks_start_at_the_literal_part_of_the_pattern() {
+        assert_eq!(Walk::glob("src/modules/*.rs").root, "src/modules");
+        assert_eq!(Walk::glob("src/*/count.rs").root, "src");
+        assert_eq!(Walk::glob("*.rs").root, "");
+        assert_eq!(Walk::glob("/tmp/*").root, "/tmp");
+        assert_eq!(Walk::glob("/*").root, "/");
+        assert_eq!(Walk::glob("src/lib.rs").pattern.unwrap(), ["lib.rs"]);
+        assert_eq!(Walk::recursive("src/").root, "src");
+        assert_eq!(Walk::recursive("/").root, "/");
+    }
+
+    #[test]
+    fn walks_find_the_matching_files() {
+        let directory = env::temp_dir().join(format!("count-walk-{}", process::id()));
+        let root = directory.to_str().unwrap().to_owned();
+        for path in ["a.txt", "b.md", ".c.txt", "sub/d.txt", "sub/deeper/e.txt", ".hidden/f.txt"] {
+            let path = directory.join(path);
+            fs::create_dir_all(path.parent().unwrap()).unwrap();
+            fs::write(path, "").unwrap();
+        }
+        let walk = |walk: Walk| {
+            let values: ValueQueue = Queue::with_capacity(64);
+            walk.feed(&values, 1, &AtomicBool::new(false)).unwrap();
+            let mut found = Vec::new();
+            while let Some(Some((_, path))) = values.pop() {
+                found.push(path.strip_prefix(&root).unwrap().to_owned());
+            }
+            found.sort();
+            found
+        };
+
+        assert_eq!(walk(Walk::glob(&format!("{root}/*.txt"))), ["/a.txt"]);
+        assert_eq!(walk(Walk::glob(&format!("{root}/**/*.txt"))), ["/a.txt", "/sub/d.txt", "/sub/deeper/e.txt"]);
+        assert_eq!(
+            walk(Walk::recursive(&format!("{root}/"))),
+            ["/.c.txt", "/.hidden/f.txt", "/a.txt", "/b.md", "/sub/d.txt", "/sub/deeper/e.txt"]
+        );
+        fs::remove_dir_all(&directory).unwrap();
+    }
+}